@@ -1,14 +1,54 @@
 #include <vector>
+#include <algorithm>
 #include <map>
+#include <memory>
 #include <shared_mutex>
+#include <mutex>
+#include <atomic>
 #include <chrono>
+#include <string>
+#include <optional>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <fstream>
+#include <memory_resource>
+#include <string_view>
+#include <charconv>
+#include <new>
+#include <exception>
+#include <cstdio> // rename
+
+// Shared memory export.
+#include <sys/mman.h> // shm_open, mmap
+#include <sys/stat.h> // mode constants
+#include <fcntl.h>    // O_* constants
+
+// Front end.
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>        // iovec
+#include <linux/errqueue.h> // MSG_ZEROCOPY completions
+#include <cerrno>
+#include <cstdlib>
+
+// Pinned threads.
+#include <pthread.h>
+#include <sched.h>
 
 // Testing
 #include <iostream> // cout
 #include <unistd.h> // sleep
 
 // Compile with:
-// g++ --std=c++17 rplace.cpp -o rplace
+// g++ --std=c++17 -pthread rplace.cpp -o rplace
+//
+// Add -DRPLACE_COUNT_ALLOCATIONS to count heap allocations per request, for `rplace bench` (see `heapAllocations`).
 
 // Forward declarations cause everything's in one file.
 class Place;
@@ -39,6 +79,11 @@ class Pixel {
 
     // Probably black, current /r/place uses white. Could change with actual colors.
     static constexpr uint64_t defaultColor = 0;
+
+    // The default color from userID 0 is what a blank pixel looks like (i.e., in a Snapshot), so writing exactly that
+    // puts a pixel back to blank: nobody placed it and nobody owns it. This is how `Place::revert` restores pixels
+    // that hadn't been written yet, and it's a property of the record, so replaying the log gives the same result.
+    bool isBlank() const {return color == defaultColor && userID == 0;}
 };
 
 // What's the schema for a change look like?
@@ -68,167 +113,7526 @@ class Update {
 };
 
 // A snapshot is the current state of the Place after a particular number of changes.
+//
+// The grid is stored as square tiles, shared between snapshots and copied on write. Copying a Snapshot only copies
+// tile pointers, and the first write to a tile that's shared with another snapshot makes a private copy of just that
+// tile. Only tiles that have been written to are stored at all, in a hash map by tile coordinates, everywhere else
+// reads as a single shared blank tile. So memory (and the cost of a copy) goes with the painted area rather than the
+// size of the grid, and `expand` is free. Coordinates are 64 bits, tile coordinates have to fit in 32.
 class Snapshot {
   public:
-    const uint64_t width;
-    const uint64_t height;
+    // Tiles are `tileSize` on a side.
+    static constexpr uint64_t tileSize = 64;
+
+    // What's stored for each pixel. The coordinates are implied by the position.
+    struct Cell {
+        uint64_t color;
+        uint64_t userID;
+    };
+
+    struct Tile {
+        Cell cells[tileSize * tileSize];
+    };
+
+    uint64_t width;
+    uint64_t height;
 
-    // The entire set of pixels requires to make up a Place.
-    std::vector<Pixel> pixels;
-    
     // This is the count in the update stream for this snapshot.
     uint64_t recordNumber;
 
+    // Which palette the colors are in, see `Place::setPalette`.
+    uint64_t paletteEpoch = 0;
+
     // Default constructor.
     Snapshot(uint64_t width, uint64_t height);
 
     // Apply a set of updates to a Snapshot. This takes everything from `recordNumber` (inclusive) forward and applies
     // it to this Snapshot.
-    void apply(const std::vector<const Update>& updates);
+    void apply(const std::vector<Update>& updates);
+
+    // Grows the grid to the given size (it never shrinks). The new area is blank, which costs nothing.
+    void expand(uint64_t newWidth, uint64_t newHeight);
+
+    // The tile at the given tile coordinates (i.e., pixel coordinates divided by `tileSize`). For reading a lot of
+    // pixels, looking up each tile once is much cheaper than `getCell` for every pixel.
+    const Tile& getTile(uint64_t tileX, uint64_t tileY) const {
+        auto it = tiles.find(tileKey(tileX, tileY));
+        return it == tiles.end() ? *blankTile() : *it->second;
+    }
+
+    const Cell& getCell(uint64_t x, uint64_t y) const {
+        return getTile(x / tileSize, y / tileSize).cells[(y % tileSize) * tileSize + x % tileSize];
+    }
+
+    Pixel getPixel(uint64_t x, uint64_t y) const {
+        const Cell& cell = getCell(x, y);
+        return Pixel(x, y, cell.color, cell.userID);
+    }
+
+    // Writes a single pixel, copying its tile first if it's shared.
+    void set(const Pixel& p);
+
+    // Replaces every color `c` with `remap[c]` (colors past the end of `remap` are left alone), and moves to the given
+    // palette epoch. Shared tiles are copied first, so other snapshots keep the colors they had. `remap[0]` has to be
+    // the default color, as blank tiles aren't touched.
+    void remapColors(const std::vector<uint64_t>& remap, uint64_t newPaletteEpoch);
+
+    // Approximate bytes used by this snapshot's tiles, counting shared tiles as if they were ours.
+    uint64_t memoryUsage() const;
+
+  private:
+    // The one tile every snapshot uses for areas that haven't been written to.
+    static const std::shared_ptr<Tile>& blankTile();
+
+    static uint64_t tileKey(uint64_t tileX, uint64_t tileY) {return (tileY << 32) | tileX;}
+
+    // Only tiles that have been written to, by `tileKey`.
+    std::unordered_map<uint64_t, std::shared_ptr<Tile>> tiles;
 };
 
+const std::shared_ptr<Snapshot::Tile>& Snapshot::blankTile() {
+    static const std::shared_ptr<Tile> blank = [] {
+        auto tile = std::make_shared<Tile>();
+        for (Cell& cell : tile->cells) {
+            cell = {Pixel::defaultColor, 0};
+        }
+        return tile;
+    }();
+    return blank;
+}
+
 Snapshot::Snapshot(uint64_t width, uint64_t height) :
-    width(width),
-    height(height),
+    width(0),
+    height(0),
     recordNumber(0)
 {
-    // Allocate a bunch of data.
-    pixels.reserve(width * height);
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            pixels.emplace_back(x, y, 0, Pixel::defaultColor);
+    expand(width, height);
+}
+
+void Snapshot::expand(uint64_t newWidth, uint64_t newHeight) {
+    width = std::max(width, newWidth);
+    height = std::max(height, newHeight);
+}
+
+void Snapshot::set(const Pixel& p) {
+    std::shared_ptr<Tile>& tile = tiles[tileKey(p.getX() / tileSize, p.getY() / tileSize)];
+
+    // If anybody else can see this tile (another snapshot), it's not ours to change. Nobody can start sharing a tile
+    // that only we hold, so if the count is one, it stays one.
+    if (!tile) {
+        tile = std::make_shared<Tile>(*blankTile());
+    } else if (tile.use_count() > 1) {
+        tile = std::make_shared<Tile>(*tile);
+    } else {
+        // If another snapshot just let go of this tile, make sure its last reads of it happen before our write.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    tile->cells[(p.getY() % tileSize) * tileSize + p.getX() % tileSize] = {p.getColor(), p.getUserID()};
+}
+
+void Snapshot::remapColors(const std::vector<uint64_t>& remap, uint64_t newPaletteEpoch) {
+    for (auto& [key, tile] : tiles) {
+        // Same as `set`.
+        if (tile.use_count() > 1) {
+            tile = std::make_shared<Tile>(*tile);
+        } else {
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        for (Cell& cell : tile->cells) {
+            cell.color = cell.color < remap.size() ? remap[cell.color] : cell.color;
         }
     }
+    paletteEpoch = newPaletteEpoch;
+}
+
+uint64_t Snapshot::memoryUsage() const {
+    // A rough cost for a hash map node, there's no way to ask.
+    static constexpr uint64_t mapEntrySize = 48;
+    return tiles.size() * (mapEntrySize + sizeof(Tile));
 }
 
-void Snapshot::apply(const std::vector<const Update>& updates) {
+void Snapshot::apply(const std::vector<Update>& updates) {
     // TODO: Minor optimization, I think this reapplies the first item in this set even though it's already applied.
     for (size_t i = recordNumber; i < updates.size(); i++) {
-        pixels[updates[i].pixel.getY() * width + updates[i].pixel.getX()] = updates[i].pixel;
+        set(updates[i].pixel);
     }
     recordNumber = updates.size();
 }
 
-class Place {
-  public:
+// The shared memory export lets other processes on the same host (renderers, edge servers) map the most recently
+// published Snapshot read-only, without a copy over a socket and without a syscall per read.
+//
+// The region holds two "slots", each a full compact copy of the grid. The writer always fills the slot that readers
+// are *not* pointed at, then flips `latestSlot`. Each slot has its own sequence number that works as a seqlock: it's
+// odd while the slot is being written and even when it's stable, so a reader that raced with the writer can tell and
+// try again. With two slots, that only happens if a reader is slower than two whole publishes.
+//
+// Only color and userID are stored, the coordinates are implied by the position in the slot, so this takes 16 bytes
+// per pixel rather than 32.
+struct SharedPixel {
+    uint64_t color;
+    uint64_t userID;
+};
 
-    // This gets the current representation of the Place.
-    Snapshot getCurrentState();
+struct SharedSlotHeader {
+    // Odd while being written, even while stable.
+    std::atomic<uint64_t> sequence;
+    uint64_t recordNumber;
+};
 
-    // Applies the update specified in the given pixel. Returns true if success, false if failure.
-    // Failure cases can be:
-    // 1. The pixel doesn't fit in the Place.
-    // 2. The user has written to the Place too recently.
-    bool update(const Pixel& p);
+struct SharedSnapshotHeader {
+    uint64_t magic;
+    uint64_t width;
+    uint64_t height;
+    std::atomic<uint64_t> latestSlot;
 
-    // TODO:
-    // void save(); write to a file. Can work in batches appending chunks of updates.
-    // void load(); opposite of serialize. Load from a saved file.
-    // std::vector<const Update> getDiff(size_t fromUpdateNumber); // Returns the difference since a particular update.
+    // Set once the writer is done with this region, i.e., because the Place was expanded and the grid no longer fits.
+    // Readers should close it and open the region by name again.
+    std::atomic<uint64_t> retired;
+    SharedSlotHeader slots[2];
 
-    // The dimensions are fixed, though you could create a new Place that expands or contracts from a previous Place.
-    const uint64_t width = 1000;
-    const uint64_t height = 1000;
+    // "rplace01" in ASCII, this lets readers tell they've opened the right thing.
+    static constexpr uint64_t expectedMagic = 0x31307563616c7072;
+};
 
-    // Default constructor.
-    Place();
+// These live in memory shared between processes, so they can't fall back to a lock.
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory requires lock-free 64-bit atomics.");
 
-  private:
-    // Map from userIDs to timestamps (unix epoch in us).
-    std::map<uint64_t, uint64_t> mostRecentUpdatesPerUser;
+// Total size of a shared region for a grid of the given size.
+static size_t sharedRegionSize(uint64_t width, uint64_t height) {
+    return sizeof(SharedSnapshotHeader) + 2 * width * height * sizeof(SharedPixel);
+}
 
-    // List of all updates from the beginning of time.
-    std::vector<const Update> updates;
+// The writing side. There's only ever one of these per region, it's owned by the Place.
+class SharedSnapshotExport {
+  public:
+    SharedSnapshotExport(uint64_t width, uint64_t height);
+    ~SharedSnapshotExport();
 
-    Snapshot workingSnapshot;
-    std::shared_ptr<const Snapshot> recentSnapshot;
+    // Creates (or replaces) the named region, i.e., "/rplace". Returns false if we can't create or map it, or if the
+    // grid has more than `maxPixels`.
+    bool open(const std::string& name);
 
-    // Mutex for locking around updates.
-    std::shared_mutex updateMutex;
+    // Every slot is a dense copy of the whole grid, so this isn't for huge (mostly blank) canvases. This is 256MB.
+    static constexpr uint64_t maxPixels = 1 << 23;
+
+    // Copies `snapshot` into the free slot and makes it the latest. Snapshots older than the one already published
+    // (by record number, or palette epoch) are ignored, so it's safe to call this from several threads with whatever
+    // they have on hand. So are snapshots that aren't the size of this region.
+    void publish(const Snapshot& snapshot);
+
+    const std::string& getName() const {return name;}
+
+  private:
+    const uint64_t width;
+    const uint64_t height;
+    std::string name;
+    SharedSnapshotHeader* header = nullptr;
+    size_t size = 0;
+
+    // Of the last snapshot published. A new palette rewrites the colors without adding any records.
+    uint64_t paletteEpoch = 0;
+
+    // There's a single writer per region, this serializes publishers within our process.
+    std::mutex publishMutex;
 };
 
-Place::Place() :
-    workingSnapshot(width, height),
-    recentSnapshot(std::make_shared<Snapshot>(width, height))
+SharedSnapshotExport::SharedSnapshotExport(uint64_t width, uint64_t height) :
+    width(width),
+    height(height)
 {
 }
 
-Snapshot Place::getCurrentState() {
-    std::shared_ptr<const Snapshot> recentCopy;
-    {
-        // We lock to update the main snapshot state. Generally this is fast as we do this all the time, so there
-        // shouldn't be a lot of updates to apply.
-        std::unique_lock<std::shared_mutex> lock(updateMutex);
+SharedSnapshotExport::~SharedSnapshotExport() {
+    if (header) {
+        header->retired.store(1, std::memory_order_release);
+        munmap(header, size);
+        shm_unlink(name.c_str());
+    }
+}
 
-        // Update the working snapshot to the latest (fast).
-        workingSnapshot.apply(updates);
+bool SharedSnapshotExport::open(const std::string& regionName) {
+    if (width && height > maxPixels / width) {
+        return false;
+    }
+    int fd = shm_open(regionName.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t regionSize = sharedRegionSize(width, height);
+    if (ftruncate(fd, regionSize) != 0) {
+        close(fd);
+        shm_unlink(regionName.c_str());
+        return false;
+    }
+    void* mapped = mmap(nullptr, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-        // If we're significantly ahead, replace the "recent" snapshot. This involves copying the entire 32mb object,
-        // so it will be relatively slow, so we don't do it that often.
-        if (workingSnapshot.recordNumber > recentSnapshot->recordNumber + 100) {
-            // This invokes the copy constructor, meaning recentSnapshot is now a *new* object, but any existing shared_ptr's
-            // are still pointing at the old object.
-            recentSnapshot = std::make_shared<const Snapshot>(workingSnapshot);
-        }
+    // The mapping keeps the region alive, we don't need the descriptor anymore.
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        shm_unlink(regionName.c_str());
+        return false;
+    }
 
-        // This will be some value from within the last 100 updates.
-        recentCopy = recentSnapshot;
+    // A fresh region is zero-filled, which is already a valid, stable, empty grid in slot 0 (sequence 0 is even).
+    name = regionName;
+    size = regionSize;
+    header = static_cast<SharedSnapshotHeader*>(mapped);
+    header->width = width;
+    header->height = height;
+
+    // Set the magic number last, readers don't look at anything else until they see it.
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = SharedSnapshotHeader::expectedMagic;
+    return true;
+}
+
+void SharedSnapshotExport::publish(const Snapshot& snapshot) {
+    std::lock_guard<std::mutex> lock(publishMutex);
+    uint64_t latest = header->latestSlot.load(std::memory_order_relaxed);
+    if (snapshot.width != width || snapshot.height != height) {
+        return;
+    }
+    if (snapshot.paletteEpoch < paletteEpoch ||
+        (snapshot.paletteEpoch == paletteEpoch && snapshot.recordNumber <= header->slots[latest].recordNumber)) {
+        // Already have this one (or something newer).
+        return;
     }
+    paletteEpoch = snapshot.paletteEpoch;
 
-    // We now copy the value of `recentSnapshot` outside of the main mutex lock. This could be the second copy of this
-    // object if we updated `recentSnapshot` above, but importantly we don't need to hold the lock to do it.
-    Snapshot returnValue = *recentCopy;
+    // Write into the slot nobody should be looking at.
+    uint64_t target = latest ^ 1;
+    SharedSlotHeader& slot = header->slots[target];
+    SharedPixel* pixels = reinterpret_cast<SharedPixel*>(header + 1) + target * width * height;
 
-    // We can now apply the recent changes to the copy with a read-only lock, as we are only modifying our return
-    // object, not the Place object itself. This should "also" be fast-ish, it can apply up to 100 updates.
-    {
-        std::shared_lock<std::shared_mutex> lock(updateMutex);
-        returnValue.apply(updates);
+    // Mark the slot as being written (odd), and make sure that's visible before any of the pixel data changes.
+    slot.sequence.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (uint64_t y = 0; y < height; y++) {
+        for (uint64_t x = 0; x < width; x += Snapshot::tileSize) {
+            // A row of a tile at a time, so we only look each tile up once per row.
+            const Snapshot::Cell* cells = &snapshot.getTile(x / Snapshot::tileSize, y / Snapshot::tileSize).cells[
+                (y % Snapshot::tileSize) * Snapshot::tileSize];
+            for (uint64_t i = 0; i < Snapshot::tileSize && x + i < width; i++) {
+                pixels[y * width + x + i] = {cells[i].color, cells[i].userID};
+            }
+        }
     }
+    slot.recordNumber = snapshot.recordNumber;
 
-    return returnValue;
+    // Stable again (even), and then point readers at it.
+    slot.sequence.fetch_add(1, std::memory_order_release);
+    header->latestSlot.store(target, std::memory_order_release);
 }
 
-bool Place::update(const Pixel& p) {
+// The reading side, for use in other processes. Reads happen directly against the mapped region, nothing is copied.
+//
+// Usage:
+//     SharedSnapshotReader::Frame frame;
+//     do {
+//         frame = reader.acquire();
+//         ... read frame.pixels[y * reader.getWidth() + x] ...
+//     } while (!reader.validate(frame));
+//
+// Anything read between `acquire` and a successful `validate` is consistent. If `validate` fails, the writer lapped
+// us and the data may be torn, so it must be discarded.
+class SharedSnapshotReader {
+  public:
+    struct Frame {
+        const SharedPixel* pixels;
+        uint64_t recordNumber;
+        uint64_t slot;
+        uint64_t sequence;
+    };
+
+    ~SharedSnapshotReader();
+
+    // Maps the named region read-only. Returns false if it doesn't exist or isn't one of ours.
+    bool open(const std::string& name);
+
+    Frame acquire() const;
+    bool validate(const Frame& frame) const;
+
+    uint64_t getWidth() const {return header->width;}
+    uint64_t getHeight() const {return header->height;}
+
+    // True once the writer has replaced this region, see `SharedSnapshotHeader::retired`.
+    bool isRetired() const {return header->retired.load(std::memory_order_acquire);}
+
+  private:
+    const SharedSnapshotHeader* header = nullptr;
+    size_t size = 0;
+};
+
+SharedSnapshotReader::~SharedSnapshotReader() {
+    if (header) {
+        munmap(const_cast<SharedSnapshotHeader*>(header), size);
+    }
+}
 
-    // Fail early if this isn't a valid location.
-    if (p.getX() >= width || p.getY() >= height) {
+bool SharedSnapshotReader::open(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SharedSnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    const SharedSnapshotHeader* candidate = static_cast<const SharedSnapshotHeader*>(mapped);
+    if (candidate->magic != SharedSnapshotHeader::expectedMagic ||
+        static_cast<size_t>(info.st_size) < sharedRegionSize(candidate->width, candidate->height)) {
+        munmap(mapped, info.st_size);
         return false;
     }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    header = candidate;
+    size = info.st_size;
+    return true;
+}
 
-    // Lock to prevent collisions.
-    std::unique_lock<std::shared_mutex> lock(updateMutex);
-    
-    // Don't grab the current time until we're locked, in case it takes a while.
-    auto currentTime = std::chrono::system_clock::now().time_since_epoch().count();
+SharedSnapshotReader::Frame SharedSnapshotReader::acquire() const {
+    while (true) {
+        uint64_t slot = header->latestSlot.load(std::memory_order_acquire);
+        uint64_t sequence = header->slots[slot].sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            // Being written right now (the writer lapped us between the two loads), go look again.
+            continue;
+        }
+        const SharedPixel* pixels = reinterpret_cast<const SharedPixel*>(header + 1) +
+                                    slot * header->width * header->height;
+        return {pixels, header->slots[slot].recordNumber, slot, sequence};
+    }
+}
 
-    // See if this user has ever updated the Place.
-    auto recentUdpateIt = mostRecentUpdatesPerUser.find(p.getUserID());
-    if (recentUdpateIt != mostRecentUpdatesPerUser.end()) {
-        // This user *has* updated the grid at some point.
-        if (recentUdpateIt->second > currentTime - (/*60 * */5 * 1'000'000)) {
-            // Less than 5 minutes. // TODO: Actually seconds, update later!
-            return false;
-        } else {
-            // More than 5 minutes, we can update.
-            recentUdpateIt->second = currentTime;
+bool SharedSnapshotReader::validate(const Frame& frame) const {
+    // Keep all of the caller's reads of the frame before the re-check of the sequence number.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return header->slots[frame.slot].sequence.load(std::memory_order_relaxed) == frame.sequence;
+}
+
+// Everything you'd want to know about a single pixel, as returned by `Place::getPixel`.
+struct PixelInfo {
+    uint64_t color;
+    uint64_t userID;
+
+    // The update that last wrote this pixel. Only meaningful if `placed` is true, otherwise nobody has written to this
+    // pixel yet and it still has the default color.
+    uint64_t recordNumber;
+    bool placed;
+};
+
+// How many pixels each user currently owns (i.e., was the last to write), kept up to date on every write rather than
+// by scanning the canvas, with a leaderboard that's always sorted.
+//
+// UserIDs are sparse, so each user gets a dense index the first time they own anything, and everything else is a flat
+// array by that index. `order` holds every dense index sorted by count, most first, and `position` is the inverse.
+// Counts only ever move by one, so keeping `order` sorted is a single swap: a user that gains a pixel swaps with the
+// first user that has the same count, then moves up; a user that loses one swaps with the last. The top K is then just
+// the first K entries.
+//
+// Not thread safe, the Place only touches this while holding `updateMutex` (exclusively to write).
+class OwnershipCounts {
+  public:
+    // A cell changed hands. Either side can be missing: a pixel nobody had written to yet has no previous owner, and
+    // one that's put back to blank (see `Pixel::isBlank`) has no new one.
+    void transfer(std::optional<uint64_t> previousOwner, std::optional<uint64_t> newOwner);
+
+    uint64_t getOwned(uint64_t userID) const;
+
+    // Up to `k` (userID, pixels owned) pairs, most first. Users that don't own anything are left out.
+    std::vector<std::pair<uint64_t, uint64_t>> top(size_t k) const;
+
+    // Approximate bytes used.
+    uint64_t memoryUsage() const;
+
+  private:
+    void increment(uint32_t index);
+    void decrement(uint32_t index);
+
+    std::unordered_map<uint64_t, uint32_t> indexes;
+
+    // By dense index.
+    std::vector<uint64_t> userIDs;
+    std::vector<uint64_t> counts;
+    std::vector<uint32_t> position;
+
+    // Dense indexes, sorted by count, most first.
+    std::vector<uint32_t> order;
+};
+
+void OwnershipCounts::transfer(std::optional<uint64_t> previousOwner, std::optional<uint64_t> newOwner) {
+    if (previousOwner == newOwner) {
+        return;
+    }
+    if (previousOwner) {
+        // Anybody that owned a pixel already has an index.
+        decrement(indexes.at(*previousOwner));
+    }
+    if (!newOwner) {
+        return;
+    }
+    auto [it, added] = indexes.try_emplace(*newOwner, static_cast<uint32_t>(userIDs.size()));
+    if (added) {
+        userIDs.push_back(*newOwner);
+        counts.push_back(0);
+        position.push_back(static_cast<uint32_t>(order.size()));
+        order.push_back(it->second);
+    }
+    increment(it->second);
+}
+
+void OwnershipCounts::increment(uint32_t index) {
+    // The first entry with the same count, `order` is descending so that's the first that isn't more.
+    uint64_t count = counts[index];
+    auto first = std::partition_point(order.begin(), order.end(),
+                                      [this, count](uint32_t other) {return counts[other] > count;});
+    uint32_t swapWith = *first;
+    std::swap(order[position[index]], *first);
+    std::swap(position[index], position[swapWith]);
+    counts[index]++;
+}
+
+void OwnershipCounts::decrement(uint32_t index) {
+    // The last entry with the same count, right before the first that's less.
+    uint64_t count = counts[index];
+    auto last = std::partition_point(order.begin(), order.end(),
+                                     [this, count](uint32_t other) {return counts[other] >= count;}) - 1;
+    uint32_t swapWith = *last;
+    std::swap(order[position[index]], *last);
+    std::swap(position[index], position[swapWith]);
+    counts[index]--;
+}
+
+uint64_t OwnershipCounts::getOwned(uint64_t userID) const {
+    auto it = indexes.find(userID);
+    return it == indexes.end() ? 0 : counts[it->second];
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> OwnershipCounts::top(size_t k) const {
+    std::vector<std::pair<uint64_t, uint64_t>> result;
+    result.reserve(std::min(k, order.size()));
+    for (size_t i = 0; i < order.size() && i < k && counts[order[i]]; i++) {
+        result.emplace_back(userIDs[order[i]], counts[order[i]]);
+    }
+    return result;
+}
+
+uint64_t OwnershipCounts::memoryUsage() const {
+    // A rough cost for an unordered_map node, there's no way to ask.
+    static constexpr uint64_t mapEntrySize = 32;
+    return indexes.size() * mapEntrySize + userIDs.capacity() * sizeof(uint64_t) +
+           counts.capacity() * sizeof(uint64_t) + (position.capacity() + order.capacity()) * sizeof(uint32_t);
+}
+
+// Heap allocations made by the current thread so far, counted by our `operator new`. This is how the benchmarks (and
+// `FrontEnd::getRequestAllocations`) check what a request costs. Replacing the global `operator new` puts an increment
+// on every allocation in the program, and the compiler can't always see that our `new` and `delete` match, so it's
+// only compiled in with -DRPLACE_COUNT_ALLOCATIONS. Otherwise this stays zero.
+static thread_local uint64_t heapAllocations = 0;
+
+#ifdef RPLACE_COUNT_ALLOCATIONS
+// Not inlined, so the optimizer never sees `free` called on a pointer from `new`, which it warns about even though
+// here they match.
+__attribute__((noinline)) void* operator new(size_t size) {
+    heapAllocations++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+#endif
+
+// A per-thread bump arena for the temporaries of a single request: parsed headers, the updates behind a diff, the
+// pixels behind a region. Allocating from it is a pointer bump, freeing is a no-op, and the whole thing is dropped at
+// once when the request is done, so a request costs a handful of heap allocations however big it is.
+//
+// Open a `Scope` around the request and allocate from `resource()`. Scopes nest, only the outermost one releases.
+// Nothing allocated from the arena may outlive its scope, anything that does (e.g., an `EncodedBuffer` that's queued
+// on a connection or cached) has to come from the heap as usual. Outside of any scope, `resource()` is the plain heap.
+//
+// The arena starts at `initialBytes`. A request that doesn't fit spills to the heap, and when it's done the arena is
+// regrown to cover it (up to `maxRetainedBytes`), so the next request that big fits.
+class RequestArena {
+  public:
+    static constexpr size_t initialBytes = 256 << 10;
+    static constexpr size_t maxRetainedBytes = 16 << 20;
+
+    class Scope {
+      public:
+        Scope() {state().depth++;}
+        ~Scope() {
+            if (--state().depth == 0) {
+                release();
+            }
         }
-    } else {
-        // If the user had never update the Place, we'll add them to the map.
-        mostRecentUpdatesPerUser.emplace(std::make_pair(p.getUserID(), currentTime));
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    // Where to allocate request temporaries from on this thread.
+    static std::pmr::memory_resource* resource();
+
+  private:
+    // Passes spills through to the heap, counting how much, so `release` knows how big to regrow.
+    class Upstream : public std::pmr::memory_resource {
+      public:
+        size_t spilled = 0;
+
+      private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+#ifdef RPLACE_COUNT_ALLOCATIONS
+            // This goes through the aligned `operator new`, which we don't count, so count it here.
+            heapAllocations++;
+#endif
+            spilled += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {return this == &other;}
+    };
+
+    struct State {
+        size_t depth = 0;
+        size_t capacity = 0;
+        std::unique_ptr<char[]> buffer;
+        Upstream upstream;
+        std::optional<std::pmr::monotonic_buffer_resource> arena;
+    };
+
+    static State& state();
+    static void release();
+};
+
+RequestArena::State& RequestArena::state() {
+    static thread_local State state;
+    return state;
+}
+
+std::pmr::memory_resource* RequestArena::resource() {
+    State& s = state();
+    if (!s.depth) {
+        return std::pmr::get_default_resource();
+    }
+    if (!s.arena) {
+        // First use on this thread.
+        s.capacity = initialBytes;
+        s.buffer.reset(new char[s.capacity]);
+        s.arena.emplace(s.buffer.get(), s.capacity, &s.upstream);
     }
+    return &*s.arena;
+}
 
-    // Now, if we get this far, we add an update to the complete list (regardless if the user had previously updated
-    // the Place or not).
-    updates.emplace_back(updates.size(), currentTime, p);
+void RequestArena::release() {
+    State& s = state();
+    if (!s.arena) {
+        return;
+    }
+    // Frees the spills, if there were any.
+    s.arena.reset();
+    if (s.upstream.spilled && s.capacity < maxRetainedBytes) {
+        s.capacity = std::min(maxRetainedBytes, std::max(s.capacity * 2, s.capacity + s.upstream.spilled));
+        s.buffer.reset(new char[s.capacity]);
+    }
+    s.upstream.spilled = 0;
+    s.arena.emplace(s.buffer.get(), s.capacity, &s.upstream);
+}
 
-    // Done, success.
-    return true;
+// A copy of the working state of the Place that's kept current on every update, and that can be read without taking
+// `updateMutex`. This is what makes single pixel lookups (i.e., "who placed this?") cheap, without having to copy a
+// whole Snapshot.
+//
+// The grid is split into square tiles, and each tile has a seqlock: the single writer (which holds `updateMutex`)
+// makes the tile's sequence number odd, writes, then makes it even again. Readers never block, they read the sequence
+// number, read the pixel, and read the sequence number again, retrying if it changed (or was odd) in between. Since
+// writes are a few stores, retries are rare and short.
+//
+// Every field is an atomic so that a reader racing with the writer is well defined, the sequence number is what tells
+// the reader whether the combination it saw is consistent.
+//
+// Tiles are only allocated when first written, until then their slot points at a shared blank tile. Tile slots are
+// grouped into chunks (a two level radix tree), and chunks are only allocated when a tile in them is first written,
+// until then they're a shared blank chunk. So a huge, mostly blank grid costs a pointer per chunk, not per tile. The
+// chunk slots live in a `Directory` that's replaced (never modified in size) when the table is expanded, so readers
+// can keep using whichever directory they loaded. Old directories are kept until the table is destroyed, they're
+// only pointers and expansion is rare.
+class PixelTable {
+  public:
+    // Tiles are `tileSize` on a side.
+    static constexpr uint64_t tileSize = 64;
+
+    PixelTable(uint64_t width, uint64_t height);
+
+    // Writes a single pixel. Only one thread may write at a time (i.e., hold `updateMutex`). If `ownership` is given,
+    // the pixel is transferred to its new owner there, as we're the ones that know who had it before. A blank pixel
+    // (see `Pixel::isBlank`) is left unplaced, with no owner.
+    void set(const Pixel& p, uint64_t recordNumber, OwnershipCounts* ownership = nullptr);
+
+    // Writes a batch of pixels, with consecutive record numbers starting at `firstRecordNumber`. Every tile the batch
+    // touches stays odd (being written) until the whole batch is written, so readers see all of it or none of it.
+    void setBatch(const std::vector<Pixel>& pixels, uint64_t firstRecordNumber, OwnershipCounts* ownership = nullptr);
+
+    // Grows the table to the given size (it never shrinks). This is a writer operation like `set`. Existing tiles
+    // aren't touched, the new area points at the blank tile.
+    void expand(uint64_t newWidth, uint64_t newHeight);
+
+    // Like `Snapshot::remapColors`, in place, a tile at a time. This is a writer operation like `set`, readers see
+    // each tile either before or after.
+    void remapColors(const std::vector<uint64_t>& remap);
+
+    // Reads a single pixel. Returns false if it's outside the grid.
+    bool get(uint64_t x, uint64_t y, PixelInfo& info) const;
+
+    // Approximate bytes used. Writers need to be kept out while this runs (i.e., by holding `updateMutex`).
+    uint64_t memoryUsage() const;
+
+    // Reads a `regionWidth` x `regionHeight` rectangle into `region` (a std::vector or std::pmr::vector of
+    // PixelInfo), in row order. The whole rectangle is consistent, it's retried if any tile it touches was written
+    // while we were reading. Returns false if it doesn't fit.
+    template <typename Region>
+    bool getRegion(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight, Region& region) const;
+
+  private:
+    struct Cell {
+        std::atomic<uint64_t> color;
+        std::atomic<uint64_t> userID;
+
+        // This is one more than the record number that last wrote this cell, so that zero can mean "never written".
+        std::atomic<uint64_t> recordNumberPlusOne;
+    };
+
+    struct Tile {
+        // Odd while being written, even while stable.
+        std::atomic<uint64_t> sequence;
+        Cell cells[tileSize * tileSize];
+    };
+
+    // Chunks are `chunkSize` tiles on a side.
+    static constexpr uint64_t chunkSize = 64;
+
+    struct Chunk {
+        // Row major.
+        std::atomic<Tile*> tiles[chunkSize * chunkSize];
+    };
+
+    struct Directory {
+        uint64_t width;
+        uint64_t height;
+        uint64_t chunksWide;
+        uint64_t chunksHigh;
+
+        // Row major, `chunksWide` x `chunksHigh`.
+        std::unique_ptr<std::atomic<Chunk*>[]> chunks;
+    };
+
+    static const Cell& cellFor(const Tile& tile, uint64_t x, uint64_t y) {
+        return tile.cells[(y % tileSize) * tileSize + x % tileSize];
+    }
+
+    // The tile at the given tile coordinates, for readers.
+    static const Tile* tileAt(const Directory& current, uint64_t tileX, uint64_t tileY);
+
+    // Builds a directory of the given size, copying chunk pointers from `previous` (if any) and filling the rest with
+    // the blank chunk.
+    std::unique_ptr<Directory> makeDirectory(uint64_t newWidth, uint64_t newHeight, const Directory* previous) const;
+
+    // The tile to write `x`, `y` into, allocating it if it's still the blank tile.
+    Tile& writableTile(uint64_t x, uint64_t y);
+
+    // Writes a cell without touching the sequence number, callers do that.
+    static void writeCell(Tile& tile, const Pixel& p, uint64_t recordNumber, OwnershipCounts* ownership);
+
+    // Reads a cell without checking the sequence number, callers do that.
+    static void readCell(const Cell& cell, PixelInfo& info);
+
+    // Never written, all zeroes, which is the default color and "never written".
+    std::unique_ptr<Tile> blankTile;
+
+    // Every slot points at `blankTile`.
+    std::unique_ptr<Chunk> blankChunk;
+
+    // What readers use.
+    std::atomic<const Directory*> directory;
+
+    // Every directory, chunk and tile we've allocated, owned here so readers never see them freed.
+    std::vector<std::unique_ptr<Directory>> directories;
+    std::vector<std::unique_ptr<Chunk>> allocatedChunks;
+    std::vector<std::unique_ptr<Tile>> allocatedTiles;
+};
+
+PixelTable::PixelTable(uint64_t width, uint64_t height) :
+    blankTile(std::make_unique<Tile>()),
+    blankChunk(std::make_unique<Chunk>())
+{
+    for (std::atomic<Tile*>& slot : blankChunk->tiles) {
+        slot.store(blankTile.get(), std::memory_order_relaxed);
+    }
+    directories.push_back(makeDirectory(width, height, nullptr));
+    directory.store(directories.back().get(), std::memory_order_release);
 }
 
-// Main is not really the right place to call this, but it's all conceptual so far.
-int main() {
-    Place place;
+std::unique_ptr<PixelTable::Directory> PixelTable::makeDirectory(uint64_t newWidth, uint64_t newHeight,
+                                                                 const Directory* previous) const {
+    auto result = std::make_unique<Directory>();
+    result->width = newWidth;
+    result->height = newHeight;
+    result->chunksWide = (newWidth + tileSize * chunkSize - 1) / (tileSize * chunkSize);
+    result->chunksHigh = (newHeight + tileSize * chunkSize - 1) / (tileSize * chunkSize);
+    result->chunks = std::make_unique<std::atomic<Chunk*>[]>(result->chunksWide * result->chunksHigh);
+    for (uint64_t chunkY = 0; chunkY < result->chunksHigh; chunkY++) {
+        for (uint64_t chunkX = 0; chunkX < result->chunksWide; chunkX++) {
+            Chunk* chunk = blankChunk.get();
+            if (previous && chunkX < previous->chunksWide && chunkY < previous->chunksHigh) {
+                chunk = previous->chunks[chunkY * previous->chunksWide + chunkX].load(std::memory_order_relaxed);
+            }
+            result->chunks[chunkY * result->chunksWide + chunkX].store(chunk, std::memory_order_relaxed);
+        }
+    }
+    return result;
+}
+
+const PixelTable::Tile* PixelTable::tileAt(const Directory& current, uint64_t tileX, uint64_t tileY) {
+    const Chunk* chunk = current.chunks[(tileY / chunkSize) * current.chunksWide + tileX / chunkSize].load(
+        std::memory_order_acquire);
+    return chunk->tiles[(tileY % chunkSize) * chunkSize + tileX % chunkSize].load(std::memory_order_acquire);
+}
+
+void PixelTable::expand(uint64_t newWidth, uint64_t newHeight) {
+    const Directory* current = directory.load(std::memory_order_relaxed);
+    if (newWidth <= current->width && newHeight <= current->height) {
+        return;
+    }
+    directories.push_back(makeDirectory(std::max(newWidth, current->width), std::max(newHeight, current->height),
+                                        current));
+    directory.store(directories.back().get(), std::memory_order_release);
+}
+
+PixelTable::Tile& PixelTable::writableTile(uint64_t x, uint64_t y) {
+    const Directory* current = directory.load(std::memory_order_relaxed);
+    uint64_t tileX = x / tileSize;
+    uint64_t tileY = y / tileSize;
+    std::atomic<Chunk*>& chunkSlot = current->chunks[(tileY / chunkSize) * current->chunksWide + tileX / chunkSize];
+    Chunk* chunk = chunkSlot.load(std::memory_order_relaxed);
+    if (chunk == blankChunk.get()) {
+        // Same as for tiles below, a fresh chunk points at the blank tile everywhere, just like the blank chunk.
+        allocatedChunks.push_back(std::make_unique<Chunk>());
+        chunk = allocatedChunks.back().get();
+        for (std::atomic<Tile*>& tileSlot : chunk->tiles) {
+            tileSlot.store(blankTile.get(), std::memory_order_relaxed);
+        }
+        chunkSlot.store(chunk, std::memory_order_release);
+    }
+    std::atomic<Tile*>& slot = chunk->tiles[(tileY % chunkSize) * chunkSize + tileX % chunkSize];
+    Tile* tile = slot.load(std::memory_order_relaxed);
+    if (tile == blankTile.get()) {
+        // A fresh tile is all zeroes, just like the blank tile, so readers can switch to it at any point.
+        allocatedTiles.push_back(std::make_unique<Tile>());
+        tile = allocatedTiles.back().get();
+        slot.store(tile, std::memory_order_release);
+    }
+    return *tile;
+}
+
+void PixelTable::writeCell(Tile& tile, const Pixel& p, uint64_t recordNumber, OwnershipCounts* ownership) {
+    Cell& cell = tile.cells[(p.getY() % tileSize) * tileSize + p.getX() % tileSize];
+    bool blank = p.isBlank();
+    if (ownership) {
+        std::optional<uint64_t> previousOwner;
+        if (cell.recordNumberPlusOne.load(std::memory_order_relaxed)) {
+            previousOwner = cell.userID.load(std::memory_order_relaxed);
+        }
+        ownership->transfer(previousOwner, blank ? std::nullopt : std::optional<uint64_t>(p.getUserID()));
+    }
+    cell.color.store(p.getColor(), std::memory_order_relaxed);
+    cell.userID.store(p.getUserID(), std::memory_order_relaxed);
+    cell.recordNumberPlusOne.store(blank ? 0 : recordNumber + 1, std::memory_order_relaxed);
+}
+
+void PixelTable::set(const Pixel& p, uint64_t recordNumber, OwnershipCounts* ownership) {
+    Tile& tile = writableTile(p.getX(), p.getY());
+
+    // Odd, then make sure that's visible before any of the cell changes.
+    uint64_t sequence = tile.sequence.load(std::memory_order_relaxed);
+    tile.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    writeCell(tile, p, recordNumber, ownership);
+
+    // Even again, after all of the cell changes.
+    tile.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void PixelTable::setBatch(const std::vector<Pixel>& pixels, uint64_t firstRecordNumber,
+                          OwnershipCounts* ownership) {
+    std::vector<Tile*> touched;
+    touched.reserve(pixels.size());
+    for (const Pixel& p : pixels) {
+        touched.push_back(&writableTile(p.getX(), p.getY()));
+    }
+    std::vector<Tile*> distinct = touched;
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+    // Every tile goes odd before we write anything, and even again only once we've written everything. A reader that
+    // saw any tile even while we were writing will see it changed when it re-checks.
+    for (Tile* tile : distinct) {
+        tile->sequence.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        writeCell(*touched[i], pixels[i], firstRecordNumber + i, ownership);
+    }
+    for (Tile* tile : distinct) {
+        tile->sequence.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void PixelTable::remapColors(const std::vector<uint64_t>& remap) {
+    for (const auto& tile : allocatedTiles) {
+        uint64_t sequence = tile->sequence.load(std::memory_order_relaxed);
+        tile->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (Cell& cell : tile->cells) {
+            uint64_t color = cell.color.load(std::memory_order_relaxed);
+            if (color < remap.size()) {
+                cell.color.store(remap[color], std::memory_order_relaxed);
+            }
+        }
+        tile->sequence.store(sequence + 2, std::memory_order_release);
+    }
+}
+
+uint64_t PixelTable::memoryUsage() const {
+    uint64_t total = (allocatedTiles.size() + 1) * sizeof(Tile) + (allocatedChunks.size() + 1) * sizeof(Chunk);
+    for (const auto& previous : directories) {
+        total += sizeof(Directory) + previous->chunksWide * previous->chunksHigh * sizeof(std::atomic<Chunk*>);
+    }
+    return total;
+}
+
+void PixelTable::readCell(const Cell& cell, PixelInfo& info) {
+    info.color = cell.color.load(std::memory_order_relaxed);
+    info.userID = cell.userID.load(std::memory_order_relaxed);
+    uint64_t recordNumberPlusOne = cell.recordNumberPlusOne.load(std::memory_order_relaxed);
+    info.placed = recordNumberPlusOne != 0;
+    info.recordNumber = info.placed ? recordNumberPlusOne - 1 : 0;
+}
+
+bool PixelTable::get(uint64_t x, uint64_t y, PixelInfo& info) const {
+    const Directory* current = directory.load(std::memory_order_acquire);
+    if (x >= current->width || y >= current->height) {
+        return false;
+    }
+    while (true) {
+        // The slot can change from the blank tile to a real one between attempts, so look it up every time.
+        const Tile& tile = *tileAt(*current, x / tileSize, y / tileSize);
+        uint64_t before = tile.sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        readCell(cellFor(tile, x, y), info);
+
+        // Keep the cell reads before the re-check.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (tile.sequence.load(std::memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+}
+
+template <typename Region>
+bool PixelTable::getRegion(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight,
+                           Region& region) const {
+    const Directory* current = directory.load(std::memory_order_acquire);
+    if (x >= current->width || y >= current->height ||
+        regionWidth > current->width - x || regionHeight > current->height - y) {
+        return false;
+    }
+    region.resize(regionWidth * regionHeight);
+    if (!regionWidth || !regionHeight) {
+        // Nothing to read, and the last tile below would be before the first one (or wrap around at 0).
+        return true;
+    }
+
+    // The tiles this region touches, and the sequence number we saw for each of them. We read through these exact
+    // tile pointers, so if a blank slot gets a real tile while we're reading, we consistently see the blank one. That
+    // alone isn't enough, a stamp could give a blank slot its tile and write both it and a tile we read after the
+    // stamp, and the blank tile's sequence never changes. So checking also makes sure every slot still points where
+    // it did.
+    uint64_t firstTileX = x / tileSize;
+    uint64_t firstTileY = y / tileSize;
+    uint64_t lastTileX = (x + regionWidth - 1) / tileSize;
+    uint64_t lastTileY = (y + regionHeight - 1) / tileSize;
+    uint64_t touchedWide = lastTileX - firstTileX + 1;
+    std::pmr::vector<std::pair<const Tile*, uint64_t>> touched(RequestArena::resource());
+    touched.reserve(touchedWide * (lastTileY - firstTileY + 1));
+
+    while (true) {
+        // The directory can be replaced by `expand` between attempts, and a replaced one never gets new tiles.
+        current = directory.load(std::memory_order_acquire);
+        touched.clear();
+        bool writing = false;
+        for (uint64_t tileY = firstTileY; tileY <= lastTileY && !writing; tileY++) {
+            for (uint64_t tileX = firstTileX; tileX <= lastTileX; tileX++) {
+                const Tile* tile = tileAt(*current, tileX, tileY);
+                uint64_t sequence = tile->sequence.load(std::memory_order_acquire);
+                if (sequence & 1) {
+                    writing = true;
+                    break;
+                }
+                touched.emplace_back(tile, sequence);
+            }
+        }
+        if (writing) {
+            continue;
+        }
+
+        for (uint64_t row = 0; row < regionHeight; row++) {
+            for (uint64_t column = 0; column < regionWidth; column++) {
+                uint64_t pixelX = x + column;
+                uint64_t pixelY = y + row;
+                const Tile& tile = *touched[(pixelY / tileSize - firstTileY) * touchedWide +
+                                            pixelX / tileSize - firstTileX].first;
+                readCell(cellFor(tile, pixelX, pixelY), region[row * regionWidth + column]);
+            }
+        }
+
+        // If none of the tiles changed (or were swapped out), every tile was stable for the whole time we were
+        // reading. A writer gives a slot its tile before making anything odd, so if we saw any of its writes, we see
+        // the new slot here.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const Directory* latest = directory.load(std::memory_order_acquire);
+        bool consistent = true;
+        for (size_t i = 0; i < touched.size() && consistent; i++) {
+            const auto& [tile, sequence] = touched[i];
+            consistent = tile->sequence.load(std::memory_order_relaxed) == sequence &&
+                         tileAt(*latest, firstTileX + i % touchedWide, firstTileY + i / touchedWide) == tile;
+        }
+        if (consistent) {
+            return true;
+        }
+    }
+}
+
+// A rectangle to freeze or unfreeze, see `Place::setProtection`.
+struct ProtectionChange {
+    uint64_t x;
+    uint64_t y;
+    uint64_t width;
+    uint64_t height;
+
+    // True to freeze, false to unfreeze.
+    bool protect;
+};
+
+// Which pixels are frozen by moderators, checked on every write, so a lookup has to be O(1) and lock free.
+//
+// This is a bit per pixel, split into the same tiles as `PixelTable`, but with a tile level on top: a tile slot is
+// null if nothing in the tile is protected, points at the shared `fullTile` if everything is, and only otherwise at a
+// bitmap. Most of the canvas is one of the first two, so the common case never touches a bitmap at all. Tile slots are
+// grouped into chunks like in `PixelTable`, and a chunk with nothing protected in it is just null, so a huge canvas
+// costs a pointer per chunk.
+//
+// Chunks and tiles are never modified once published. A change builds new tiles and chunks for whatever it touches and
+// a new directory, and swaps the directory in with a single store, so a whole set of changes takes effect at once. Old
+// directories, chunks and tiles are kept until the mask is destroyed, so readers never see them freed, moderation is
+// rare enough for that.
+class ProtectionMask {
+  public:
+    static constexpr uint64_t tileSize = PixelTable::tileSize;
+
+    ProtectionMask(uint64_t width, uint64_t height);
+
+    // Whether `x`, `y` is protected. Anything outside the mask isn't.
+    bool isProtected(uint64_t x, uint64_t y) const;
+
+    // Applies every change, in order, all at once. Returns false, and changes nothing, if any rectangle doesn't fit.
+    bool apply(const std::vector<ProtectionChange>& changes);
+
+    // Grows the mask (it never shrinks), the new area isn't protected.
+    void expand(uint64_t newWidth, uint64_t newHeight);
+
+    // Approximate bytes used.
+    uint64_t memoryUsage();
+
+  private:
+    // Chunks are `chunkSize` tiles on a side.
+    static constexpr uint64_t chunkSize = 64;
+
+    struct Tile {
+        uint64_t rows[tileSize];
+    };
+
+    struct Chunk {
+        // Row major, see above for what null and `fullTile` mean.
+        const Tile* tiles[chunkSize * chunkSize];
+    };
+
+    struct Directory {
+        uint64_t width;
+        uint64_t height;
+        uint64_t chunksWide;
+        uint64_t chunksHigh;
+
+        // Row major, `chunksWide` x `chunksHigh`, null if nothing in the chunk is protected.
+        std::unique_ptr<const Chunk*[]> chunks;
+    };
+
+    // A new directory of the given size, with the chunk pointers from `previous`.
+    static std::unique_ptr<Directory> copyDirectory(uint64_t newWidth, uint64_t newHeight, const Directory& previous);
+
+    // Every bit set.
+    std::unique_ptr<Tile> fullTile;
+
+    // What readers use.
+    std::atomic<const Directory*> directory;
+
+    // Writers (`apply` and `expand`) are serialized by `writerMutex`, which also guards these. These own every
+    // directory, chunk and tile we've ever published.
+    std::mutex writerMutex;
+    std::vector<std::unique_ptr<Directory>> directories;
+    std::vector<std::unique_ptr<Chunk>> allocatedChunks;
+    std::vector<std::unique_ptr<Tile>> allocatedTiles;
+};
+
+ProtectionMask::ProtectionMask(uint64_t width, uint64_t height) :
+    fullTile(std::make_unique<Tile>())
+{
+    std::fill(std::begin(fullTile->rows), std::end(fullTile->rows), UINT64_MAX);
+    Directory empty{0, 0, 0, 0, nullptr};
+    directories.push_back(copyDirectory(width, height, empty));
+    directory.store(directories.back().get(), std::memory_order_release);
+}
+
+std::unique_ptr<ProtectionMask::Directory> ProtectionMask::copyDirectory(uint64_t newWidth, uint64_t newHeight,
+                                                                         const Directory& previous) {
+    auto result = std::make_unique<Directory>();
+    result->width = newWidth;
+    result->height = newHeight;
+    result->chunksWide = (newWidth + tileSize * chunkSize - 1) / (tileSize * chunkSize);
+    result->chunksHigh = (newHeight + tileSize * chunkSize - 1) / (tileSize * chunkSize);
+    result->chunks = std::make_unique<const Chunk*[]>(result->chunksWide * result->chunksHigh);
+    for (uint64_t chunkY = 0; chunkY < previous.chunksHigh; chunkY++) {
+        for (uint64_t chunkX = 0; chunkX < previous.chunksWide; chunkX++) {
+            result->chunks[chunkY * result->chunksWide + chunkX] =
+                previous.chunks[chunkY * previous.chunksWide + chunkX];
+        }
+    }
+    return result;
+}
+
+bool ProtectionMask::isProtected(uint64_t x, uint64_t y) const {
+    const Directory* current = directory.load(std::memory_order_acquire);
+    if (x >= current->width || y >= current->height) {
+        return false;
+    }
+    uint64_t tileX = x / tileSize;
+    uint64_t tileY = y / tileSize;
+    const Chunk* chunk = current->chunks[(tileY / chunkSize) * current->chunksWide + tileX / chunkSize];
+    if (!chunk) {
+        return false;
+    }
+    const Tile* tile = chunk->tiles[(tileY % chunkSize) * chunkSize + tileX % chunkSize];
+    if (!tile || tile == fullTile.get()) {
+        return tile;
+    }
+    return (tile->rows[y % tileSize] >> (x % tileSize)) & 1;
+}
+
+bool ProtectionMask::apply(const std::vector<ProtectionChange>& changes) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    const Directory& current = *directory.load(std::memory_order_relaxed);
+    for (const ProtectionChange& change : changes) {
+        if (change.x >= current.width || change.y >= current.height ||
+            change.width > current.width - change.x || change.height > current.height - change.y) {
+            return false;
+        }
+    }
+    auto next = copyDirectory(current.width, current.height, current);
+
+    // Chunks and tiles we've made for this change, by index into `next` and by tile coordinates. They're private until
+    // we publish `next`, so we can keep editing them.
+    std::unordered_map<uint64_t, std::unique_ptr<Chunk>> editedChunks;
+    std::map<std::pair<uint64_t, uint64_t>, std::unique_ptr<Tile>> editedTiles;
+    for (const ProtectionChange& change : changes) {
+        if (!change.width || !change.height) {
+            continue;
+        }
+        for (uint64_t tileY = change.y / tileSize; tileY <= (change.y + change.height - 1) / tileSize; tileY++) {
+            for (uint64_t tileX = change.x / tileSize; tileX <= (change.x + change.width - 1) / tileSize; tileX++) {
+                auto& tile = editedTiles[{tileX, tileY}];
+                if (!tile) {
+                    tile = std::make_unique<Tile>();
+                    uint64_t chunkIndex = (tileY / chunkSize) * next->chunksWide + tileX / chunkSize;
+                    const Chunk* chunk = next->chunks[chunkIndex];
+                    const Tile* previous = chunk ? chunk->tiles[(tileY % chunkSize) * chunkSize + tileX % chunkSize]
+                                                 : nullptr;
+                    if (previous) {
+                        *tile = *previous;
+                    } else {
+                        std::fill(std::begin(tile->rows), std::end(tile->rows), 0);
+                    }
+                }
+
+                // The part of the rectangle in this tile, in tile coordinates.
+                uint64_t left = std::max(change.x, tileX * tileSize) - tileX * tileSize;
+                uint64_t right = std::min(change.x + change.width, (tileX + 1) * tileSize) - tileX * tileSize;
+                uint64_t top = std::max(change.y, tileY * tileSize) - tileY * tileSize;
+                uint64_t bottom = std::min(change.y + change.height, (tileY + 1) * tileSize) - tileY * tileSize;
+                uint64_t bits = (right - left == 64 ? UINT64_MAX : ((uint64_t{1} << (right - left)) - 1)) << left;
+                for (uint64_t row = top; row < bottom; row++) {
+                    tile->rows[row] = change.protect ? tile->rows[row] | bits : tile->rows[row] & ~bits;
+                }
+            }
+        }
+    }
+
+    // Tiles that ended up all or nothing don't need a bitmap.
+    for (auto& [coordinates, tile] : editedTiles) {
+        auto [tileX, tileY] = coordinates;
+        uint64_t chunkIndex = (tileY / chunkSize) * next->chunksWide + tileX / chunkSize;
+        auto& chunk = editedChunks[chunkIndex];
+        if (!chunk) {
+            chunk = std::make_unique<Chunk>();
+            if (next->chunks[chunkIndex]) {
+                *chunk = *next->chunks[chunkIndex];
+            } else {
+                std::fill(std::begin(chunk->tiles), std::end(chunk->tiles), nullptr);
+            }
+        }
+
+        bool full = true;
+        bool empty = true;
+        for (uint64_t row : tile->rows) {
+            full = full && row == UINT64_MAX;
+            empty = empty && row == 0;
+        }
+        const Tile*& slot = chunk->tiles[(tileY % chunkSize) * chunkSize + tileX % chunkSize];
+        if (full) {
+            slot = fullTile.get();
+        } else if (empty) {
+            slot = nullptr;
+        } else {
+            slot = tile.get();
+            allocatedTiles.push_back(std::move(tile));
+        }
+    }
+
+    // And chunks that ended up with nothing protected don't need to exist.
+    for (auto& [index, chunk] : editedChunks) {
+        bool empty = std::all_of(std::begin(chunk->tiles), std::end(chunk->tiles),
+                                 [](const Tile* tile) {return !tile;});
+        if (empty) {
+            next->chunks[index] = nullptr;
+        } else {
+            next->chunks[index] = chunk.get();
+            allocatedChunks.push_back(std::move(chunk));
+        }
+    }
+    directories.push_back(std::move(next));
+    directory.store(directories.back().get(), std::memory_order_release);
+    return true;
+}
+
+void ProtectionMask::expand(uint64_t newWidth, uint64_t newHeight) {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    const Directory& current = *directory.load(std::memory_order_relaxed);
+    if (newWidth <= current.width && newHeight <= current.height) {
+        return;
+    }
+
+    // Partial edge tiles and chunks were already full size, and we never set bits outside the mask, so they carry
+    // over as is.
+    directories.push_back(copyDirectory(std::max(newWidth, current.width), std::max(newHeight, current.height),
+                                        current));
+    directory.store(directories.back().get(), std::memory_order_release);
+}
+
+uint64_t ProtectionMask::memoryUsage() {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    uint64_t total = (allocatedTiles.size() + 1) * sizeof(Tile) + allocatedChunks.size() * sizeof(Chunk);
+    for (const auto& previous : directories) {
+        total += sizeof(Directory) + previous->chunksWide * previous->chunksHigh * sizeof(const Chunk*);
+    }
+    return total;
+}
+
+// A community's target image for part of the canvas, see `Place::addTemplate`.
+struct TemplateImage {
+    // Pixels with this color are "don't care", they never count as a mismatch.
+    static constexpr uint64_t transparent = UINT64_MAX;
+
+    uint64_t x;
+    uint64_t y;
+    uint64_t width;
+    uint64_t height;
+
+    // `width` x `height`, in row order.
+    std::vector<uint64_t> colors;
+};
+
+// Live counts of how many pixels differ from each registered template, and which ones, so that "how is our art doing"
+// costs O(1) rather than a comparison against a whole Snapshot per template.
+//
+// Each template keeps a bit per pixel that's set where the canvas doesn't match, and a count of those bits. A spatial
+// map from tiles to the templates that overlap them means each write only looks at the few templates that could care
+// about it. The full comparison is only done once, when a template is added.
+//
+// Not thread safe, the Place only touches this while holding `updateMutex` (exclusively to write).
+class TemplateTracker {
+  public:
+    static constexpr uint64_t tileSize = PixelTable::tileSize;
+
+    // Registers a template, given the current colors of the area it covers (in the same order as its own colors), and
+    // returns its ID.
+    uint64_t add(TemplateImage image, const std::vector<uint64_t>& current);
+
+    // Returns false if there's no such template.
+    bool remove(uint64_t id);
+
+    // For a new palette, see `Place::setPalette`. Every template's colors are remapped like the canvas, and compared
+    // again, as two colors that used to differ can be the same now. `current` gets the current colors for a template.
+    void remapColors(const std::vector<uint64_t>& remap,
+                     const std::function<std::vector<uint64_t>(const TemplateImage&)>& current);
+
+    // A pixel was written.
+    void apply(const Pixel& p);
+
+    // How many pixels differ from the template. Returns false if there's no such template.
+    bool getMismatchCount(uint64_t id, uint64_t& count) const;
+
+    // Up to `limit` of the pixels that differ from the template, as canvas coordinates, in row order. Returns false if
+    // there's no such template.
+    bool getMismatches(uint64_t id, size_t limit, std::vector<std::pair<uint64_t, uint64_t>>& mismatches) const;
+
+    // Approximate bytes used.
+    uint64_t memoryUsage() const;
+
+  private:
+    struct Template {
+        TemplateImage image;
+
+        // A bit per pixel, in row order, set where the canvas doesn't match.
+        std::vector<uint64_t> mismatched;
+        uint64_t mismatchCount;
+    };
+
+    // The full comparison, setting `mismatched` and `mismatchCount` from scratch.
+    static void compare(Template& t, const std::vector<uint64_t>& current);
+
+    // Calls `f(key)` for every tile `image` overlaps.
+    template <typename F>
+    static void forEachTile(const TemplateImage& image, F f);
+
+    static uint64_t tileKey(uint64_t tileX, uint64_t tileY) {return (tileY << 32) | tileX;}
+
+    std::unordered_map<uint64_t, Template> templates;
+    uint64_t nextID = 1;
+
+    // Tile (see `tileKey`) to the IDs of every template overlapping it.
+    std::unordered_map<uint64_t, std::vector<uint64_t>> coverage;
+};
+
+template <typename F>
+void TemplateTracker::forEachTile(const TemplateImage& image, F f) {
+    for (uint64_t tileY = image.y / tileSize; tileY <= (image.y + image.height - 1) / tileSize; tileY++) {
+        for (uint64_t tileX = image.x / tileSize; tileX <= (image.x + image.width - 1) / tileSize; tileX++) {
+            f(tileKey(tileX, tileY));
+        }
+    }
+}
+
+void TemplateTracker::compare(Template& t, const std::vector<uint64_t>& current) {
+    size_t pixelCount = t.image.colors.size();
+    t.mismatched.assign((pixelCount + 63) / 64, 0);
+    t.mismatchCount = 0;
+
+    // 64 pixels at a time into one word of the bitmap. This is deliberately branch free over flat arrays so the
+    // compiler can vectorize it.
+    const uint64_t* target = t.image.colors.data();
+    const uint64_t* actual = current.data();
+    for (size_t word = 0; word < t.mismatched.size(); word++) {
+        size_t begin = word * 64;
+        size_t count = std::min<size_t>(64, pixelCount - begin);
+        uint64_t bits = 0;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t want = target[begin + i];
+            uint64_t differs = (want != actual[begin + i]) & (want != TemplateImage::transparent);
+            bits |= differs << i;
+        }
+        t.mismatched[word] = bits;
+        t.mismatchCount += __builtin_popcountll(bits);
+    }
+}
+
+uint64_t TemplateTracker::add(TemplateImage image, const std::vector<uint64_t>& current) {
+    uint64_t id = nextID++;
+    Template& added = templates[id];
+    added.image = std::move(image);
+    compare(added, current);
+    if (added.image.width && added.image.height) {
+        forEachTile(added.image, [this, id](uint64_t key) {coverage[key].push_back(id);});
+    }
+    return id;
+}
+
+void TemplateTracker::remapColors(const std::vector<uint64_t>& remap,
+                                  const std::function<std::vector<uint64_t>(const TemplateImage&)>& current) {
+    for (auto& [id, t] : templates) {
+        for (uint64_t& color : t.image.colors) {
+            color = color < remap.size() ? remap[color] : color;
+        }
+        compare(t, current(t.image));
+    }
+}
+
+bool TemplateTracker::remove(uint64_t id) {
+    auto it = templates.find(id);
+    if (it == templates.end()) {
+        return false;
+    }
+    if (it->second.image.width && it->second.image.height) {
+        forEachTile(it->second.image, [this, id](uint64_t key) {
+            std::vector<uint64_t>& ids = coverage[key];
+            ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+            if (ids.empty()) {
+                coverage.erase(key);
+            }
+        });
+    }
+    templates.erase(it);
+    return true;
+}
+
+void TemplateTracker::apply(const Pixel& p) {
+    if (coverage.empty()) {
+        return;
+    }
+    auto covering = coverage.find(tileKey(p.getX() / tileSize, p.getY() / tileSize));
+    if (covering == coverage.end()) {
+        return;
+    }
+    for (uint64_t id : covering->second) {
+        Template& t = templates.find(id)->second;
+        const TemplateImage& image = t.image;
+        if (p.getX() < image.x || p.getY() < image.y || p.getX() - image.x >= image.width ||
+            p.getY() - image.y >= image.height) {
+            continue;
+        }
+        uint64_t index = (p.getY() - image.y) * image.width + p.getX() - image.x;
+        uint64_t target = image.colors[index];
+        bool wasMismatched = (t.mismatched[index / 64] >> (index % 64)) & 1;
+        bool isMismatched = target != TemplateImage::transparent && target != p.getColor();
+        if (wasMismatched != isMismatched) {
+            t.mismatched[index / 64] ^= uint64_t{1} << (index % 64);
+            t.mismatchCount += isMismatched ? 1 : -1;
+        }
+    }
+}
+
+bool TemplateTracker::getMismatchCount(uint64_t id, uint64_t& count) const {
+    auto it = templates.find(id);
+    if (it == templates.end()) {
+        return false;
+    }
+    count = it->second.mismatchCount;
+    return true;
+}
+
+bool TemplateTracker::getMismatches(uint64_t id, size_t limit,
+                                    std::vector<std::pair<uint64_t, uint64_t>>& mismatches) const {
+    auto it = templates.find(id);
+    if (it == templates.end()) {
+        return false;
+    }
+    const Template& t = it->second;
+    mismatches.clear();
+    for (size_t word = 0; word < t.mismatched.size() && mismatches.size() < limit; word++) {
+        // Only visit the set bits.
+        for (uint64_t bits = t.mismatched[word]; bits && mismatches.size() < limit; bits &= bits - 1) {
+            uint64_t index = word * 64 + __builtin_ctzll(bits);
+            mismatches.emplace_back(t.image.x + index % t.image.width, t.image.y + index / t.image.width);
+        }
+    }
+    return true;
+}
+
+uint64_t TemplateTracker::memoryUsage() const {
+    uint64_t total = 0;
+    for (const auto& [id, t] : templates) {
+        total += sizeof(Template) + t.image.colors.capacity() * sizeof(uint64_t) +
+                 t.mismatched.capacity() * sizeof(uint64_t);
+    }
+    for (const auto& [key, ids] : coverage) {
+        total += sizeof(key) + sizeof(ids) + ids.capacity() * sizeof(uint64_t);
+    }
+    return total;
+}
+
+// A write that's waiting to be sequenced, see `Place::submit`.
+struct Submission {
+    Pixel pixel;
+
+    // When this was admitted, in steady clock microseconds, used to measure how long writes wait to be sequenced.
+    uint64_t admittedAt;
+
+    // Optional, called from the sequencer thread with the result of `Place::update` once this has been sequenced.
+    std::function<void(bool)> done;
+};
+
+// A bounded, lock-free, multi-producer queue of Submissions. Any number of threads can `push`, and the sequencer
+// thread `pop`s. This is Dmitry Vyukov's bounded MPMC queue: every cell has a sequence number that tells producers and
+// consumers whose turn it is to use the cell, so the only contention is on the two position counters.
+class IngestionQueue {
+  public:
+    // Capacity is rounded up to a power of two.
+    IngestionQueue(size_t capacity);
+
+    // Returns false if the queue is full.
+    bool push(Submission&& submission);
+
+    // Returns false if the queue is empty.
+    bool pop(Submission& submission);
+
+    // Approximate, as it can change while you're looking at it.
+    size_t depth() const;
+
+    size_t getCapacity() const {return cells.size();}
+
+  private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        std::optional<Submission> submission;
+    };
+
+    static size_t roundUpCapacity(size_t capacity);
+
+    std::vector<Cell> cells;
+    const size_t mask;
+
+    // Keep the producer and consumer positions on separate cache lines.
+    alignas(64) std::atomic<size_t> enqueuePosition;
+    alignas(64) std::atomic<size_t> dequeuePosition;
+};
+
+size_t IngestionQueue::roundUpCapacity(size_t capacity) {
+    size_t rounded = 2;
+    while (rounded < capacity) {
+        rounded *= 2;
+    }
+    return rounded;
+}
+
+IngestionQueue::IngestionQueue(size_t capacity) :
+    cells(roundUpCapacity(capacity)),
+    mask(cells.size() - 1),
+    enqueuePosition(0),
+    dequeuePosition(0)
+{
+    for (size_t i = 0; i < cells.size(); i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool IngestionQueue::push(Submission&& submission) {
+    size_t position = enqueuePosition.load(std::memory_order_relaxed);
+    while (true) {
+        Cell& cell = cells[position & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+        if (difference == 0) {
+            // The cell is free for this position, try to claim it.
+            if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                cell.submission.emplace(std::move(submission));
+                cell.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            // The consumer hasn't gotten to this cell from the last time around yet, we're full.
+            return false;
+        } else {
+            // Another producer beat us to it.
+            position = enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool IngestionQueue::pop(Submission& submission) {
+    size_t position = dequeuePosition.load(std::memory_order_relaxed);
+    while (true) {
+        Cell& cell = cells[position & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+        if (difference == 0) {
+            if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                submission = std::move(*cell.submission);
+                cell.submission.reset();
+
+                // Free for the producer that's one full lap ahead of us.
+                cell.sequence.store(position + mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            // Nothing written here yet, we're empty.
+            return false;
+        } else {
+            position = dequeuePosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+size_t IngestionQueue::depth() const {
+    size_t enqueued = enqueuePosition.load(std::memory_order_relaxed);
+    size_t dequeued = dequeuePosition.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+// A hashed timer wheel: timers go in one of `slotCount` buckets by the tick they're due in, and advancing the wheel
+// only looks at the buckets for the ticks that have passed. Scheduling and firing are O(1) per timer. Timers further
+// out than one turn of the wheel just sit in their bucket until a later turn, when they're actually due.
+//
+// Each timer is just a key, it's up to the owner to know what the key means. Not thread safe.
+class TimerWheel {
+  public:
+    TimerWheel(uint64_t tickUs, size_t slotCount);
+
+    void schedule(uint64_t key, uint64_t dueUs);
+
+    // Calls `expired(key)` for every timer due at or before `nowUs`, and forgets them.
+    void advance(uint64_t nowUs, const std::function<void(uint64_t)>& expired);
+
+    bool empty() const {return count == 0;}
+
+    // Forgets every timer.
+    void clear();
+
+  private:
+    struct Timer {
+        uint64_t key;
+        uint64_t dueUs;
+    };
+
+    const uint64_t tickUs;
+    std::vector<std::vector<Timer>> slots;
+
+    // Everything in ticks before this has been fired. Zero until the first `advance`.
+    uint64_t nextTick = 0;
+    size_t count = 0;
+};
+
+TimerWheel::TimerWheel(uint64_t tickUs, size_t slotCount) :
+    tickUs(tickUs),
+    slots(slotCount)
+{
+}
+
+void TimerWheel::schedule(uint64_t key, uint64_t dueUs) {
+    // Round up, so that by the time we look at a bucket everything in it for this turn is due. Anything already due
+    // goes in the next bucket we'll look at.
+    uint64_t tick = std::max((dueUs + tickUs - 1) / tickUs, nextTick);
+    slots[tick % slots.size()].push_back({key, dueUs});
+    count++;
+}
+
+void TimerWheel::clear() {
+    for (std::vector<Timer>& slot : slots) {
+        slot.clear();
+    }
+    nextTick = 0;
+    count = 0;
+}
+
+void TimerWheel::advance(uint64_t nowUs, const std::function<void(uint64_t)>& expired) {
+    uint64_t nowTick = nowUs / tickUs;
+    if (nextTick == 0) {
+        // The first time, there's nothing in the past to catch up on beyond what's in the buckets.
+        nextTick = nowTick > slots.size() ? nowTick - slots.size() : 0;
+    }
+
+    // If we fell more than a whole turn behind, every bucket is due, but only once.
+    uint64_t firstTick = std::max(nextTick, nowTick + 1 > slots.size() ? nowTick + 1 - slots.size() : 0);
+    for (uint64_t tick = firstTick; tick <= nowTick && count; tick++) {
+        std::vector<Timer>& slot = slots[tick % slots.size()];
+        for (size_t i = 0; i < slot.size(); ) {
+            if (slot[i].dueUs <= nowUs) {
+                uint64_t key = slot[i].key;
+                slot[i] = slot.back();
+                slot.pop_back();
+                count--;
+                expired(key);
+            } else {
+                i++;
+            }
+        }
+    }
+    nextTick = std::max(nextTick, nowTick + 1);
+}
+
+// Configuration for the admission control in front of the sequencer, see `Place::startSequencer`.
+struct AdmissionLimits {
+    // Submissions are rejected once this many are waiting to be sequenced.
+    size_t maxQueueDepth = 4096;
+
+    // Submissions are also rejected once recent writes have been waiting longer than this to be sequenced.
+    uint64_t targetLatencyUs = 10'000;
+
+    // The smallest "retry after" hint we'll hand back, so rejected clients don't come right back.
+    uint64_t minRetryAfterUs = 1'000;
+
+    // If set, a submission from a user that's still on cooldown isn't rejected, it's held (one per user) and applied
+    // by the sequencer as soon as the cooldown is over. A newer submission from the same user replaces the held one.
+    // This saves clients from retrying right at the end of their cooldown, all at once.
+    bool deferCooldownWrites = false;
+
+    // Low latency mode. The sequencer busy-polls the queue when it runs dry rather than going to sleep (which costs a
+    // wakeup, tens of microseconds, for the next write), and only parks after spinning for a while with nothing to do.
+    // How long adapts between `minSpinUs` and `maxSpinUs`: it doubles whenever a write turns up during the spin, and
+    // halves whenever the spin runs out. Set both to UINT64_MAX to never park at all.
+    bool busyPoll = false;
+    uint64_t minSpinUs = 100;
+    uint64_t maxSpinUs = 100'000;
+
+    // Pins the sequencer thread to this core, which should be isolated from everything else (i.e., with `isolcpus`),
+    // or busy polling just steals time from whatever else was scheduled there. -1 doesn't pin.
+    int sequencerCore = -1;
+};
+
+// A reader-writer lock that scales with the number of reading cores and prefers writers, for `updateMutex`.
+//
+// With `std::shared_mutex`, every reader updates the same reader count, so that cache line bounces between every core
+// that reads, and a steady stream of readers can keep a writer waiting forever. Here, readers are spread over a set
+// of per-core-ish counters (each on its own cache line, picked once per thread), so readers on different cores don't
+// touch each other's lines at all. A writer first announces itself with `writerPending`, which turns away any new
+// readers, then waits for the counters to drain. Readers that are turned away wait for the writer to finish.
+//
+// Writers are serialized with a plain mutex, so they sleep while another writer holds the lock. Readers and the
+// writer draining readers spin, then yield, as they usually only wait for short critical sections. Not always though,
+// `Place::save` and `Place::freeze` hold the shared lock for a whole file write, so after a while they go to sleep on
+// a condition variable. Whoever releases a slot or the writer flag only touches that if someone is asleep.
+//
+// This has the same interface as `std::shared_mutex`, so it works with `std::unique_lock` and `std::shared_lock`.
+class ScalableSharedMutex {
+  public:
+    void lock();
+    bool try_lock();
+    void unlock();
+
+    void lock_shared();
+    bool try_lock_shared();
+    void unlock_shared();
+
+  private:
+    static constexpr size_t readerSlots = 64;
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> count{0};
+    };
+
+    // Which slot this thread reads with. Threads are handed slots round robin the first time they read.
+    static ReaderSlot& slotFor(ReaderSlot* slots);
+
+    // Spins on `condition` for a while, then yields for a while, then sleeps until `wake` is called and it holds.
+    template <typename Condition>
+    void waitUntil(Condition condition);
+
+    // Wakes anyone asleep in `waitUntil`. Has to be called after anything that might make their condition true.
+    void wake();
+
+    bool noReaders() const;
+
+    ReaderSlot slots[readerSlots];
+    alignas(64) std::atomic<bool> writerPending{false};
+    std::mutex writerMutex;
+
+    // For `waitUntil` and `wake`. `sleepers` is only written by threads about to sleep or just woken, so it's almost
+    // always zero and the line stays shared between every core that releases the lock.
+    alignas(64) std::atomic<uint64_t> sleepers{0};
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+};
+
+ScalableSharedMutex::ReaderSlot& ScalableSharedMutex::slotFor(ReaderSlot* slots) {
+    static std::atomic<size_t> nextSlot{0};
+    thread_local size_t slot = nextSlot.fetch_add(1, std::memory_order_relaxed) % readerSlots;
+    return slots[slot];
+}
+
+template <typename Condition>
+void ScalableSharedMutex::waitUntil(Condition condition) {
+    for (int spins = 0; spins < 1000; spins++) {
+        if (condition()) {
+            return;
+        }
+        if (spins > 100) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Whoever makes the condition true changes it and then checks `sleepers`, we bump `sleepers` and then check the
+    // condition. Everything involved is sequentially consistent, so either we see the change or they see us and take
+    // `sleepMutex` to wake us, which they can't do between our check and our wait.
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    sleepers.fetch_add(1);
+    sleepCondition.wait(lock, condition);
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ScalableSharedMutex::wake() {
+    if (sleepers.load()) {
+        // Taking the mutex means nobody is between checking their condition and going to sleep.
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        sleepCondition.notify_all();
+    }
+}
+
+bool ScalableSharedMutex::noReaders() const {
+    // Sequentially consistent, as in `lock`, a weaker load could miss a reader that's already past `writerPending`.
+    for (const ReaderSlot& slot : slots) {
+        if (slot.count.load()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ScalableSharedMutex::lock() {
+    writerMutex.lock();
+
+    // Readers increment their slot and then check this, we set this and then check their slots. Both are sequentially
+    // consistent, so at least one of us sees the other.
+    writerPending.store(true);
+    waitUntil([this] {return noReaders();});
+}
+
+bool ScalableSharedMutex::try_lock() {
+    if (!writerMutex.try_lock()) {
+        return false;
+    }
+    writerPending.store(true);
+    if (!noReaders()) {
+        writerPending.store(false);
+        writerMutex.unlock();
+        wake();
+        return false;
+    }
+    return true;
+}
+
+void ScalableSharedMutex::unlock() {
+    writerPending.store(false);
+    writerMutex.unlock();
+    wake();
+}
+
+void ScalableSharedMutex::lock_shared() {
+    while (!try_lock_shared()) {
+        waitUntil([this] {return !writerPending.load();});
+    }
+}
+
+bool ScalableSharedMutex::try_lock_shared() {
+    ReaderSlot& slot = slotFor(slots);
+    slot.count.fetch_add(1);
+    if (!writerPending.load()) {
+        return true;
+    }
+
+    // A writer is waiting or has the lock, get out of its way.
+    slot.count.fetch_sub(1);
+    wake();
+    return false;
+}
+
+void ScalableSharedMutex::unlock_shared() {
+    slotFor(slots).count.fetch_sub(1);
+    wake();
+}
+
+// A change to the dimensions of a Place, see `Place::expand`.
+struct CanvasEpoch {
+    uint64_t epoch;
+
+    // The first record number written with these dimensions.
+    uint64_t recordNumber;
+    uint64_t width;
+    uint64_t height;
+};
+
+// A palette for a Place, see `Place::setPalette`.
+struct PaletteEpoch {
+    uint64_t epoch;
+
+    // The first record number written with this palette. Colors in the update log are indexes into the palette of
+    // the epoch they were written in.
+    uint64_t recordNumber;
+
+    // 0xRRGGBB for each color index. Empty for "no palette", any color goes.
+    std::vector<uint32_t> colors;
+
+    // From the previous epoch's color indexes to this one's.
+    std::vector<uint64_t> remap;
+};
+
+// Result of `Place::submit`.
+struct Admission {
+    // Whether the submission was taken, i.e., `done` will be called with the result. This isn't the result, a write
+    // that's accepted can still be refused by the sequencer (cooldown, palette) or right away (see `Place::submit`).
+    bool accepted;
+
+    // If not accepted, a hint for how long the client should wait before trying again.
+    uint64_t retryAfterUs;
+};
+
+class Place {
+  public:
+
+    // This gets the current representation of the Place. Concurrent callers share the work: if a call is already
+    // building a snapshot that's at least as new as the latest update when we arrived, we wait for it and return a
+    // copy of its result (which only copies tile pointers), rather than building our own.
+    Snapshot getCurrentState();
+
+    // For readers that can live with a slightly old canvas (thumbnails, dashboards). If the last snapshot published
+    // by `getCurrentState` is at most `maxStaleness` old, or nothing has changed since, this returns it as is: no copy,
+    // no catching up, and no `updateMutex`. Otherwise, it falls back to `getCurrentState`.
+    std::shared_ptr<const Snapshot> getState(std::chrono::microseconds maxStaleness);
+
+    // Applies the update specified in the given pixel. Returns true if success, false if failure.
+    // Failure cases can be:
+    // 1. The pixel doesn't fit in the Place.
+    // 2. The user has written to the Place too recently.
+    // 3. The pixel is protected, see `setProtection`.
+    // 4. There's a palette, and the color isn't in it.
+    bool update(const Pixel& p);
+
+    // Applies a whole set of pixels at once, for admin tools (rollbacks, restoring art, event overlays). These are
+    // appended as a contiguous run of records with the same timestamp under a single lock, and aren't subject to the
+    // cooldown. Nobody can observe part of a stamp: `getCurrentState`, `getPixel` and `getRegion` see all of it or
+    // none of it. Returns false, and applies nothing, if any pixel doesn't fit in the Place or, when there's a palette,
+    // has a color that isn't in it.
+    bool stamp(const std::vector<Pixel>& pixels);
+
+    // Puts a rectangle back the way it was at `timestamp` (unix epoch in us), i.e., after a raid. Only the region is
+    // reconstructed, from the nearest keyframe before then and the history of the tiles it covers, and only pixels
+    // whose color differs from now are written, as a single `stamp`. Pixels get back the userID that had them at the
+    // time, pixels that were still blank are made blank again (see `Pixel::isBlank`), unplaced and owned by nobody,
+    // even if the current color is already the default. `reverted` is set to how many pixels were
+    // written. Returns false, and changes nothing, if the rectangle doesn't fit in the Place, or if any pixel would get
+    // a color that isn't in the current palette (i.e., it was painted before the first palette, with no remap for it).
+    bool revert(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight, uint64_t timestamp,
+                size_t& reverted);
+
+    // Queues an update to be applied by the sequencer thread, rather than contending for `updateMutex` directly. This
+    // fails fast when the sequencer is falling behind (see `AdmissionLimits`), with a hint for when to retry, so that
+    // during a spike latency stays bounded rather than everyone piling up behind the lock. If accepted, `done` (if
+    // given) is later called on the sequencer thread with the same result `update` would have returned. With
+    // `AdmissionLimits::deferCooldownWrites`, that's once the write is finally applied (true) or replaced (false).
+    // Nothing is accepted unless the sequencer is running. Pixels outside the Place or in a protected area are checked
+    // before queueing and never reach the sequencer, but they're still accepted, with `done(false)` called before this
+    // returns. Only `done` says whether a write landed.
+    Admission submit(const Pixel& p, std::function<void(bool)> done = nullptr);
+
+    // Freezes and unfreezes rectangles of the Place, for moderators. The changes are applied in order, and take effect
+    // all at once. From then on, `update` and `submit` reject writes to protected pixels straight away, before taking
+    // any lock, and writes held by the sequencer (see `AdmissionLimits::deferCooldownWrites`) are rejected when they
+    // come due. `stamp` isn't affected, it's for admins. Returns false, and changes nothing, if any rectangle doesn't
+    // fit in the Place.
+    bool setProtection(const std::vector<ProtectionChange>& changes);
+    bool isProtected(uint64_t x, uint64_t y) const {return protectionMask.isProtected(x, y);}
+
+    // Starts and stops the sequencer thread that applies `submit`ted updates. Stopping applies anything still queued,
+    // and should only be done once nothing else is calling `submit`.
+    void startSequencer(const AdmissionLimits& limits = AdmissionLimits());
+    void stopSequencer();
+
+    // Looks up a single pixel without copying the whole state, and without taking `updateMutex`, see `PixelTable`.
+    // This reflects every successful `update` so far. Returns false if the pixel doesn't fit in the Place.
+    bool getPixel(uint64_t x, uint64_t y, PixelInfo& info) const;
+
+    // Like `getPixel`, for a small rectangle, returned in row order. The rectangle is read consistently, it won't
+    // include half of a concurrent change. An empty rectangle (no width or no height) that starts in the Place is
+    // fine, it gives an empty region. `region` can be a std::pmr::vector, to read into a `RequestArena`.
+    template <typename Region>
+    bool getRegion(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight, Region& region) const;
+
+    // Starts publishing snapshots to the named POSIX shared memory region (i.e., "/rplace") whenever the recent
+    // snapshot is replaced, see `SharedSnapshotExport`. Call this before serving traffic. Returns false if the region
+    // can't be created, or the Place is too big to export (see `SharedSnapshotExport::maxPixels`).
+    bool exportSharedMemory(const std::string& name);
+
+    // Writes a checkpoint of the Place (the dimensions and every update) to `path`, replacing it atomically. Writers
+    // are blocked while this runs, readers aren't. The data is synced to disk before it replaces `path`, and saves of
+    // the same Place run one at a time. Returns false if the file can't be written.
+    bool save(const std::string& path);
+
+    // Opposite of `save`. This is only valid on a Place that hasn't been written to yet. Returns false if the file
+    // can't be read or isn't a checkpoint, in which case the Place is left unchanged.
+    bool load(const std::string& path);
+
+    // Ends the event. From here on the Place refuses every write (`update`, `submit`, `stamp`, `revert`, `expand`,
+    // `setPalette` and `load`), and its whole history is written to `path` as a `FrozenArchive`, which is what should
+    // serve it from then on. Returns false if the archive couldn't be written, the Place is read-only either way.
+    bool freeze(const std::string& path);
+    bool isFrozen() const {return frozen.load(std::memory_order_acquire);}
+
+    // How many pixels `userID` currently owns (was the last to write), and the users that own the most, as up to `k`
+    // (userID, pixels owned) pairs, most first. Both are kept up to date on every write, so the leaderboard costs
+    // O(k), not a scan of the canvas.
+    uint64_t getOwnedPixels(uint64_t userID);
+    std::vector<std::pair<uint64_t, uint64_t>> getLeaderboard(size_t k);
+
+    // Registers a community's template, which is compared against the canvas once now, and then kept up to date on
+    // every write, so that asking how many pixels differ (or where) doesn't compare anything. Returns false if the
+    // template is empty, doesn't fit in the Place, or doesn't have a color for every pixel.
+    bool addTemplate(const TemplateImage& image, uint64_t& id);
+    bool removeTemplate(uint64_t id);
+
+    // How many pixels differ from the template, in O(1), and up to `limit` of where they are. These return false if
+    // there's no such template.
+    bool getTemplateMismatchCount(uint64_t id, uint64_t& count);
+    bool getTemplateMismatches(uint64_t id, size_t limit, std::vector<std::pair<uint64_t, uint64_t>>& mismatches);
+
+    // Number of updates so far. This doesn't lock.
+    uint64_t getRecordCount() const {return recordCount.load(std::memory_order_acquire);}
+
+    // Approximate bytes used by this Place, for enforcing memory budgets.
+    uint64_t memoryUsage();
+
+    // Returns the difference since a particular update, i.e., every update from `fromRecordNumber` (inclusive) on, or
+    // the first `limit` of them.
+    std::vector<Update> getDiff(uint64_t fromRecordNumber, size_t limit = SIZE_MAX);
+
+    // Like the above, appending to `diff`, which can be a std::pmr::vector, to build it in a `RequestArena`.
+    template <typename Diff>
+    void getDiff(uint64_t fromRecordNumber, Diff& diff, size_t limit = SIZE_MAX);
+
+    // Grows the Place while it's live. Existing pixels, tiles and the update log aren't touched, the new area starts
+    // out blank and shares a single blank tile until it's written to, so this costs a pointer per tile rather than a
+    // copy of the grid. Each expansion starts a new canvas epoch. Returns false if either dimension would shrink,
+    // that still requires creating a new Place, or would be more than `maxDimension`.
+    bool expand(uint64_t newWidth, uint64_t newHeight);
+
+    // The largest width or height `expand` and `load` accept. The pixel table and the protection mask each keep a
+    // pointer for every chunk (4096 x 4096 pixels) of the grid, blank or not, so at this size that's a million each.
+    static constexpr uint64_t maxDimension = 1 << 22;
+
+    // How many times the Place has been expanded, and the dimensions for each epoch.
+    uint64_t getEpoch() const {return canvasEpoch.load(std::memory_order_acquire);}
+    std::vector<CanvasEpoch> getEpochs();
+
+    // Switches to a new palette mid-stream, i.e., when an event adds colors. `remap` maps every color index in the
+    // current palette to one in `colors`, and the default color has to stay where it is. The update log isn't
+    // touched, its records keep the color indexes they were written with, and `getPaletteEpochs` says which palette
+    // each record number is in. Everything that holds the current state (snapshots, `getPixel`, templates) is
+    // remapped in place, which takes a pass over the painted tiles under the write lock. That pass is done inline, so
+    // every writer (`update`, the sequencer, `stamp`, `revert`) waits for it, which on a big, busy canvas is a stall
+    // of however long it takes to rewrite every painted tile. `getPixel` and `getRegion` don't take the lock and
+    // aren't held up. Snapshots that readers already have aren't changed, they're copied on write. Returns false, and
+    // changes nothing, if `remap` doesn't fit the palettes.
+    bool setPalette(const std::vector<uint32_t>& colors, const std::vector<uint64_t>& remap);
+    uint64_t getPaletteEpoch() const {return paletteEpoch.load(std::memory_order_acquire);}
+    std::vector<PaletteEpoch> getPaletteEpochs();
+
+    // The dimensions can only grow, see `expand`.
+    std::atomic<uint64_t> width{1000};
+    std::atomic<uint64_t> height{1000};
+
+    // Default constructor.
+    Place();
+
+    // A Place of the given size. Nothing is allocated for the area until it's written to, so this can be huge (i.e.,
+    // 100k x 100k) as long as most of it stays blank.
+    Place(uint64_t initialWidth, uint64_t initialHeight);
+    ~Place();
+
+  private:
+    // `getCurrentState`, without the copy at the end.
+    std::shared_ptr<const Snapshot> sharedCurrentState();
+
+    // Does the work for `getCurrentState`, without any of the sharing between callers.
+    std::shared_ptr<const Snapshot> materializeCurrentState();
+
+    // The body of `update`, for callers that already hold `updateMutex` exclusively and have the current time.
+    bool updateLocked(const Pixel& p, uint64_t currentTime);
+
+    // The body of `stamp`, for callers that already hold `updateMutex` exclusively and have checked the pixels fit.
+    void stampLocked(const std::vector<Pixel>& pixels);
+
+    // Which `tileHistory` entry a pixel's writes go in.
+    static uint64_t historyKey(uint64_t x, uint64_t y) {
+        return ((y / Snapshot::tileSize) << 32) | (x / Snapshot::tileSize);
+    }
+
+    // The sequencer thread's main loop.
+    void runSequencer();
+
+    // When the given user's cooldown is over (in the same units as `Update::timestamp`). Requires `updateMutex`.
+    uint64_t cooldownEndsLocked(uint64_t userID) const;
+
+    // A color from the given palette epoch, in the current palette, and the palette epoch a record was written in.
+    // Both require `updateMutex`.
+    uint64_t translateColorLocked(uint64_t color, uint64_t fromPaletteEpoch) const;
+    uint64_t paletteEpochForLocked(uint64_t recordNumber) const;
+
+    // Whether a color can be written now, i.e., there's no palette or it's in the current one. Requires `updateMutex`.
+    bool inPaletteLocked(uint64_t color) const;
+
+    // Map from userIDs to timestamps (unix epoch in us).
+    std::map<uint64_t, uint64_t> mostRecentUpdatesPerUser;
+
+    // How long a user has to wait between updates.
+    static constexpr uint64_t cooldownUs = /*60 * */5 * 1'000'000; // TODO: Actually seconds, update later!
+
+    // List of all updates from the beginning of time.
+    std::vector<Update> updates;
+
+    Snapshot workingSnapshot;
+    std::shared_ptr<const Snapshot> recentSnapshot;
+
+    // Always current, written by `update` and read without locking by `getPixel`.
+    PixelTable pixelTable;
+
+    // For `revert`: the record number of every write to each tile (see `historyKey`), in order, and snapshots from
+    // every `keyframeInterval` updates or so, so that reverting only has to walk back through a tile's history as far
+    // as the keyframe before. Keyframes share tiles with each other and with the working snapshot, but each one keeps
+    // whatever's changed since alive, so we only keep the last `maxKeyframes`. Both are guarded by `updateMutex`.
+    std::unordered_map<uint64_t, std::vector<uint64_t>> tileHistory;
+    std::deque<std::shared_ptr<const Snapshot>> keyframes;
+    static constexpr uint64_t keyframeInterval = 1 << 16;
+    static constexpr size_t maxKeyframes = 16;
+
+    // Who owns how much of the canvas, see `getLeaderboard`. Guarded by `updateMutex`, updated by `pixelTable`.
+    OwnershipCounts ownership;
+
+    // See `addTemplate`. Guarded by `updateMutex`.
+    TemplateTracker templates;
+
+    // See `setProtection`. This has its own writer lock, it's never written under `updateMutex` except to expand it.
+    ProtectionMask protectionMask;
+
+    // Mutex for locking around updates.
+    ScalableSharedMutex updateMutex;
+
+    // See `freeze`. Only set under `updateMutex`, so writers check it once they have the lock.
+    std::atomic<bool> frozen{false};
+
+    // Optional, set by `exportSharedMemory`. It's replaced when the Place is expanded, so it's guarded by its own
+    // mutex, which also keeps us from copying a snapshot into it from more than one thread at a time.
+    std::unique_ptr<SharedSnapshotExport> sharedExport;
+    std::mutex sharedExportMutex;
+
+    // Held for the whole of `save`, so two saves of this Place can't interleave.
+    std::mutex saveMutex;
+
+    // Single flight state for `getCurrentState`, guarded by `materializeMutex`. While a caller is building a snapshot,
+    // `materializing` is set, and when it's done its result goes in `lastMaterialized` for everybody that waited.
+    std::mutex materializeMutex;
+    std::condition_variable materialized;
+    bool materializing = false;
+    std::shared_ptr<const Snapshot> lastMaterialized;
+
+    // The last snapshot built by `getCurrentState`, and when (in steady clock microseconds), for `getState`. This is
+    // only ever replaced as a whole, with `std::atomic_store`.
+    struct PublishedState {
+        std::shared_ptr<const Snapshot> snapshot;
+        uint64_t publishedAtUs;
+    };
+    std::shared_ptr<const PublishedState> publishedState;
+
+    // `updates.size()`, readable without the lock. Set after each append.
+    std::atomic<uint64_t> recordCount{0};
+
+    // Every set of dimensions the Place has had, guarded by `updateMutex`. `canvasEpoch` is the last entry's `epoch`.
+    std::vector<CanvasEpoch> canvasEpochs;
+    std::atomic<uint64_t> canvasEpoch{0};
+
+    // Same for palettes, see `setPalette`.
+    std::vector<PaletteEpoch> paletteEpochs{{0, 0, {}, {}}};
+    std::atomic<uint64_t> paletteEpoch{0};
+
+    // Sequencer state, see `submit`. `ingestionQueue` is created by the first `startSequencer`.
+    AdmissionLimits admissionLimits;
+    std::unique_ptr<IngestionQueue> ingestionQueue;
+    std::thread sequencerThread;
+    std::atomic<bool> sequencerRunning{false};
+
+    // Recent time writes waited to be sequenced (an exponentially weighted moving average), in microseconds.
+    std::atomic<uint64_t> sequencingLatencyUs{0};
+
+    // Writes held until their user's cooldown is over, by userID, and the timers for them, keyed by userID. Only the
+    // sequencer thread touches these.
+    struct DeferredWrite {
+        Pixel pixel;
+        std::function<void(bool)> done;
+    };
+    std::unordered_map<uint64_t, DeferredWrite> deferredWrites;
+    TimerWheel deferredTimers{10'000, 1024};
+
+    // The sequencer sleeps on this when there's nothing to do, producers wake it if `sequencerParked` is set.
+    std::mutex sequencerMutex;
+    std::condition_variable sequencerWakeup;
+    std::atomic<bool> sequencerParked{false};
+};
+
+// Current time from a clock that doesn't jump, in microseconds. Only useful for measuring intervals.
+static uint64_t steadyMicroseconds() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Pins the calling thread to one core. Returns false if there's no such core or we aren't allowed.
+static bool pinCurrentThread(int core) {
+    if (core < 0 || core >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+// Goes in busy-poll loops, so spinning doesn't starve a sibling hyperthread or burn more power than it has to.
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// A fresh name next to `path` to write a file at before `commitFile` moves it into place. It's unique, so two writers
+// of the same path (in this process or another) never write into each other's file.
+static std::string temporaryPathFor(const std::string& path) {
+    static std::atomic<uint64_t> count{0};
+    return path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(count++);
+}
+
+// Syncs the (closed) file at `temporaryPath` to disk and renames it to `path`, so `path` is always either the old file
+// or the complete new one, even after a crash. Removes the temporary file if anything fails.
+static bool commitFile(const std::string& temporaryPath, const std::string& path) {
+    int fd = open(temporaryPath.c_str(), O_RDONLY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!synced || std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+        std::remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Current unix time, in microseconds. This is what goes in `Update::timestamp`.
+static uint64_t wallMicroseconds() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+Place::Place() :
+    Place(1000, 1000)
+{
+}
+
+Place::Place(uint64_t initialWidth, uint64_t initialHeight) :
+    width(initialWidth),
+    height(initialHeight),
+    workingSnapshot(width, height),
+    recentSnapshot(std::make_shared<Snapshot>(width, height)),
+    pixelTable(width, height),
+    protectionMask(width, height),
+    canvasEpochs{{0, 0, width, height}}
+{
+}
+
+Place::~Place() {
+    stopSequencer();
+}
+
+bool Place::getPixel(uint64_t x, uint64_t y, PixelInfo& info) const {
+    return pixelTable.get(x, y, info);
+}
+
+template <typename Region>
+bool Place::getRegion(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight, Region& region) const {
+    return pixelTable.getRegion(x, y, regionWidth, regionHeight, region);
+}
+
+bool Place::exportSharedMemory(const std::string& name) {
+    std::lock_guard<std::mutex> lock(sharedExportMutex);
+    sharedExport.reset();
+    auto candidate = std::make_unique<SharedSnapshotExport>(width, height);
+    if (!candidate->open(name)) {
+        return false;
+    }
+    sharedExport = std::move(candidate);
+    return true;
+}
+
+bool Place::expand(uint64_t newWidth, uint64_t newHeight) {
+    {
+        std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+        if (frozen.load(std::memory_order_relaxed) || newWidth < width || newHeight < height ||
+            newWidth > maxDimension || newHeight > maxDimension) {
+            return false;
+        }
+        if (newWidth == width && newHeight == height) {
+            return true;
+        }
+        workingSnapshot.expand(newWidth, newHeight);
+        pixelTable.expand(newWidth, newHeight);
+        protectionMask.expand(newWidth, newHeight);
+        canvasEpochs.push_back({canvasEpochs.back().epoch + 1, updates.size(), newWidth, newHeight});
+
+        // Only now that everything can hold the new area do we let updates into it.
+        width.store(newWidth);
+        height.store(newHeight);
+        canvasEpoch.store(canvasEpochs.back().epoch, std::memory_order_release);
+    }
+
+    // The shared memory region is a fixed size, so it's replaced with one that fits. Readers see the old one marked
+    // retired and re-open it by name. It gets filled in the next time a snapshot is published.
+    std::lock_guard<std::mutex> lock(sharedExportMutex);
+    if (sharedExport) {
+        std::string name = sharedExport->getName();
+        sharedExport.reset();
+        auto replacement = std::make_unique<SharedSnapshotExport>(newWidth, newHeight);
+        if (replacement->open(name)) {
+            sharedExport = std::move(replacement);
+        }
+    }
+    return true;
+}
+
+uint64_t Place::getOwnedPixels(uint64_t userID) {
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+    return ownership.getOwned(userID);
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> Place::getLeaderboard(size_t k) {
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+    return ownership.top(k);
+}
+
+bool Place::addTemplate(const TemplateImage& image, uint64_t& id) {
+    if (!image.width || !image.height || image.colors.size() != image.width * image.height) {
+        return false;
+    }
+
+    // Exclusive, so nothing is written between reading the current colors and tracking writes.
+    std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+    std::vector<PixelInfo> region;
+    if (!pixelTable.getRegion(image.x, image.y, image.width, image.height, region)) {
+        return false;
+    }
+    std::vector<uint64_t> current(region.size());
+    for (size_t i = 0; i < region.size(); i++) {
+        current[i] = region[i].color;
+    }
+    id = templates.add(image, current);
+    return true;
+}
+
+bool Place::removeTemplate(uint64_t id) {
+    std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+    return templates.remove(id);
+}
+
+bool Place::getTemplateMismatchCount(uint64_t id, uint64_t& count) {
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+    return templates.getMismatchCount(id, count);
+}
+
+bool Place::getTemplateMismatches(uint64_t id, size_t limit, std::vector<std::pair<uint64_t, uint64_t>>& mismatches) {
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+    return templates.getMismatches(id, limit, mismatches);
+}
+
+std::vector<CanvasEpoch> Place::getEpochs() {
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+    return canvasEpochs;
+}
+
+bool Place::setPalette(const std::vector<uint32_t>& colors, const std::vector<uint64_t>& remap) {
+    std::shared_ptr<const Snapshot> remapped;
+    {
+        std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+        if (frozen.load(std::memory_order_relaxed) || remap.size() != paletteEpochs.back().colors.size() ||
+            (!remap.empty() && remap[Pixel::defaultColor] != Pixel::defaultColor)) {
+            return false;
+        }
+        for (uint64_t color : remap) {
+            if (color >= colors.size()) {
+                return false;
+            }
+        }
+        uint64_t epoch = paletteEpochs.back().epoch + 1;
+        paletteEpochs.push_back({epoch, updates.size(), colors, remap});
+
+        // Everything in the log so far is in the old palette, so catch the working snapshot up before remapping it.
+        // From here on, everything is in the new one.
+        workingSnapshot.apply(updates);
+        workingSnapshot.remapColors(remap, epoch);
+        recentSnapshot = std::make_shared<const Snapshot>(workingSnapshot);
+        remapped = recentSnapshot;
+        pixelTable.remapColors(remap);
+        templates.remapColors(remap, [this](const TemplateImage& image) {
+            std::vector<PixelInfo> region;
+            pixelTable.getRegion(image.x, image.y, image.width, image.height, region);
+            std::vector<uint64_t> current(region.size());
+            for (size_t i = 0; i < region.size(); i++) {
+                current[i] = region[i].color;
+            }
+            return current;
+        });
+
+        // Readers use this to tell that snapshots they've kept around are in an old palette.
+        paletteEpoch.store(epoch, std::memory_order_release);
+    }
+
+    std::lock_guard<std::mutex> lock(sharedExportMutex);
+    if (sharedExport) {
+        sharedExport->publish(*remapped);
+    }
+    return true;
+}
+
+std::vector<PaletteEpoch> Place::getPaletteEpochs() {
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+    return paletteEpochs;
+}
+
+uint64_t Place::paletteEpochForLocked(uint64_t recordNumber) const {
+    auto it = std::partition_point(paletteEpochs.begin(), paletteEpochs.end(), [recordNumber](const PaletteEpoch& e) {
+        return e.recordNumber <= recordNumber;
+    });
+    return (it - 1)->epoch;
+}
+
+uint64_t Place::translateColorLocked(uint64_t color, uint64_t fromPaletteEpoch) const {
+    for (uint64_t epoch = fromPaletteEpoch + 1; epoch < paletteEpochs.size(); epoch++) {
+        const std::vector<uint64_t>& remap = paletteEpochs[epoch].remap;
+        color = color < remap.size() ? remap[color] : color;
+    }
+    return color;
+}
+
+bool Place::inPaletteLocked(uint64_t color) const {
+    const std::vector<uint32_t>& palette = paletteEpochs.back().colors;
+    return palette.empty() || color < palette.size();
+}
+
+// Checkpoint files are a header, the canvas epochs, the palette epochs, then every update as six 8-byte numbers (the
+// 48 bytes per update from the `Update` schema), all in host byte order. Version 1 files have no palette epochs.
+static constexpr uint64_t checkpointMagicV1 = 0x31747063636c7072; // "rplccpt1"
+static constexpr uint64_t checkpointMagic = 0x32747063636c7072; // "rplccpt2"
+
+bool Place::save(const std::string& path) {
+    std::lock_guard<std::mutex> saving(saveMutex);
+
+    // Write somewhere else first, so a crash mid-save never leaves a truncated checkpoint behind.
+    std::string temporaryPath = temporaryPathFor(path);
+    {
+        std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        auto write = [&file](uint64_t value) {
+            file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        };
+
+        // Nothing can append while we hold this, but readers can carry on.
+        std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+        write(checkpointMagic);
+        write(canvasEpochs.size());
+        for (const CanvasEpoch& epoch : canvasEpochs) {
+            write(epoch.epoch);
+            write(epoch.recordNumber);
+            write(epoch.width);
+            write(epoch.height);
+        }
+        write(paletteEpochs.size());
+        for (const PaletteEpoch& epoch : paletteEpochs) {
+            write(epoch.epoch);
+            write(epoch.recordNumber);
+            write(epoch.colors.size());
+            for (uint32_t color : epoch.colors) {
+                write(color);
+            }
+            write(epoch.remap.size());
+            for (uint64_t color : epoch.remap) {
+                write(color);
+            }
+        }
+        write(updates.size());
+        for (const Update& u : updates) {
+            write(u.recordNumber);
+            write(u.timestamp);
+            write(u.pixel.getX());
+            write(u.pixel.getY());
+            write(u.pixel.getColor());
+            write(u.pixel.getUserID());
+        }
+        file.flush();
+        if (!file) {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+    }
+    return commitFile(temporaryPath, path);
+}
+
+bool Place::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    auto read = [&file]() {
+        uint64_t value = 0;
+        file.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    };
+
+    // Sizes come from the file, so before allocating for a count, check the rest of the file could hold that many.
+    file.seekg(0, std::ios::end);
+    std::streamoff fileSize = file.tellg();
+    file.seekg(0);
+    auto fits = [&file, fileSize](uint64_t count, uint64_t bytesEach) {
+        std::streamoff position = file.tellg();
+        return file && position >= 0 && count <= static_cast<uint64_t>(fileSize - position) / bytesEach;
+    };
+
+    // Read everything before changing anything, so a bad file leaves us as we were.
+    uint64_t magic = read();
+    if (magic != checkpointMagic && magic != checkpointMagicV1) {
+        return false;
+    }
+    uint64_t epochCount = read();
+    if (!fits(epochCount, 4 * sizeof(uint64_t))) {
+        return false;
+    }
+    std::vector<CanvasEpoch> loadedEpochs(epochCount);
+    for (CanvasEpoch& epoch : loadedEpochs) {
+        epoch.epoch = read();
+        epoch.recordNumber = read();
+        epoch.width = read();
+        epoch.height = read();
+    }
+
+    // These have to be epochs `expand` could have made, starting with the Place as it was created. Otherwise we'd
+    // expand to whatever size the file says, and `getEpochs` would hand clients a history that makes no sense.
+    for (uint64_t i = 0; i < loadedEpochs.size(); i++) {
+        const CanvasEpoch& epoch = loadedEpochs[i];
+        const CanvasEpoch* previous = i > 0 ? &loadedEpochs[i - 1] : nullptr;
+        if (epoch.epoch != i || epoch.width > maxDimension || epoch.height > maxDimension ||
+            (previous ? epoch.recordNumber < previous->recordNumber || epoch.width < previous->width ||
+                        epoch.height < previous->height : epoch.recordNumber != 0)) {
+            return false;
+        }
+    }
+    std::vector<PaletteEpoch> loadedPaletteEpochs{{0, 0, {}, {}}};
+    if (magic == checkpointMagic) {
+        // Like the canvas epochs, these have to be ones `setPalette` could have made: the first (no palette, as the
+        // Place was created) covers the log from the start, and every remap fits the palettes either side of it, or
+        // looking up and translating colors below would read out of bounds. They're read a piece at a time, so
+        // they're checked as we go.
+        auto validPaletteEpoch = [](const PaletteEpoch& epoch, const PaletteEpoch* previous) {
+            if (!previous) {
+                return epoch.epoch == 0 && epoch.recordNumber == 0 && epoch.colors.empty() && epoch.remap.empty();
+            }
+            if (epoch.epoch != previous->epoch + 1 || epoch.recordNumber < previous->recordNumber ||
+                epoch.remap.size() != previous->colors.size() ||
+                (!epoch.remap.empty() && epoch.remap[Pixel::defaultColor] != Pixel::defaultColor)) {
+                return false;
+            }
+            for (uint64_t color : epoch.remap) {
+                if (color >= epoch.colors.size()) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        loadedPaletteEpochs.clear();
+        for (uint64_t i = 0, n = read(); i < n && file; i++) {
+            loadedPaletteEpochs.emplace_back();
+            PaletteEpoch& epoch = loadedPaletteEpochs.back();
+            epoch.epoch = read();
+            epoch.recordNumber = read();
+            epoch.colors.clear();
+            for (uint64_t j = read(); j > 0 && file; j--) {
+                epoch.colors.push_back(static_cast<uint32_t>(read()));
+            }
+            epoch.remap.clear();
+            for (uint64_t j = read(); j > 0 && file; j--) {
+                epoch.remap.push_back(read());
+            }
+            if (!file || !validPaletteEpoch(epoch, i > 0 ? &loadedPaletteEpochs[i - 1] : nullptr)) {
+                return false;
+            }
+        }
+    }
+    uint64_t count = read();
+    if (!fits(count, 6 * sizeof(uint64_t)) || loadedEpochs.empty() || loadedPaletteEpochs.empty()) {
+        return false;
+    }
+    const CanvasEpoch& last = loadedEpochs.back();
+    std::vector<Update> loadedUpdates;
+    loadedUpdates.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t recordNumber = read();
+        uint64_t timestamp = read();
+        uint64_t x = read();
+        uint64_t y = read();
+        uint64_t color = read();
+        uint64_t userID = read();
+        if (!file || recordNumber != i || x >= last.width || y >= last.height) {
+            return false;
+        }
+        loadedUpdates.emplace_back(recordNumber, timestamp, Pixel(x, y, color, userID));
+    }
+
+    std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+    if (!updates.empty() || frozen.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    // The grid only grows, so every update fits in the last epoch's dimensions.
+    workingSnapshot.expand(last.width, last.height);
+    pixelTable.expand(last.width, last.height);
+    protectionMask.expand(last.width, last.height);
+    canvasEpochs = std::move(loadedEpochs);
+    width.store(last.width);
+    height.store(last.height);
+    canvasEpoch.store(last.epoch, std::memory_order_release);
+    paletteEpochs = std::move(loadedPaletteEpochs);
+    paletteEpoch.store(paletteEpochs.back().epoch, std::memory_order_release);
+
+    // The log has each update in the palette it was written in, but the grid is all in the current one.
+    updates = std::move(loadedUpdates);
+    recordCount.store(updates.size(), std::memory_order_release);
+    for (const Update& u : updates) {
+        Pixel current(u.pixel.getX(), u.pixel.getY(),
+                      translateColorLocked(u.pixel.getColor(), paletteEpochForLocked(u.recordNumber)),
+                      u.pixel.getUserID());
+        pixelTable.set(current, u.recordNumber, &ownership);
+        workingSnapshot.set(current);
+        tileHistory[historyKey(u.pixel.getX(), u.pixel.getY())].push_back(u.recordNumber);
+        uint64_t& mostRecent = mostRecentUpdatesPerUser[u.pixel.getUserID()];
+        mostRecent = std::max(mostRecent, u.timestamp);
+    }
+    workingSnapshot.recordNumber = updates.size();
+    workingSnapshot.paletteEpoch = paletteEpochs.back().epoch;
+    recentSnapshot = std::make_shared<const Snapshot>(workingSnapshot);
+    keyframes.push_back(recentSnapshot);
+    return true;
+}
+
+std::vector<Update> Place::getDiff(uint64_t fromRecordNumber, size_t limit) {
+    std::vector<Update> diff;
+    getDiff(fromRecordNumber, diff, limit);
+    return diff;
+}
+
+template <typename Diff>
+void Place::getDiff(uint64_t fromRecordNumber, Diff& diff, size_t limit) {
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+    if (fromRecordNumber < updates.size()) {
+        size_t end = fromRecordNumber + std::min<size_t>(limit, updates.size() - fromRecordNumber);
+        diff.reserve(diff.size() + end - fromRecordNumber);
+        for (size_t i = fromRecordNumber; i < end; i++) {
+            diff.emplace_back(updates[i].recordNumber, updates[i].timestamp, updates[i].pixel);
+        }
+    }
+}
+
+uint64_t Place::memoryUsage() {
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+
+    // A rough cost for a std::map node, there's no way to ask.
+    static constexpr uint64_t mapEntrySize = 64;
+    uint64_t historySize = 0;
+    for (const auto& [key, records] : tileHistory) {
+        historySize += mapEntrySize + records.capacity() * sizeof(uint64_t);
+    }
+    return sizeof(Place) + updates.capacity() * sizeof(Update) + mostRecentUpdatesPerUser.size() * mapEntrySize +
+           workingSnapshot.memoryUsage() + recentSnapshot->memoryUsage() + pixelTable.memoryUsage() +
+           protectionMask.memoryUsage() + ownership.memoryUsage() + templates.memoryUsage() + historySize;
+}
+
+Snapshot Place::getCurrentState() {
+    return *sharedCurrentState();
+}
+
+std::shared_ptr<const Snapshot> Place::getState(std::chrono::microseconds maxStaleness) {
+    std::shared_ptr<const PublishedState> state = std::atomic_load(&publishedState);
+    // However old it's allowed to be, it has to be in the current palette.
+    if (state && state->snapshot->paletteEpoch == getPaletteEpoch() &&
+        (state->snapshot->recordNumber >= getRecordCount() ||
+         steadyMicroseconds() - state->publishedAtUs <= static_cast<uint64_t>(maxStaleness.count()))) {
+        return state->snapshot;
+    }
+    return sharedCurrentState();
+}
+
+std::shared_ptr<const Snapshot> Place::sharedCurrentState() {
+    // Anything that's been applied by the time we got here has to be in what we return, in the palette at the time.
+    uint64_t target = getRecordCount();
+    uint64_t targetPaletteEpoch = getPaletteEpoch();
+
+    std::unique_lock<std::mutex> lock(materializeMutex);
+    while (true) {
+        if (lastMaterialized && lastMaterialized->recordNumber >= target &&
+            lastMaterialized->paletteEpoch >= targetPaletteEpoch) {
+            return lastMaterialized;
+        }
+        if (!materializing) {
+            break;
+        }
+
+        // Wait for whoever's building one now, it might be new enough for us. If not, we'll build the next one.
+        materialized.wait(lock);
+    }
+    materializing = true;
+    lock.unlock();
+
+    std::shared_ptr<const Snapshot> result = materializeCurrentState();
+
+    lock.lock();
+    if (!lastMaterialized || result->paletteEpoch > lastMaterialized->paletteEpoch ||
+        (result->paletteEpoch == lastMaterialized->paletteEpoch &&
+         result->recordNumber > lastMaterialized->recordNumber)) {
+        lastMaterialized = result;
+        std::atomic_store(&publishedState, std::shared_ptr<const PublishedState>(
+            std::make_shared<PublishedState>(PublishedState{result, steadyMicroseconds()})));
+    }
+    materializing = false;
+    materialized.notify_all();
+    return result;
+}
+
+std::shared_ptr<const Snapshot> Place::materializeCurrentState() {
+    std::shared_ptr<const Snapshot> recentCopy;
+    bool published = false;
+    {
+        // We lock to update the main snapshot state. Generally this is fast as we do this all the time, so there
+        // shouldn't be a lot of updates to apply.
+        std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+
+        // Update the working snapshot to the latest (fast).
+        workingSnapshot.apply(updates);
+
+        // If we're significantly ahead, replace the "recent" snapshot. The copy itself only copies tile pointers, but
+        // every tile the working snapshot writes to afterwards has to be copied again, so we don't do it that often.
+        if (workingSnapshot.recordNumber > recentSnapshot->recordNumber + 100) {
+            // This invokes the copy constructor, meaning recentSnapshot is now a *new* object, but any existing shared_ptr's
+            // are still pointing at the old object.
+            recentSnapshot = std::make_shared<const Snapshot>(workingSnapshot);
+            published = true;
+
+            // It's also a keyframe for `revert`, if it's been long enough since the last one.
+            if (recentSnapshot->recordNumber >=
+                (keyframes.empty() ? 0 : keyframes.back()->recordNumber) + keyframeInterval) {
+                keyframes.push_back(recentSnapshot);
+                if (keyframes.size() > maxKeyframes) {
+                    keyframes.pop_front();
+                }
+            }
+        }
+
+        // This will be some value from within the last 100 updates.
+        recentCopy = recentSnapshot;
+    }
+
+    // Other processes get the new snapshot too, also outside of the lock, as this is another full copy.
+    if (published) {
+        std::lock_guard<std::mutex> lock(sharedExportMutex);
+        if (sharedExport) {
+            sharedExport->publish(*recentCopy);
+        }
+    }
+
+    // We now copy the value of `recentSnapshot` outside of the main mutex lock. This could be the second copy of this
+    // object if we updated `recentSnapshot` above, but importantly we don't need to hold the lock to do it.
+    auto returnValue = std::make_shared<Snapshot>(*recentCopy);
+
+    // We can now apply the recent changes to the copy with a read-only lock, as we are only modifying our return
+    // object, not the Place object itself. This should "also" be fast-ish, it can apply up to 100 updates.
+    {
+        std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+
+        // If the palette changed since we copied it, the tail is in the new palette, so start over from the recent
+        // snapshot, which has been remapped.
+        if (returnValue->paletteEpoch != paletteEpochs.back().epoch) {
+            returnValue = std::make_shared<Snapshot>(*recentSnapshot);
+        }
+
+        // The recent snapshot might be from before the last `expand`.
+        returnValue->expand(width, height);
+        returnValue->apply(updates);
+    }
+
+    return returnValue;
+}
+
+bool Place::update(const Pixel& p) {
+
+    // Fail early if this isn't a valid location, or it's frozen.
+    if (p.getX() >= width || p.getY() >= height || protectionMask.isProtected(p.getX(), p.getY())) {
+        return false;
+    }
+
+    // Lock to prevent collisions.
+    std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+    
+    // Don't grab the current time until we're locked, in case it takes a while.
+    uint64_t currentTime = wallMicroseconds();
+    return updateLocked(p, currentTime);
+}
+
+bool Place::updateLocked(const Pixel& p, uint64_t currentTime) {
+    if (frozen.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    if (!inPaletteLocked(p.getColor())) {
+        return false;
+    }
+
+    // See if this user has ever updated the Place.
+    auto recentUdpateIt = mostRecentUpdatesPerUser.find(p.getUserID());
+    if (recentUdpateIt != mostRecentUpdatesPerUser.end()) {
+        // This user *has* updated the grid at some point.
+        if (recentUdpateIt->second + cooldownUs > currentTime) {
+            // Less than 5 minutes.
+            return false;
+        } else {
+            // More than 5 minutes, we can update.
+            recentUdpateIt->second = currentTime;
+        }
+    } else {
+        // If the user had never update the Place, we'll add them to the map.
+        mostRecentUpdatesPerUser.emplace(std::make_pair(p.getUserID(), currentTime));
+    }
+
+    // Now, if we get this far, we add an update to the complete list (regardless if the user had previously updated
+    // the Place or not).
+    updates.emplace_back(updates.size(), currentTime, p);
+    recordCount.store(updates.size(), std::memory_order_release);
+
+    // Make it visible to `getPixel` right away, we're the only writer as we hold the lock.
+    pixelTable.set(p, updates.back().recordNumber, &ownership);
+    templates.apply(p);
+    tileHistory[historyKey(p.getX(), p.getY())].push_back(updates.back().recordNumber);
+
+    // Done, success.
+    return true;
+}
+
+uint64_t Place::cooldownEndsLocked(uint64_t userID) const {
+    auto it = mostRecentUpdatesPerUser.find(userID);
+    return it == mostRecentUpdatesPerUser.end() ? 0 : it->second + cooldownUs;
+}
+
+bool Place::setProtection(const std::vector<ProtectionChange>& changes) {
+    // Rectangles are checked against the mask's own size, which is grown before `width` and `height` are.
+    return protectionMask.apply(changes);
+}
+
+bool Place::stamp(const std::vector<Pixel>& pixels) {
+    // Validate everything up front, it's all or nothing.
+    for (const Pixel& p : pixels) {
+        if (p.getX() >= width || p.getY() >= height) {
+            return false;
+        }
+    }
+    if (pixels.empty()) {
+        return true;
+    }
+
+    std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+    if (frozen.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    // The palette can change between any two calls, so this has to be checked under the lock.
+    for (const Pixel& p : pixels) {
+        if (!inPaletteLocked(p.getColor())) {
+            return false;
+        }
+    }
+    stampLocked(pixels);
+    return true;
+}
+
+void Place::stampLocked(const std::vector<Pixel>& pixels) {
+    uint64_t currentTime = wallMicroseconds();
+    uint64_t firstRecordNumber = updates.size();
+    updates.reserve(updates.size() + pixels.size());
+    for (const Pixel& p : pixels) {
+        tileHistory[historyKey(p.getX(), p.getY())].push_back(updates.size());
+        updates.emplace_back(updates.size(), currentTime, p);
+    }
+    recordCount.store(updates.size(), std::memory_order_release);
+    pixelTable.setBatch(pixels, firstRecordNumber, &ownership);
+    for (const Pixel& p : pixels) {
+        templates.apply(p);
+    }
+}
+
+bool Place::revert(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight, uint64_t timestamp,
+                   size_t& reverted) {
+    reverted = 0;
+    if (x >= width || y >= height || regionWidth > width - x || regionHeight > height - y) {
+        return false;
+    }
+    if (!regionWidth || !regionHeight) {
+        return true;
+    }
+
+    // Exclusive for the whole thing, so nothing can be written between working out the difference and applying it.
+    std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+    if (frozen.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    // Everything before `end` happened at or before `timestamp`. Timestamps come from the wall clock under the lock,
+    // so they're in order unless the clock was stepped back.
+    uint64_t end = std::partition_point(updates.begin(), updates.end(), [timestamp](const Update& u) {
+        return u.timestamp <= timestamp;
+    }) - updates.begin();
+
+    // The most recent keyframe that's not after `end`, if we still have one.
+    std::shared_ptr<const Snapshot> keyframe;
+    for (auto it = keyframes.rbegin(); it != keyframes.rend(); it++) {
+        if ((*it)->recordNumber <= end) {
+            keyframe = *it;
+            break;
+        }
+    }
+    uint64_t keyframeRecordNumber = keyframe ? keyframe->recordNumber : 0;
+
+    // The region as of `end`, in row order. Walk each tile's history backwards from `end`, the first write we see to
+    // a pixel is its last one before then. Anything not written between the keyframe and `end` is as in the keyframe.
+    std::vector<Snapshot::Cell> then(regionWidth * regionHeight);
+    std::vector<bool> resolved(then.size(), false);
+    uint64_t tileSize = Snapshot::tileSize;
+    for (uint64_t tileY = y / tileSize; tileY <= (y + regionHeight - 1) / tileSize; tileY++) {
+        for (uint64_t tileX = x / tileSize; tileX <= (x + regionWidth - 1) / tileSize; tileX++) {
+            auto history = tileHistory.find(historyKey(tileX * tileSize, tileY * tileSize));
+            if (history == tileHistory.end()) {
+                continue;
+            }
+            uint64_t left = std::max(x, tileX * tileSize);
+            uint64_t right = std::min(x + regionWidth, (tileX + 1) * tileSize);
+            uint64_t top = std::max(y, tileY * tileSize);
+            uint64_t bottom = std::min(y + regionHeight, (tileY + 1) * tileSize);
+            uint64_t unresolved = (right - left) * (bottom - top);
+
+            const std::vector<uint64_t>& records = history->second;
+            auto it = std::lower_bound(records.begin(), records.end(), end);
+            while (it != records.begin() && unresolved) {
+                it--;
+                if (*it < keyframeRecordNumber) {
+                    break;
+                }
+                const Pixel& p = updates[*it].pixel;
+                if (p.getX() < left || p.getX() >= right || p.getY() < top || p.getY() >= bottom) {
+                    continue;
+                }
+                uint64_t index = (p.getY() - y) * regionWidth + p.getX() - x;
+                if (!resolved[index]) {
+                    then[index] = {translateColorLocked(p.getColor(), paletteEpochForLocked(*it)), p.getUserID()};
+                    resolved[index] = true;
+                    unresolved--;
+                }
+            }
+        }
+    }
+    for (uint64_t row = 0; row < regionHeight; row++) {
+        for (uint64_t column = 0; column < regionWidth; column++) {
+            uint64_t index = row * regionWidth + column;
+            if (resolved[index]) {
+                continue;
+            }
+
+            // The keyframe can be from before the last `expand`, anything outside it was blank.
+            if (keyframe && x + column < keyframe->width && y + row < keyframe->height) {
+                then[index] = keyframe->getCell(x + column, y + row);
+                then[index].color = translateColorLocked(then[index].color, keyframe->paletteEpoch);
+            } else {
+                then[index] = {Pixel::defaultColor, 0};
+            }
+        }
+    }
+
+    // Only write what's actually different now. A pixel that was blank then and has been placed since is different
+    // even if it's the default color now, someone owns it.
+    std::vector<PixelInfo> now;
+    pixelTable.getRegion(x, y, regionWidth, regionHeight, now);
+    std::vector<Pixel> pixels;
+    for (uint64_t row = 0; row < regionHeight; row++) {
+        for (uint64_t column = 0; column < regionWidth; column++) {
+            uint64_t index = row * regionWidth + column;
+            Pixel p(x + column, y + row, then[index].color, then[index].userID);
+            if (now[index].color != p.getColor() || (p.isBlank() && now[index].placed)) {
+                pixels.push_back(p);
+            }
+        }
+    }
+
+    // Colors from before the first palette have nothing to remap them, so they may not fit the current one.
+    for (const Pixel& p : pixels) {
+        if (!inPaletteLocked(p.getColor())) {
+            return false;
+        }
+    }
+    if (!pixels.empty()) {
+        stampLocked(pixels);
+    }
+    reverted = pixels.size();
+    return true;
+}
+
+Admission Place::submit(const Pixel& p, std::function<void(bool)> done) {
+    if (!sequencerRunning.load(std::memory_order_acquire)) {
+        return {false, admissionLimits.minRetryAfterUs};
+    }
+
+    // Invalid or frozen locations don't need to wait in line to be rejected.
+    if (p.getX() >= width || p.getY() >= height || protectionMask.isProtected(p.getX(), p.getY())) {
+        if (done) {
+            done(false);
+        }
+        return {true, 0};
+    }
+
+    // Shed load if we're already behind. The hint is roughly how far behind we are, as that's how long it will take
+    // for things to clear up.
+    size_t depth = ingestionQueue->depth();
+    uint64_t latency = sequencingLatencyUs.load(std::memory_order_relaxed);
+    uint64_t retryAfter = std::max(latency, admissionLimits.minRetryAfterUs);
+    if (depth >= admissionLimits.maxQueueDepth || latency > admissionLimits.targetLatencyUs) {
+        return {false, retryAfter};
+    }
+    if (!ingestionQueue->push({p, steadyMicroseconds(), std::move(done)})) {
+        return {false, retryAfter};
+    }
+
+    // If the sequencer went to sleep, wake it. It sets `sequencerParked` before checking the queue a last time, and
+    // we pushed before checking `sequencerParked`. The push is only a relaxed increment of the queue's position, so
+    // there's a fence here and one after the sequencer's store, which is what guarantees one of us sees the other.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sequencerParked.load()) {
+        std::lock_guard<std::mutex> lock(sequencerMutex);
+        sequencerWakeup.notify_one();
+    }
+    return {true, 0};
+}
+
+void Place::startSequencer(const AdmissionLimits& limits) {
+    if (sequencerRunning.load()) {
+        return;
+    }
+    admissionLimits = limits;
+    if (!ingestionQueue || ingestionQueue->getCapacity() < limits.maxQueueDepth) {
+        ingestionQueue = std::make_unique<IngestionQueue>(limits.maxQueueDepth);
+    }
+    sequencingLatencyUs.store(0);
+    sequencerRunning.store(true, std::memory_order_release);
+    sequencerThread = std::thread(&Place::runSequencer, this);
+}
+
+void Place::stopSequencer() {
+    if (!sequencerRunning.exchange(false)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sequencerMutex);
+        sequencerWakeup.notify_one();
+    }
+    sequencerThread.join();
+}
+
+void Place::runSequencer() {
+    // We take the lock once per batch rather than once per write, this is a big part of why the queue is faster than
+    // calling `update` from every thread.
+    static constexpr size_t maxBatch = 256;
+    std::vector<Submission> batch;
+    batch.reserve(maxBatch);
+
+    // Users whose deferred write is due, and the callbacks to run once we're out of the lock.
+    std::vector<uint64_t> due;
+    std::vector<std::pair<std::function<void(bool)>, bool>> completions;
+    completions.reserve(maxBatch);
+
+    if (admissionLimits.sequencerCore >= 0) {
+        pinCurrentThread(admissionLimits.sequencerCore);
+    }
+
+    // For busy polling: how long we spin before parking, when we ran out of work (0 while we have some), and how many
+    // times we've gone around since.
+    uint64_t spinUs = admissionLimits.maxSpinUs;
+    uint64_t idleSinceUs = 0;
+    uint64_t spins = 0;
+
+    Submission submission{Pixel{0, 0, 0, 0}, 0, nullptr};
+    while (true) {
+        batch.clear();
+        while (batch.size() < maxBatch && ingestionQueue->pop(submission)) {
+            batch.push_back(std::move(submission));
+        }
+        due.clear();
+        deferredTimers.advance(wallMicroseconds(), [&due](uint64_t userID) {due.push_back(userID);});
+
+        if (batch.empty() && due.empty()) {
+            // Nothing is waiting, so anything submitted now would be sequenced right away.
+            sequencingLatencyUs.store(0, std::memory_order_relaxed);
+
+            // Only exit once everything that was accepted has been applied.
+            if (!sequencerRunning.load(std::memory_order_acquire)) {
+                break;
+            }
+            if (admissionLimits.busyPoll) {
+                uint64_t now = steadyMicroseconds();
+                if (!idleSinceUs) {
+                    idleSinceUs = now;
+                }
+                if (now - idleSinceUs < spinUs) {
+                    // Now and then, let anything else that wants this core have it. On an isolated core that's nobody
+                    // and this returns right away, on a shared one it's the difference between spinning and hogging.
+                    if (++spins % 256 == 0) {
+                        std::this_thread::yield();
+                    } else {
+                        cpuRelax();
+                    }
+                    continue;
+                }
+
+                // Nothing turned up, so that was wasted, spin for less next time.
+                spinUs = std::max(admissionLimits.minSpinUs, spinUs / 2);
+                idleSinceUs = 0;
+            }
+            std::unique_lock<std::mutex> lock(sequencerMutex);
+            sequencerParked.store(true);
+            // Pairs with the fence in `submit`, see there.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ingestionQueue->depth() == 0 && sequencerRunning.load()) {
+                // The timeout is just a backstop, we should always be woken up. It's also how often deferred writes
+                // are checked while we're idle.
+                sequencerWakeup.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            sequencerParked.store(false);
+            continue;
+        }
+
+        if (idleSinceUs) {
+            // Something turned up while we were spinning, so spinning paid off, do it for longer next time.
+            spinUs = spinUs > admissionLimits.maxSpinUs / 2 ? admissionLimits.maxSpinUs
+                                                            : std::max<uint64_t>(spinUs * 2, 1);
+            idleSinceUs = 0;
+        }
+
+        completions.clear();
+        {
+            std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+            uint64_t currentTime = wallMicroseconds();
+
+            // Deferred writes first, they've been waiting longest.
+            for (uint64_t userID : due) {
+                auto it = deferredWrites.find(userID);
+                if (it == deferredWrites.end()) {
+                    continue;
+                }
+                if (protectionMask.isProtected(it->second.pixel.getX(), it->second.pixel.getY())) {
+                    // Frozen while it was waiting.
+                    completions.emplace_back(std::move(it->second.done), false);
+                    deferredWrites.erase(it);
+                } else if (updateLocked(it->second.pixel, currentTime)) {
+                    completions.emplace_back(std::move(it->second.done), true);
+                    deferredWrites.erase(it);
+                } else if (cooldownEndsLocked(userID) > currentTime) {
+                    // The user got a write in some other way (i.e., `update`) in the meantime, wait again.
+                    deferredTimers.schedule(userID, cooldownEndsLocked(userID));
+                } else {
+                    // Off cooldown but still refused, so it was never going to work.
+                    completions.emplace_back(std::move(it->second.done), false);
+                    deferredWrites.erase(it);
+                }
+            }
+
+            for (Submission& item : batch) {
+                bool result = updateLocked(item.pixel, currentTime);
+                uint64_t userID = item.pixel.getUserID();
+                if (!result && admissionLimits.deferCooldownWrites && cooldownEndsLocked(userID) > currentTime) {
+                    auto [it, added] = deferredWrites.try_emplace(userID, DeferredWrite{item.pixel, nullptr});
+                    if (added) {
+                        deferredTimers.schedule(userID, cooldownEndsLocked(userID));
+                    } else {
+                        // Replaced, the old one is never going to be applied. The timer stays, it's the same user.
+                        completions.emplace_back(std::move(it->second.done), false);
+                        it->second.pixel = item.pixel;
+                    }
+                    it->second.done = std::move(item.done);
+                    continue;
+                }
+                if (result) {
+                    // The timer wheel rounds to whole ticks, so the cooldown a held write is waiting out can be over
+                    // before its timer fires. If a newer write from the same user got in first, the held one must not
+                    // land on top of it later. Its timer can stay, when it fires there's nothing left to apply.
+                    auto held = deferredWrites.find(userID);
+                    if (held != deferredWrites.end()) {
+                        completions.emplace_back(std::move(held->second.done), false);
+                        deferredWrites.erase(held);
+                    }
+                }
+                completions.emplace_back(std::move(item.done), result);
+            }
+        }
+
+        // The oldest write in the batch is the one that waited longest. Smooth it a bit so that one slow batch doesn't
+        // shed load on its own.
+        if (!batch.empty()) {
+            uint64_t waited = steadyMicroseconds() - batch.front().admittedAt;
+            uint64_t previous = sequencingLatencyUs.load(std::memory_order_relaxed);
+            sequencingLatencyUs.store(previous - previous / 4 + waited / 4, std::memory_order_relaxed);
+        }
+
+        // Callbacks are outside of the lock, we don't know how long they'll take.
+        for (auto& [done, result] : completions) {
+            if (done) {
+                done(result);
+            }
+        }
+    }
+
+    // Deferred writes that weren't due yet don't survive stopping.
+    for (auto& [userID, deferred] : deferredWrites) {
+        if (deferred.done) {
+            deferred.done(false);
+        }
+    }
+    deferredWrites.clear();
+    deferredTimers.clear();
+}
+
+// Once an event is over, its Place only serves history: paging through the log, what a pixel or a user did, and the
+// canvas as it was at some point. `Place::freeze` writes everything that takes into a single file, and a FrozenArchive
+// maps that file read-only and answers straight from the mapping. There are no locks and nothing in here is ever
+// written after `open`, so any number of threads (or processes, the mapping is shared) can read at once and the page
+// cache does the rest.
+//
+// The file is a `FrozenArchiveHeader` followed by sections of fixed size entries, each 8-byte aligned, at offsets
+// given in the header:
+// - The canvas and palette epochs, as in a checkpoint.
+// - The log, in blocks of `blockSize` records. Each block is columnar: every timestamp, then every x, y, color and
+//   userID, all as varints. Timestamps and coordinates are zigzagged deltas from the record before, which mostly fit
+//   in a byte or two, so the log is around a fifth of the 48 bytes per update it takes in memory. The block index
+//   holds each block's offset and first timestamp, so any record is one block decode away, and finding a time is a
+//   binary search.
+// - Every pixel that was ever written, sorted by (y, x), with its final state and every record number that wrote it.
+//   This is what keyframes are for in a live Place: a pixel at any point in time is a binary search in its list.
+// - Every user, sorted, with how many pixels they own at the end and every record number they wrote, and the
+//   leaderboard.
+//
+// Colors in a `PixelInfo` are in the final palette, like `Place::getPixel`. `Update`s are as they were written, like
+// `Place::getDiff`, in the palette of their epoch.
+struct FrozenSection {
+    // Bytes from the start of the file, and the number of entries.
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct FrozenPaletteEpoch {
+    uint64_t epoch;
+    uint64_t recordNumber;
+
+    // Ranges of `FrozenArchiveHeader::paletteWords`.
+    uint64_t colorsBegin;
+    uint64_t colorsCount;
+    uint64_t remapBegin;
+    uint64_t remapCount;
+};
+
+struct FrozenBlock {
+    // Bytes into `FrozenArchiveHeader::blocks`.
+    uint64_t offset;
+    uint64_t firstTimestamp;
+};
+
+struct FrozenPixelKey {
+    uint64_t y;
+    uint64_t x;
+
+    bool operator<(const FrozenPixelKey& other) const {
+        return y != other.y ? y < other.y : x < other.x;
+    }
+};
+
+struct FrozenOwner {
+    uint64_t userID;
+    uint64_t owned;
+};
+
+struct FrozenArchiveHeader {
+    static constexpr uint64_t expectedMagic = 0x317a7266636c7072; // "rplcfrz1"
+
+    uint64_t magic;
+    uint64_t recordCount;
+    uint64_t width;
+    uint64_t height;
+
+    FrozenSection canvasEpochs;       // CanvasEpoch
+    FrozenSection paletteEpochs;      // FrozenPaletteEpoch
+    FrozenSection paletteWords;       // uint64_t
+    FrozenSection blockIndex;         // FrozenBlock
+    FrozenSection blocks;             // bytes
+    FrozenSection pixelKeys;          // FrozenPixelKey, sorted
+    FrozenSection pixelFinal;         // Snapshot::Cell, one per key
+    FrozenSection pixelHistoryBegins; // uint64_t, one per key and one more for the end
+    FrozenSection pixelHistory;       // uint64_t record numbers
+    FrozenSection userIDs;            // uint64_t, sorted
+    FrozenSection userOwned;          // uint64_t, one per user
+    FrozenSection userHistoryBegins;  // uint64_t, one per user and one more for the end
+    FrozenSection userHistory;        // uint64_t record numbers
+    FrozenSection leaderboard;        // FrozenOwner, most owned first
+};
+
+class FrozenArchive {
+  public:
+    // Records per log block. Bigger compresses a little better, smaller makes reading a single record cheaper.
+    static constexpr uint64_t blockSize = 256;
+
+    ~FrozenArchive();
+
+    // Writes an archive, see `Place::freeze`. `currentColor` gives an update's color in the final palette.
+    static bool write(const std::string& path, const std::vector<Update>& updates,
+                      const std::vector<CanvasEpoch>& canvasEpochs, const std::vector<PaletteEpoch>& paletteEpochs,
+                      const std::function<uint64_t(const Update&)>& currentColor);
+
+    // Maps an archive read-only. Returns false if it can't be read or isn't one of ours.
+    bool open(const std::string& path);
+
+    uint64_t getRecordCount() const {return header->recordCount;}
+    uint64_t getWidth() const {return header->width;}
+    uint64_t getHeight() const {return header->height;}
+
+    // A pixel or a rectangle (in row order) as of just before `recordNumber`, by default at the end. Like
+    // `Place::getPixel` and `Place::getRegion`, these return false if it's not all within the final dimensions.
+    bool getPixel(uint64_t x, uint64_t y, PixelInfo& info, uint64_t recordNumber = UINT64_MAX) const;
+    bool getRegion(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight, std::vector<PixelInfo>& region,
+                   uint64_t recordNumber = UINT64_MAX) const;
+
+    // The final state.
+    Snapshot getFinalState() const;
+
+    // Up to `limit` updates from `fromRecordNumber` on, like `Place::getDiff`.
+    std::vector<Update> getDiff(uint64_t fromRecordNumber, size_t limit = SIZE_MAX) const;
+
+    // How many updates have a timestamp at or before `timestamp`, i.e., the record number to pass to `getRegion` for
+    // the canvas as it was at that time.
+    uint64_t getRecordCountAt(uint64_t timestamp) const;
+
+    // Every update to a pixel, and by a user, oldest first.
+    std::vector<Update> getPixelHistory(uint64_t x, uint64_t y) const;
+    std::vector<Update> getUserHistory(uint64_t userID) const;
+
+    // As in `Place`, at the end of the event.
+    uint64_t getOwnedPixels(uint64_t userID) const;
+    std::vector<std::pair<uint64_t, uint64_t>> getLeaderboard(size_t k) const;
+    std::vector<CanvasEpoch> getEpochs() const;
+    std::vector<PaletteEpoch> getPaletteEpochs() const;
+
+  private:
+    template <typename T>
+    const T* section(const FrozenSection& s) const {
+        return reinterpret_cast<const T*>(base + s.offset);
+    }
+
+    // Checks that a section fits in the file, and that a "begins" section starts at 0, gives every key at least one
+    // entry (so `begins[key + 1] - 1` is always an entry of `key`), and ends within `entries`.
+    bool validSection(const FrozenSection& s, size_t entrySize) const;
+    bool validBegins(const FrozenSection& begins, uint64_t keys, const FrozenSection& entries) const;
+
+    // Appends every record in a block to `out`. Returns false if the block's bad.
+    bool decodeBlock(uint64_t block, std::vector<Update>& out) const;
+
+    // The records for a sorted list of record numbers, decoding each block once.
+    std::vector<Update> decodeRecords(const uint64_t* recordNumbers, size_t count) const;
+
+    // Index into `pixelKeys`, or `header->pixelKeys.count` if the pixel was never written.
+    uint64_t findPixel(uint64_t x, uint64_t y) const;
+
+    // A color written in `recordNumber`, in the final palette.
+    uint64_t translateColor(uint64_t color, uint64_t recordNumber) const;
+
+    const uint8_t* base = nullptr;
+    const FrozenArchiveHeader* header = nullptr;
+    size_t size = 0;
+};
+
+static void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static bool readVarint(const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && in < end; shift += 7) {
+        uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Small signed deltas to small unsigned numbers: 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+static uint64_t zigzag(uint64_t delta) {
+    return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+static uint64_t unzigzag(uint64_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+FrozenArchive::~FrozenArchive() {
+    if (base) {
+        munmap(const_cast<uint8_t*>(base), size);
+    }
+}
+
+bool FrozenArchive::write(const std::string& path, const std::vector<Update>& updates,
+                          const std::vector<CanvasEpoch>& canvasEpochs, const std::vector<PaletteEpoch>& paletteEpochs,
+                          const std::function<uint64_t(const Update&)>& currentColor) {
+    FrozenArchiveHeader h{};
+    h.magic = FrozenArchiveHeader::expectedMagic;
+    h.recordCount = updates.size();
+    h.width = canvasEpochs.back().width;
+    h.height = canvasEpochs.back().height;
+
+    // The header is filled in last, once we know where everything went.
+    std::string out(sizeof(h), '\0');
+    auto begin = [&out](FrozenSection& s, uint64_t count) {
+        out.resize((out.size() + 7) & ~size_t(7), '\0');
+        s = {out.size(), count};
+    };
+    auto append = [&out](const auto* entries, size_t count) {
+        out.append(reinterpret_cast<const char*>(entries), count * sizeof(*entries));
+    };
+
+    begin(h.canvasEpochs, canvasEpochs.size());
+    append(canvasEpochs.data(), canvasEpochs.size());
+
+    std::vector<FrozenPaletteEpoch> frozenPalettes;
+    std::vector<uint64_t> paletteWords;
+    for (const PaletteEpoch& epoch : paletteEpochs) {
+        frozenPalettes.push_back({epoch.epoch, epoch.recordNumber, paletteWords.size(), epoch.colors.size(),
+                                  paletteWords.size() + epoch.colors.size(), epoch.remap.size()});
+        paletteWords.insert(paletteWords.end(), epoch.colors.begin(), epoch.colors.end());
+        paletteWords.insert(paletteWords.end(), epoch.remap.begin(), epoch.remap.end());
+    }
+    begin(h.paletteEpochs, frozenPalettes.size());
+    append(frozenPalettes.data(), frozenPalettes.size());
+    begin(h.paletteWords, paletteWords.size());
+    append(paletteWords.data(), paletteWords.size());
+
+    // The log, a column at a time within each block.
+    std::vector<FrozenBlock> blockIndex;
+    std::string blocks;
+    for (size_t first = 0; first < updates.size(); first += blockSize) {
+        size_t last = std::min<size_t>(first + blockSize, updates.size());
+        blockIndex.push_back({blocks.size(), updates[first].timestamp});
+        uint64_t previous = 0;
+        for (size_t i = first; i < last; i++) {
+            appendVarint(blocks, zigzag(updates[i].timestamp - previous));
+            previous = updates[i].timestamp;
+        }
+        previous = 0;
+        for (size_t i = first; i < last; i++) {
+            appendVarint(blocks, zigzag(updates[i].pixel.getX() - previous));
+            previous = updates[i].pixel.getX();
+        }
+        previous = 0;
+        for (size_t i = first; i < last; i++) {
+            appendVarint(blocks, zigzag(updates[i].pixel.getY() - previous));
+            previous = updates[i].pixel.getY();
+        }
+        for (size_t i = first; i < last; i++) {
+            appendVarint(blocks, updates[i].pixel.getColor());
+        }
+        for (size_t i = first; i < last; i++) {
+            appendVarint(blocks, updates[i].pixel.getUserID());
+        }
+    }
+    begin(h.blockIndex, blockIndex.size());
+    append(blockIndex.data(), blockIndex.size());
+    begin(h.blocks, blocks.size());
+    out += blocks;
+    blocks = std::string();
+
+    // Record numbers by pixel, and by user. Sorting is stable, so each list stays in record order.
+    std::vector<uint64_t> order(updates.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&updates](uint64_t a, uint64_t b) {
+        const Pixel& p = updates[a].pixel;
+        const Pixel& q = updates[b].pixel;
+        return FrozenPixelKey{p.getY(), p.getX()} < FrozenPixelKey{q.getY(), q.getX()};
+    });
+    std::vector<FrozenPixelKey> pixelKeys;
+    std::vector<Snapshot::Cell> pixelFinal;
+    std::vector<uint64_t> pixelHistoryBegins;
+    for (size_t i = 0; i < order.size(); i++) {
+        const Update& u = updates[order[i]];
+        FrozenPixelKey key{u.pixel.getY(), u.pixel.getX()};
+        if (pixelKeys.empty() || pixelKeys.back() < key) {
+            pixelKeys.push_back(key);
+            pixelFinal.emplace_back();
+            pixelHistoryBegins.push_back(i);
+        }
+        pixelFinal.back() = {currentColor(u), u.pixel.getUserID()};
+    }
+    pixelHistoryBegins.push_back(order.size());
+    begin(h.pixelKeys, pixelKeys.size());
+    append(pixelKeys.data(), pixelKeys.size());
+    begin(h.pixelFinal, pixelFinal.size());
+    append(pixelFinal.data(), pixelFinal.size());
+    begin(h.pixelHistoryBegins, pixelHistoryBegins.size());
+    append(pixelHistoryBegins.data(), pixelHistoryBegins.size());
+    begin(h.pixelHistory, order.size());
+    append(order.data(), order.size());
+
+    std::stable_sort(order.begin(), order.end(), [&updates](uint64_t a, uint64_t b) {
+        return updates[a].pixel.getUserID() < updates[b].pixel.getUserID();
+    });
+    std::vector<uint64_t> userIDs;
+    std::vector<uint64_t> userHistoryBegins;
+    for (size_t i = 0; i < order.size(); i++) {
+        uint64_t userID = updates[order[i]].pixel.getUserID();
+        if (userIDs.empty() || userIDs.back() != userID) {
+            userIDs.push_back(userID);
+            userHistoryBegins.push_back(i);
+        }
+    }
+    userHistoryBegins.push_back(order.size());
+    std::vector<uint64_t> userOwned(userIDs.size());
+    for (const Snapshot::Cell& cell : pixelFinal) {
+        // Pixels put back to blank are owned by nobody, like in the Place.
+        if (!Pixel(0, 0, cell.color, cell.userID).isBlank()) {
+            userOwned[std::lower_bound(userIDs.begin(), userIDs.end(), cell.userID) - userIDs.begin()]++;
+        }
+    }
+    std::vector<FrozenOwner> leaderboard;
+    for (size_t i = 0; i < userIDs.size(); i++) {
+        if (userOwned[i]) {
+            leaderboard.push_back({userIDs[i], userOwned[i]});
+        }
+    }
+    std::sort(leaderboard.begin(), leaderboard.end(), [](const FrozenOwner& a, const FrozenOwner& b) {
+        return a.owned != b.owned ? a.owned > b.owned : a.userID < b.userID;
+    });
+    begin(h.userIDs, userIDs.size());
+    append(userIDs.data(), userIDs.size());
+    begin(h.userOwned, userOwned.size());
+    append(userOwned.data(), userOwned.size());
+    begin(h.userHistoryBegins, userHistoryBegins.size());
+    append(userHistoryBegins.data(), userHistoryBegins.size());
+    begin(h.userHistory, order.size());
+    append(order.data(), order.size());
+    begin(h.leaderboard, leaderboard.size());
+    append(leaderboard.data(), leaderboard.size());
+
+    out.replace(0, sizeof(h), reinterpret_cast<const char*>(&h), sizeof(h));
+
+    // Same as `Place::save`, so there's never a partial archive at `path`.
+    std::string temporaryPath = temporaryPathFor(path);
+    {
+        std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        file.write(out.data(), out.size());
+        file.flush();
+        if (!file) {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+    }
+    return commitFile(temporaryPath, path);
+}
+
+bool FrozenArchive::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(FrozenArchiveHeader)) {
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    base = static_cast<const uint8_t*>(mapped);
+    header = static_cast<const FrozenArchiveHeader*>(mapped);
+    size = info.st_size;
+
+    // Everything else trusts these, so a bad file is turned away here rather than read out of bounds later.
+    const FrozenArchiveHeader& h = *header;
+    bool valid = h.magic == FrozenArchiveHeader::expectedMagic &&
+                 validSection(h.canvasEpochs, sizeof(CanvasEpoch)) && h.canvasEpochs.count > 0 &&
+                 validSection(h.paletteEpochs, sizeof(FrozenPaletteEpoch)) && h.paletteEpochs.count > 0 &&
+                 validSection(h.paletteWords, sizeof(uint64_t)) &&
+                 validSection(h.blockIndex, sizeof(FrozenBlock)) &&
+                 h.blockIndex.count == (h.recordCount + blockSize - 1) / blockSize &&
+                 validSection(h.blocks, 1) &&
+                 validSection(h.pixelKeys, sizeof(FrozenPixelKey)) &&
+                 validSection(h.pixelFinal, sizeof(Snapshot::Cell)) && h.pixelFinal.count == h.pixelKeys.count &&
+                 validBegins(h.pixelHistoryBegins, h.pixelKeys.count, h.pixelHistory) &&
+                 validSection(h.userIDs, sizeof(uint64_t)) &&
+                 validSection(h.userOwned, sizeof(uint64_t)) && h.userOwned.count == h.userIDs.count &&
+                 validBegins(h.userHistoryBegins, h.userIDs.count, h.userHistory) &&
+                 validSection(h.leaderboard, sizeof(FrozenOwner));
+    for (uint64_t i = 0; valid && i < h.blockIndex.count; i++) {
+        const FrozenBlock* blocks = section<FrozenBlock>(h.blockIndex);
+        valid = blocks[i].offset <= h.blocks.count && (i == 0 || blocks[i - 1].offset <= blocks[i].offset);
+    }
+    for (uint64_t i = 0; valid && i < h.paletteEpochs.count; i++) {
+        const FrozenPaletteEpoch& epoch = section<FrozenPaletteEpoch>(h.paletteEpochs)[i];
+        uint64_t words = h.paletteWords.count;
+        valid = epoch.colorsBegin <= words && epoch.colorsCount <= words - epoch.colorsBegin &&
+                epoch.remapBegin <= words && epoch.remapCount <= words - epoch.remapBegin;
+    }
+    if (!valid) {
+        munmap(mapped, size);
+        base = nullptr;
+        header = nullptr;
+        size = 0;
+        return false;
+    }
+    return true;
+}
+
+bool FrozenArchive::validSection(const FrozenSection& s, size_t entrySize) const {
+    return s.offset % 8 == 0 && s.offset >= sizeof(FrozenArchiveHeader) && s.offset <= size &&
+           s.count <= (size - s.offset) / entrySize;
+}
+
+bool FrozenArchive::validBegins(const FrozenSection& begins, uint64_t keys, const FrozenSection& entries) const {
+    if (!validSection(begins, sizeof(uint64_t)) || !validSection(entries, sizeof(uint64_t)) ||
+        begins.count != keys + 1) {
+        return false;
+    }
+    // `write` only makes a key for something that has history, so an empty range is as corrupt as a backwards one.
+    const uint64_t* b = section<uint64_t>(begins);
+    for (uint64_t i = 0; i < keys; i++) {
+        if (b[i] >= b[i + 1]) {
+            return false;
+        }
+    }
+    return b[0] == 0 && b[keys] <= entries.count;
+}
+
+bool FrozenArchive::decodeBlock(uint64_t block, std::vector<Update>& out) const {
+    const FrozenBlock* blocks = section<FrozenBlock>(header->blockIndex);
+    const uint8_t* in = base + header->blocks.offset + blocks[block].offset;
+    const uint8_t* end = base + header->blocks.offset +
+                         (block + 1 < header->blockIndex.count ? blocks[block + 1].offset : header->blocks.count);
+    uint64_t first = block * blockSize;
+    uint64_t count = std::min(blockSize, header->recordCount - first);
+
+    // Columns come one after the other, so we fill them in one at a time.
+    uint64_t columns[5][blockSize];
+    for (int column = 0; column < 5; column++) {
+        uint64_t previous = 0;
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t value;
+            if (!readVarint(in, end, value)) {
+                return false;
+            }
+            // Timestamps, x and y are deltas.
+            columns[column][i] = column < 3 ? (previous += unzigzag(value)) : value;
+        }
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        out.emplace_back(first + i, columns[0][i], Pixel(columns[1][i], columns[2][i], columns[3][i], columns[4][i]));
+    }
+    return true;
+}
+
+std::vector<Update> FrozenArchive::decodeRecords(const uint64_t* recordNumbers, size_t count) const {
+    std::vector<Update> records;
+    std::vector<Update> block;
+    uint64_t decoded = UINT64_MAX;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t recordNumber = recordNumbers[i];
+        if (recordNumber >= header->recordCount) {
+            break;
+        }
+        if (recordNumber / blockSize != decoded) {
+            block.clear();
+            decoded = recordNumber / blockSize;
+            if (!decodeBlock(decoded, block)) {
+                break;
+            }
+        }
+        const Update& u = block[recordNumber % blockSize];
+        records.emplace_back(u.recordNumber, u.timestamp, u.pixel);
+    }
+    return records;
+}
+
+uint64_t FrozenArchive::findPixel(uint64_t x, uint64_t y) const {
+    const FrozenPixelKey* keys = section<FrozenPixelKey>(header->pixelKeys);
+    const FrozenPixelKey* end = keys + header->pixelKeys.count;
+    FrozenPixelKey key{y, x};
+    const FrozenPixelKey* it = std::lower_bound(keys, end, key);
+    return it != end && !(key < *it) ? it - keys : header->pixelKeys.count;
+}
+
+uint64_t FrozenArchive::translateColor(uint64_t color, uint64_t recordNumber) const {
+    const FrozenPaletteEpoch* epochs = section<FrozenPaletteEpoch>(header->paletteEpochs);
+    const FrozenPaletteEpoch* end = epochs + header->paletteEpochs.count;
+    const FrozenPaletteEpoch* it = std::partition_point(epochs, end, [recordNumber](const FrozenPaletteEpoch& e) {
+        return e.recordNumber <= recordNumber;
+    });
+    const uint64_t* words = section<uint64_t>(header->paletteWords);
+    for (; it != end; it++) {
+        color = color < it->remapCount ? words[it->remapBegin + color] : color;
+    }
+    return color;
+}
+
+bool FrozenArchive::getPixel(uint64_t x, uint64_t y, PixelInfo& info, uint64_t recordNumber) const {
+    std::vector<PixelInfo> region;
+    if (!getRegion(x, y, 1, 1, region, recordNumber)) {
+        return false;
+    }
+    info = region[0];
+    return true;
+}
+
+bool FrozenArchive::getRegion(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight,
+                              std::vector<PixelInfo>& region, uint64_t recordNumber) const {
+    if (x >= header->width || y >= header->height ||
+        regionWidth > header->width - x || regionHeight > header->height - y) {
+        return false;
+    }
+    region.assign(regionWidth * regionHeight, {Pixel::defaultColor, 0, 0, false});
+
+    const FrozenPixelKey* keys = section<FrozenPixelKey>(header->pixelKeys);
+    const FrozenPixelKey* keysEnd = keys + header->pixelKeys.count;
+    const Snapshot::Cell* finalCells = section<Snapshot::Cell>(header->pixelFinal);
+    const uint64_t* begins = section<uint64_t>(header->pixelHistoryBegins);
+    const uint64_t* history = section<uint64_t>(header->pixelHistory);
+    bool atEnd = recordNumber >= header->recordCount;
+
+    // For an earlier point, the (record number, index in `region`) of the last write to each pixel before it, so we
+    // can decode them in record order, a block at a time.
+    std::vector<std::pair<uint64_t, uint64_t>> earlier;
+    for (uint64_t row = 0; row < regionHeight; row++) {
+        const FrozenPixelKey* it = std::lower_bound(keys, keysEnd, FrozenPixelKey{y + row, x});
+        for (; it != keysEnd && it->y == y + row && it->x < x + regionWidth; it++) {
+            uint64_t key = it - keys;
+            uint64_t index = row * regionWidth + (it->x - x);
+            if (atEnd) {
+                // Left as it is if it ended up blank, see `Pixel::isBlank`.
+                if (!Pixel(0, 0, finalCells[key].color, finalCells[key].userID).isBlank()) {
+                    region[index] = {finalCells[key].color, finalCells[key].userID, history[begins[key + 1] - 1],
+                                     true};
+                }
+                continue;
+            }
+            const uint64_t* last = std::lower_bound(history + begins[key], history + begins[key + 1], recordNumber);
+            if (last != history + begins[key]) {
+                earlier.emplace_back(*(last - 1), index);
+            }
+        }
+    }
+    if (earlier.empty()) {
+        return true;
+    }
+    std::sort(earlier.begin(), earlier.end());
+    std::vector<uint64_t> recordNumbers(earlier.size());
+    for (size_t i = 0; i < earlier.size(); i++) {
+        recordNumbers[i] = earlier[i].first;
+    }
+    std::vector<Update> records = decodeRecords(recordNumbers.data(), recordNumbers.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        const Update& u = records[i];
+        if (!u.pixel.isBlank()) {
+            region[earlier[i].second] = {translateColor(u.pixel.getColor(), u.recordNumber), u.pixel.getUserID(),
+                                         u.recordNumber, true};
+        }
+    }
+    return true;
+}
+
+Snapshot FrozenArchive::getFinalState() const {
+    Snapshot snapshot(header->width, header->height);
+    const FrozenPixelKey* keys = section<FrozenPixelKey>(header->pixelKeys);
+    const Snapshot::Cell* finalCells = section<Snapshot::Cell>(header->pixelFinal);
+    for (uint64_t i = 0; i < header->pixelKeys.count; i++) {
+        snapshot.set(Pixel(keys[i].x, keys[i].y, finalCells[i].color, finalCells[i].userID));
+    }
+    snapshot.recordNumber = header->recordCount;
+    snapshot.paletteEpoch = section<FrozenPaletteEpoch>(header->paletteEpochs)[header->paletteEpochs.count - 1].epoch;
+    return snapshot;
+}
+
+std::vector<Update> FrozenArchive::getDiff(uint64_t fromRecordNumber, size_t limit) const {
+    std::vector<Update> diff;
+    std::vector<Update> block;
+    for (uint64_t b = fromRecordNumber / blockSize; b < header->blockIndex.count && diff.size() < limit; b++) {
+        block.clear();
+        if (!decodeBlock(b, block)) {
+            break;
+        }
+        for (const Update& u : block) {
+            if (u.recordNumber >= fromRecordNumber && diff.size() < limit) {
+                diff.emplace_back(u.recordNumber, u.timestamp, u.pixel);
+            }
+        }
+    }
+    return diff;
+}
+
+uint64_t FrozenArchive::getRecordCountAt(uint64_t timestamp) const {
+    // Timestamps are in order (see `Place::revert`), so it's the last block that starts at or before `timestamp`,
+    // then somewhere in that block.
+    const FrozenBlock* blocks = section<FrozenBlock>(header->blockIndex);
+    const FrozenBlock* it = std::partition_point(blocks, blocks + header->blockIndex.count,
+                                                 [timestamp](const FrozenBlock& b) {
+        return b.firstTimestamp <= timestamp;
+    });
+    if (it == blocks) {
+        return 0;
+    }
+    std::vector<Update> block;
+    uint64_t b = it - blocks - 1;
+    if (!decodeBlock(b, block)) {
+        return b * blockSize;
+    }
+    return b * blockSize + (std::partition_point(block.begin(), block.end(), [timestamp](const Update& u) {
+        return u.timestamp <= timestamp;
+    }) - block.begin());
+}
+
+std::vector<Update> FrozenArchive::getPixelHistory(uint64_t x, uint64_t y) const {
+    uint64_t key = findPixel(x, y);
+    if (key == header->pixelKeys.count) {
+        return {};
+    }
+    const uint64_t* begins = section<uint64_t>(header->pixelHistoryBegins);
+    return decodeRecords(section<uint64_t>(header->pixelHistory) + begins[key], begins[key + 1] - begins[key]);
+}
+
+std::vector<Update> FrozenArchive::getUserHistory(uint64_t userID) const {
+    const uint64_t* userIDs = section<uint64_t>(header->userIDs);
+    const uint64_t* it = std::lower_bound(userIDs, userIDs + header->userIDs.count, userID);
+    if (it == userIDs + header->userIDs.count || *it != userID) {
+        return {};
+    }
+    const uint64_t* begins = section<uint64_t>(header->userHistoryBegins);
+    uint64_t index = it - userIDs;
+    return decodeRecords(section<uint64_t>(header->userHistory) + begins[index], begins[index + 1] - begins[index]);
+}
+
+uint64_t FrozenArchive::getOwnedPixels(uint64_t userID) const {
+    const uint64_t* userIDs = section<uint64_t>(header->userIDs);
+    const uint64_t* it = std::lower_bound(userIDs, userIDs + header->userIDs.count, userID);
+    if (it == userIDs + header->userIDs.count || *it != userID) {
+        return 0;
+    }
+    return section<uint64_t>(header->userOwned)[it - userIDs];
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> FrozenArchive::getLeaderboard(size_t k) const {
+    const FrozenOwner* owners = section<FrozenOwner>(header->leaderboard);
+    std::vector<std::pair<uint64_t, uint64_t>> top;
+    for (uint64_t i = 0; i < std::min<uint64_t>(k, header->leaderboard.count); i++) {
+        top.emplace_back(owners[i].userID, owners[i].owned);
+    }
+    return top;
+}
+
+std::vector<CanvasEpoch> FrozenArchive::getEpochs() const {
+    const CanvasEpoch* epochs = section<CanvasEpoch>(header->canvasEpochs);
+    return std::vector<CanvasEpoch>(epochs, epochs + header->canvasEpochs.count);
+}
+
+std::vector<PaletteEpoch> FrozenArchive::getPaletteEpochs() const {
+    const FrozenPaletteEpoch* epochs = section<FrozenPaletteEpoch>(header->paletteEpochs);
+    const uint64_t* words = section<uint64_t>(header->paletteWords);
+    std::vector<PaletteEpoch> result;
+    for (uint64_t i = 0; i < header->paletteEpochs.count; i++) {
+        const FrozenPaletteEpoch& e = epochs[i];
+        result.push_back({e.epoch, e.recordNumber,
+                          std::vector<uint32_t>(words + e.colorsBegin, words + e.colorsBegin + e.colorsCount),
+                          std::vector<uint64_t>(words + e.remapBegin, words + e.remapBegin + e.remapCount)});
+    }
+    return result;
+}
+
+bool Place::freeze(const std::string& path) {
+    {
+        // Anyone who gets the lock after this sees it and backs off, so once we have it again nothing can change.
+        std::unique_lock<ScalableSharedMutex> lock(updateMutex);
+        frozen.store(true, std::memory_order_release);
+    }
+
+    // Readers can carry on while we write.
+    std::shared_lock<ScalableSharedMutex> lock(updateMutex);
+    return FrozenArchive::write(path, updates, canvasEpochs, paletteEpochs, [this](const Update& u) {
+        return translateColorLocked(u.pixel.getColor(), paletteEpochForLocked(u.recordNumber));
+    });
+}
+
+// Priority classes for the `Executor`, most urgent first.
+enum class Priority {
+    // Anything a client is waiting on, i.e., applying writes.
+    Foreground,
+
+    // Work that readers will want soon, like encoding.
+    Normal,
+
+    // Maintenance: checkpoints, compaction, index building, timelapses.
+    Background,
+};
+
+// Configuration for an `Executor`.
+struct ExecutorLimits {
+    size_t threads = 4;
+
+    // How much of the threads each class can have at once. Foreground work can use all of them.
+    double normalShare = 0.5;
+    double backgroundShare = 0.25;
+
+    // Threads that never start Normal or Background work, whatever the shares say, so there's always somewhere for
+    // foreground work to start right away.
+    size_t reservedForeground = 1;
+};
+
+// A fixed set of threads shared by work of every priority, so that maintenance doesn't need threads of its own that
+// sit idle most of the time, but also can't get in the way of anything urgent.
+//
+// Each thread has its own queue per class, and takes the most urgent task it's allowed to run, from its own queues
+// first, then stealing from the others. Tasks posted from one of our threads go on that thread's queues, anything else
+// is spread round robin. Each class other than Foreground has a budget, the most threads it can have at once, and
+// together they always leave `reservedForeground` threads for Foreground work, so a foreground task never waits behind
+// more than whatever's already running on the other threads.
+//
+// Long jobs are posted with `postChunked`, as a step that's called until it says it's done. Each step is a separate
+// task, put back at the end of its queue, so a job can be preempted between any two steps by anything more urgent (or
+// by other jobs of its own class), and a step should be short, a millisecond or so.
+class Executor {
+  public:
+    Executor(const ExecutorLimits& limits = ExecutorLimits());
+
+    // Runs everything that's already been posted, chunked jobs to the end, before returning.
+    ~Executor();
+
+    void post(Priority priority, std::function<void()> task);
+    void postChunked(Priority priority, std::function<bool()> step);
+
+    // Waits until everything posted so far (and anything it posts) has finished, chunked jobs to the end. Don't call
+    // this from a task.
+    void drain();
+
+    // Microseconds spent running tasks of a class, across every thread.
+    uint64_t getBusyMicroseconds(Priority priority) const {
+        return busyUs[static_cast<size_t>(priority)].load(std::memory_order_relaxed);
+    }
+
+    size_t getThreadCount() const {return workers.size();}
+
+  private:
+    static constexpr size_t classCount = 3;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<bool()>> tasks[classCount];
+        std::thread thread;
+    };
+
+    void run(size_t index);
+    void push(size_t index, size_t priority, std::function<bool()> task);
+
+    // Takes the most urgent task that's within its class's budget, and counts it as running.
+    bool take(size_t index, size_t& priority, std::function<bool()>& task);
+
+    // Counts a task of the class as running, if that's within budget, and the opposite.
+    bool claim(size_t priority);
+    void release(size_t priority);
+
+    // Whether there's anything queued that some thread could start now.
+    bool runnable() const;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    size_t budgets[classCount];
+    size_t nonForegroundBudget;
+
+    std::atomic<size_t> queued[classCount]{};
+    std::atomic<size_t> running[classCount]{};
+    std::atomic<size_t> runningNonForeground{0};
+    std::atomic<uint64_t> busyUs[classCount]{};
+    std::atomic<size_t> nextWorker{0};
+
+    // Jobs posted but not finished, a chunked job counts once. `drain` waits on `idle` for this to be 0.
+    std::atomic<size_t> outstanding{0};
+    std::mutex idleMutex;
+    std::condition_variable idle;
+
+    // Threads with nothing they can run sleep on `wakeup`.
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    std::atomic<size_t> sleeping{0};
+    bool stopping = false;
+};
+
+// So a task posted from one of our own threads goes on that thread's queue.
+static thread_local Executor* currentExecutor = nullptr;
+static thread_local size_t currentWorker = 0;
+
+Executor::Executor(const ExecutorLimits& limits) {
+    size_t threads = std::max<size_t>(limits.threads, 1);
+
+    // With a single thread, nothing can be reserved, and everything has to be allowed to use it.
+    nonForegroundBudget = threads > limits.reservedForeground ? threads - limits.reservedForeground : 1;
+    budgets[static_cast<size_t>(Priority::Foreground)] = threads;
+    budgets[static_cast<size_t>(Priority::Normal)] =
+        std::max(static_cast<size_t>(threads * limits.normalShare), size_t(1));
+    budgets[static_cast<size_t>(Priority::Background)] =
+        std::max(static_cast<size_t>(threads * limits.backgroundShare), size_t(1));
+    for (size_t i = 0; i < threads; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        workers[i]->thread = std::thread(&Executor::run, this, i);
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+}
+
+void Executor::drain() {
+    std::unique_lock<std::mutex> lock(idleMutex);
+    idle.wait(lock, [this] {return outstanding.load() == 0;});
+}
+
+void Executor::post(Priority priority, std::function<void()> task) {
+    postChunked(priority, [task = std::move(task)] {
+        task();
+        return false;
+    });
+}
+
+void Executor::postChunked(Priority priority, std::function<bool()> step) {
+    outstanding.fetch_add(1);
+    size_t index = currentExecutor == this ? currentWorker : nextWorker.fetch_add(1) % workers.size();
+    push(index, static_cast<size_t>(priority), std::move(step));
+}
+
+void Executor::push(size_t index, size_t priority, std::function<bool()> task) {
+    {
+        std::lock_guard<std::mutex> lock(workers[index]->mutex);
+        workers[index]->tasks[priority].push_back(std::move(task));
+    }
+    queued[priority].fetch_add(1);
+
+    // Sleepers count themselves before they last check for work, and we count the task before checking for them, so
+    // one of us sees the other.
+    if (sleeping.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wakeup.notify_one();
+    }
+}
+
+bool Executor::claim(size_t priority) {
+    size_t count = running[priority].load();
+    do {
+        if (count >= budgets[priority]) {
+            return false;
+        }
+    } while (!running[priority].compare_exchange_weak(count, count + 1));
+    if (priority == static_cast<size_t>(Priority::Foreground)) {
+        return true;
+    }
+    count = runningNonForeground.load();
+    do {
+        if (count >= nonForegroundBudget) {
+            running[priority].fetch_sub(1);
+            return false;
+        }
+    } while (!runningNonForeground.compare_exchange_weak(count, count + 1));
+    return true;
+}
+
+void Executor::release(size_t priority) {
+    running[priority].fetch_sub(1);
+    if (priority != static_cast<size_t>(Priority::Foreground)) {
+        runningNonForeground.fetch_sub(1);
+    }
+}
+
+bool Executor::runnable() const {
+    if (queued[0].load() > 0) {
+        return true;
+    }
+    for (size_t priority = 1; priority < classCount; priority++) {
+        if (queued[priority].load() > 0 && running[priority].load() < budgets[priority] &&
+            runningNonForeground.load() < nonForegroundBudget) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Executor::take(size_t index, size_t& priority, std::function<bool()>& task) {
+    for (priority = 0; priority < classCount; priority++) {
+        if (queued[priority].load() == 0 || !claim(priority)) {
+            continue;
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker& worker = *workers[(index + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (!worker.tasks[priority].empty()) {
+                task = std::move(worker.tasks[priority].front());
+                worker.tasks[priority].pop_front();
+                queued[priority].fetch_sub(1);
+                return true;
+            }
+        }
+        // Somebody else got there first.
+        release(priority);
+    }
+    return false;
+}
+
+void Executor::run(size_t index) {
+    currentExecutor = this;
+    currentWorker = index;
+    std::function<bool()> task;
+    size_t priority;
+    while (true) {
+        if (take(index, priority, task)) {
+            uint64_t start = steadyMicroseconds();
+            bool more = task();
+            busyUs[priority].fetch_add(steadyMicroseconds() - start, std::memory_order_relaxed);
+            release(priority);
+            if (more) {
+                // To the back, so whatever's waiting gets a turn first.
+                push(index, priority, std::move(task));
+            } else {
+                if (priority != 0 && sleeping.load() > 0 && runnable()) {
+                    // We were holding budget that somebody might have been waiting on.
+                    std::lock_guard<std::mutex> lock(sleepMutex);
+                    wakeup.notify_one();
+                }
+                if (outstanding.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> lock(idleMutex);
+                    idle.notify_all();
+                }
+            }
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleeping.fetch_add(1);
+        bool empty = queued[0].load() + queued[1].load() + queued[2].load() == 0;
+        if (stopping && empty) {
+            sleeping.fetch_sub(1);
+            return;
+        }
+        if (!runnable() && !stopping) {
+            // The timeout is just a backstop, we should always be woken up.
+            wakeup.wait_for(lock, std::chrono::milliseconds(10));
+        }
+        sleeping.fetch_sub(1);
+    }
+}
+
+// Configuration for a `CanvasRegistry`.
+struct RegistryLimits {
+    // The executor shared by every canvas.
+    ExecutorLimits executor;
+
+    // A canvas that uses more than this stops accepting writes through the registry, so one runaway canvas can't take
+    // down every other canvas in the process.
+    uint64_t canvasMemoryBudget = 256ull << 20;
+
+    // Once the loaded canvases use more than this in total, the least recently used ones are checkpointed and unloaded
+    // even if they haven't been idle for `idleTimeoutUs`.
+    uint64_t totalMemoryBudget = 4ull << 30;
+
+    // Canvases that haven't been used for this long are checkpointed and unloaded.
+    uint64_t idleTimeoutUs = 60'000'000;
+};
+
+// Hosts many Places (per-community canvases, test canvases) in one process. Canvases are loaded from their checkpoint
+// the first time they're used, and checkpointed and unloaded again once they go idle, so a dormant canvas only costs
+// its entry in the map here. Work that isn't specific to one canvas runs on an executor shared between all of them.
+//
+// Each canvas is checkpointed to `<directory>/<name>.place`.
+class CanvasRegistry {
+  public:
+    CanvasRegistry(const std::string& directory, const RegistryLimits& limits = RegistryLimits());
+
+    // Checkpoints every loaded canvas.
+    ~CanvasRegistry();
+
+    // Returns the named canvas, loading it from its checkpoint (or creating it, if there's no checkpoint) if it isn't
+    // loaded. Returns nullptr if the name can't be used as a file name, or its checkpoint can't be loaded, in which
+    // case the canvas stays unloaded (and its checkpoint untouched). A canvas isn't unloaded while anybody holds the
+    // returned pointer.
+    std::shared_ptr<Place> get(const std::string& name);
+
+    // Applies an update to the named canvas as foreground work on the executor, calling `done` with the result from
+    // there.
+    // Fails (with `done(false)`) if the canvas is over its memory budget.
+    void submit(const std::string& name, const Pixel& p, std::function<void(bool)> done = nullptr);
+
+    // Checkpoints and unloads canvases that have been idle for too long, and then, if we're still over the total
+    // memory budget, the least recently used of the rest. Call this periodically. The checkpoints are written on the
+    // executor as background work, so this returns right away.
+    void unloadIdle();
+
+    // Number of canvases currently loaded, and known about in total (loaded or not).
+    size_t loadedCount();
+    size_t knownCount();
+
+    // For work that's done on behalf of a canvas.
+    Executor& getExecutor() {return executor;}
+
+  private:
+    struct Entry {
+        // Null while dormant.
+        std::shared_ptr<Place> place;
+        uint64_t lastUsedUs = 0;
+
+        // As of the last `unloadIdle`.
+        uint64_t memoryUsage = 0;
+
+        // Set while a checkpoint for unloading is in flight, so we don't queue another.
+        bool unloading = false;
+
+        // Set while a thread is loading the canvas (with `canvasesMutex` released), anybody else waits on `loaded`.
+        bool loading = false;
+    };
+
+    std::string checkpointPath(const std::string& name) const {return directory + "/" + name + ".place";}
+
+    // Runs as background work: writes the checkpoint, then unloads the canvas if nobody touched it in the meantime.
+    void checkpointAndUnload(const std::string& name, std::shared_ptr<Place> place);
+
+    const std::string directory;
+    const RegistryLimits limits;
+    std::unordered_map<std::string, Entry> canvases;
+    std::mutex canvasesMutex;
+    std::condition_variable loaded;
+
+    // Declared last, so it's destroyed (and finishes its work) first.
+    Executor executor;
+};
+
+CanvasRegistry::CanvasRegistry(const std::string& directory, const RegistryLimits& limits) :
+    directory(directory),
+    limits(limits),
+    executor(limits.executor)
+{
+}
+
+CanvasRegistry::~CanvasRegistry() {
+    // Checkpoints queued by `unloadIdle` have to finish before we write our own.
+    executor.drain();
+    std::lock_guard<std::mutex> lock(canvasesMutex);
+    for (auto& [name, entry] : canvases) {
+        if (entry.place) {
+            entry.place->save(checkpointPath(name));
+        }
+    }
+}
+
+std::shared_ptr<Place> CanvasRegistry::get(const std::string& name) {
+    if (name.empty() || name.find('/') != std::string::npos || name[0] == '.') {
+        return nullptr;
+    }
+    std::unique_lock<std::mutex> lock(canvasesMutex);
+    loaded.wait(lock, [&] {return !canvases[name].loading;});
+    Entry& entry = canvases[name];
+    entry.lastUsedUs = steadyMicroseconds();
+    if (entry.place) {
+        return entry.place;
+    }
+
+    // Loading reads the whole log, so don't hold up every other canvas while we do it. Only whoever is loading an entry
+    // removes it (below), so `entry` stays valid.
+    entry.loading = true;
+    lock.unlock();
+    auto place = std::make_shared<Place>();
+    std::string path = checkpointPath(name);
+    struct stat info;
+    bool exists = stat(path.c_str(), &info) == 0 || errno != ENOENT;
+
+    // If there's no checkpoint, this is a new canvas. If there is one and it won't load, we mustn't start a blank
+    // canvas, it would be checkpointed over the real one.
+    bool ok = !exists || place->load(path);
+    lock.lock();
+    entry.loading = false;
+    loaded.notify_all();
+    if (!ok) {
+        // Nothing to keep, and the next `get` tries the checkpoint again.
+        canvases.erase(name);
+        return nullptr;
+    }
+    entry.place = std::move(place);
+    return entry.place;
+}
+
+void CanvasRegistry::submit(const std::string& name, const Pixel& p, std::function<void(bool)> done) {
+    std::shared_ptr<Place> place = get(name);
+    bool overBudget = false;
+    if (place) {
+        std::lock_guard<std::mutex> lock(canvasesMutex);
+        overBudget = canvases[name].memoryUsage > limits.canvasMemoryBudget;
+    }
+    if (!place || overBudget) {
+        if (done) {
+            done(false);
+        }
+        return;
+    }
+    executor.post(Priority::Foreground, [place, p, done = std::move(done)] {
+        bool result = place->update(p);
+        if (done) {
+            done(result);
+        }
+    });
+}
+
+void CanvasRegistry::unloadIdle() {
+    uint64_t now = steadyMicroseconds();
+    std::vector<std::pair<std::string, std::shared_ptr<Place>>> toUnload;
+    {
+        std::lock_guard<std::mutex> lock(canvasesMutex);
+
+        // Refresh memory use, and unload anything that's been idle too long.
+        uint64_t total = 0;
+        std::vector<std::pair<uint64_t, std::string>> byLastUse;
+        for (auto& [name, entry] : canvases) {
+            if (!entry.place || entry.unloading) {
+                continue;
+            }
+            entry.memoryUsage = entry.place->memoryUsage();
+            if (now - entry.lastUsedUs > limits.idleTimeoutUs) {
+                entry.unloading = true;
+                toUnload.emplace_back(name, entry.place);
+            } else {
+                total += entry.memoryUsage;
+                byLastUse.emplace_back(entry.lastUsedUs, name);
+            }
+        }
+
+        // Then, the least recently used until we're back under the total budget.
+        std::sort(byLastUse.begin(), byLastUse.end());
+        for (size_t i = 0; i < byLastUse.size() && total > limits.totalMemoryBudget; i++) {
+            Entry& entry = canvases[byLastUse[i].second];
+            total -= entry.memoryUsage;
+            entry.unloading = true;
+            toUnload.emplace_back(byLastUse[i].second, entry.place);
+        }
+    }
+
+    for (auto& [name, place] : toUnload) {
+        executor.post(Priority::Background, [this, name = name, place = std::move(place)]() mutable {
+            checkpointAndUnload(name, std::move(place));
+        });
+    }
+}
+
+void CanvasRegistry::checkpointAndUnload(const std::string& name, std::shared_ptr<Place> place) {
+    uint64_t recordCount = place->getRecordCount();
+    uint64_t epoch = place->getEpoch();
+    bool saved = place->save(checkpointPath(name));
+
+    std::lock_guard<std::mutex> lock(canvasesMutex);
+    Entry& entry = canvases[name];
+    entry.unloading = false;
+
+    // Only unload if the checkpoint has everything, and nobody but us and the registry is holding the canvas. Nobody
+    // can pick it up while we hold `canvasesMutex`. If either check fails, we'll try again next time.
+    if (saved && entry.place == place && place.use_count() == 2 && place->getRecordCount() == recordCount &&
+        place->getEpoch() == epoch) {
+        entry.place.reset();
+        entry.memoryUsage = 0;
+    }
+}
+
+size_t CanvasRegistry::loadedCount() {
+    std::lock_guard<std::mutex> lock(canvasesMutex);
+    size_t count = 0;
+    for (const auto& [name, entry] : canvases) {
+        count += entry.place ? 1 : 0;
+    }
+    return count;
+}
+
+size_t CanvasRegistry::knownCount() {
+    std::lock_guard<std::mutex> lock(canvasesMutex);
+    return canvases.size();
+}
+
+// Wire encodings used by the front end. Every number is 8 bytes, little endian.
+//
+// Snapshot: width, height, recordNumber, then the color of every pixel in row order.
+// Updates:  count, then for each update recordNumber, timestamp, x, y, color, userID (the 48 bytes from `Update`).
+// Region:   x, y, width, height, then for each pixel in row order color, userID, recordNumber, placed (0 or 1).
+static void appendUint64(std::string& out, uint64_t value) {
+    char bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = static_cast<char>(value >> (8 * i));
+    }
+    out.append(bytes, 8);
+}
+
+static size_t encodedSnapshotSize(const Snapshot& snapshot) {
+    return (3 + snapshot.width * snapshot.height) * 8;
+}
+
+static void encodeSnapshot(const Snapshot& snapshot, std::string& out) {
+    appendUint64(out, snapshot.width);
+    appendUint64(out, snapshot.height);
+    appendUint64(out, snapshot.recordNumber);
+    for (uint64_t y = 0; y < snapshot.height; y++) {
+        for (uint64_t x = 0; x < snapshot.width; x += Snapshot::tileSize) {
+            const Snapshot::Cell* cells = &snapshot.getTile(x / Snapshot::tileSize, y / Snapshot::tileSize).cells[
+                (y % Snapshot::tileSize) * Snapshot::tileSize];
+            for (uint64_t i = 0; i < Snapshot::tileSize && x + i < snapshot.width; i++) {
+                appendUint64(out, cells[i].color);
+            }
+        }
+    }
+}
+
+static size_t encodedUpdatesSize(size_t count) {
+    return (1 + 6 * count) * 8;
+}
+
+// A single update, without the count in front.
+static void appendUpdate(std::string& out, uint64_t recordNumber, uint64_t timestamp, const Pixel& pixel) {
+    appendUint64(out, recordNumber);
+    appendUint64(out, timestamp);
+    appendUint64(out, pixel.getX());
+    appendUint64(out, pixel.getY());
+    appendUint64(out, pixel.getColor());
+    appendUint64(out, pixel.getUserID());
+}
+
+static void encodeUpdates(const Update* updates, size_t count, std::string& out) {
+    appendUint64(out, count);
+    for (const Update* u = updates; u < updates + count; u++) {
+        appendUpdate(out, u->recordNumber, u->timestamp, u->pixel);
+    }
+}
+
+static size_t encodedRegionSize(size_t pixels) {
+    return (4 + 4 * pixels) * 8;
+}
+
+// `region` is `regionWidth` x `regionHeight` pixels, in row order.
+static void encodeRegion(uint64_t x, uint64_t y, uint64_t regionWidth, uint64_t regionHeight,
+                         const PixelInfo* region, std::string& out) {
+    appendUint64(out, x);
+    appendUint64(out, y);
+    appendUint64(out, regionWidth);
+    appendUint64(out, regionHeight);
+    for (const PixelInfo* info = region; info < region + regionWidth * regionHeight; info++) {
+        appendUint64(out, info->color);
+        appendUint64(out, info->userID);
+        appendUint64(out, info->recordNumber);
+        appendUint64(out, info->placed);
+    }
+}
+
+// An encoded message that never changes once it's built, so the same bytes can be queued on any number of
+// connections without copying them per connection. It's freed when the last connection is done sending it (including,
+// for zero copy sends, once the kernel says it's done with it).
+using EncodedBuffer = std::shared_ptr<const std::string>;
+
+// SHA-1, which is only here because the WebSocket handshake requires it. Returns the 20 byte digest.
+static std::string sha1(const std::string& message) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    std::string padded = message;
+    padded.push_back(static_cast<char>(0x80));
+    while (padded.size() % 64 != 56) {
+        padded.push_back(0);
+    }
+    uint64_t bits = static_cast<uint64_t>(message.size()) * 8;
+    for (int i = 7; i >= 0; i--) {
+        padded.push_back(static_cast<char>(bits >> (8 * i)));
+    }
+    auto rotate = [](uint32_t value, int count) {return (value << count) | (value >> (32 - count));};
+    for (size_t chunk = 0; chunk < padded.size(); chunk += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(padded.data() + chunk + i * 4);
+            w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = rotate(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotate(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    std::string digest;
+    for (uint32_t word : h) {
+        for (int i = 3; i >= 0; i--) {
+            digest.push_back(static_cast<char>(word >> (8 * i)));
+        }
+    }
+    return digest;
+}
+
+static std::string base64(const std::string& data) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+    for (size_t i = 0; i < data.size(); i += 3) {
+        uint32_t group = uint32_t(static_cast<unsigned char>(data[i])) << 16;
+        if (i + 1 < data.size()) {
+            group |= uint32_t(static_cast<unsigned char>(data[i + 1])) << 8;
+        }
+        if (i + 2 < data.size()) {
+            group |= static_cast<unsigned char>(data[i + 2]);
+        }
+        result.push_back(alphabet[(group >> 18) & 63]);
+        result.push_back(alphabet[(group >> 12) & 63]);
+        result.push_back(i + 1 < data.size() ? alphabet[(group >> 6) & 63] : '=');
+        result.push_back(i + 2 < data.size() ? alphabet[group & 63] : '=');
+    }
+    return result;
+}
+
+// Caches catch-up diffs for the record numbers clients most often come back from. Lots of clients load the same
+// snapshot, so they all reconnect asking for "everything since record V", and building that from the log for each of
+// them is wasted work.
+//
+// Each entry is keyed by its base record number and holds a coalesced diff (only the latest update for each pixel
+// changed since the base) up to some target record number, already encoded. When the Place moves on, the entry is
+// rebased forward by folding in just the updates since its old target, rather than being rebuilt from the base. If
+// none of those touch a pixel that's already in the diff, the old encoding is still right as far as it goes, so it's
+// copied and the new updates are appended. Otherwise the diff is re-encoded from `byRecord`, which is already in
+// record order. Only one thread builds a given entry at a time, anybody else asking for it waits for that build and
+// shares the result.
+//
+// Bases are rounded down to a multiple of `baseGranularity`, so clients can't make us build an entry for every record
+// number, and clients that loaded slightly different snapshots still share one.
+class DiffCache {
+  public:
+    static constexpr uint64_t baseGranularity = 1024;
+
+    DiffCache(Place& place, size_t capacity = 64);
+
+    // Returns the coalesced diff from `base` to the latest record, encoded as updates (see the wire encodings). As
+    // bases are rounded down, this can include updates from before `base`. Applying those to a canvas as of `base` is
+    // harmless, it already has them, so the result is a superset of what was asked for that leads to the same canvas.
+    EncodedBuffer get(uint64_t base);
+
+  private:
+    struct PixelKey {
+        uint64_t x;
+        uint64_t y;
+        bool operator==(const PixelKey& other) const {return x == other.x && y == other.y;}
+    };
+
+    struct PixelKeyHash {
+        size_t operator()(const PixelKey& key) const {return std::hash<uint64_t>()(key.x * 0x9E3779B97F4A7C15 ^ key.y);}
+    };
+
+    // The latest update to a pixel, minus its record number, which is its key in `Entry::byRecord`.
+    struct Latest {
+        uint64_t timestamp;
+        Pixel pixel;
+    };
+
+    struct Entry {
+        // Everything from the base up to (not including) `target` is folded into `byRecord` and `encoded`.
+        uint64_t target = 0;
+
+        // The latest update to every pixel changed since the base, by record number, and the record number of the
+        // latest update for each of those pixels.
+        std::map<uint64_t, Latest> byRecord;
+        std::unordered_map<PixelKey, uint64_t, PixelKeyHash> latestRecord;
+        EncodedBuffer encoded;
+
+        // Set while a thread is building this entry (with `mutex` released).
+        bool building = false;
+        uint64_t lastUsedUs = 0;
+    };
+
+    // Drops the least recently used entries (that aren't being built) until we're within capacity.
+    void evict();
+
+    Place& place;
+    const size_t capacity;
+    std::unordered_map<uint64_t, std::shared_ptr<Entry>> entries;
+    std::mutex mutex;
+    std::condition_variable built;
+};
+
+DiffCache::DiffCache(Place& place, size_t capacity) :
+    place(place),
+    capacity(std::max<size_t>(capacity, 1))
+{
+}
+
+EncodedBuffer DiffCache::get(uint64_t base) {
+    base -= base % baseGranularity;
+    std::unique_lock<std::mutex> lock(mutex);
+    std::shared_ptr<Entry> entry;
+    uint64_t from;
+    while (true) {
+        auto it = entries.find(base);
+        bool added = it == entries.end();
+        if (added) {
+            it = entries.emplace(base, std::make_shared<Entry>()).first;
+            it->second->target = base;
+        }
+        entry = it->second;
+        entry->lastUsedUs = steadyMicroseconds();
+        if (added) {
+            // After it's marked used, so it's not the one to go. If it goes anyway (everything was used just now),
+            // we still have it, it's just not kept.
+            evict();
+        }
+        if (entry->encoded && entry->target >= place.getRecordCount()) {
+            return entry->encoded;
+        }
+        if (!entry->building) {
+            break;
+        }
+
+        // Somebody's already building this one, share theirs.
+        built.wait(lock);
+    }
+    entry->building = true;
+    from = entry->target;
+    lock.unlock();
+
+    // Only the updates since the last time this entry was built, the rest are already folded in. The temporaries are
+    // the caller's `RequestArena` (if it has one), only the encoded result outlives this call.
+    std::pmr::vector<Update> newer(RequestArena::resource());
+    place.getDiff(from, newer);
+    bool replacedEncoded = false;
+    for (const Update& u : newer) {
+        auto [it, added] = entry->latestRecord.try_emplace({u.pixel.getX(), u.pixel.getY()}, u.recordNumber);
+        if (!added) {
+            // Anything before `from` is in the old encoding, which now has a stale update for this pixel.
+            replacedEncoded |= it->second < from;
+            entry->byRecord.erase(it->second);
+            it->second = u.recordNumber;
+        }
+        entry->byRecord.emplace(u.recordNumber, Latest{u.timestamp, u.pixel});
+    }
+
+    // Encoded in record order, same as an uncoalesced diff. Everything from `from` on is new, and after everything
+    // that was already there.
+    auto encoded = std::make_shared<std::string>();
+    encoded->reserve(encodedUpdatesSize(entry->byRecord.size()));
+    appendUint64(*encoded, entry->byRecord.size());
+    auto appendFrom = entry->byRecord.begin();
+    if (entry->encoded && !replacedEncoded) {
+        // All but the old count.
+        encoded->append(*entry->encoded, 8);
+        appendFrom = entry->byRecord.lower_bound(from);
+    }
+    for (auto it = appendFrom; it != entry->byRecord.end(); it++) {
+        appendUpdate(*encoded, it->first, it->second.timestamp, it->second.pixel);
+    }
+
+    lock.lock();
+    entry->target = from + newer.size();
+    entry->encoded = std::move(encoded);
+    entry->building = false;
+    built.notify_all();
+    return entry->encoded;
+}
+
+void DiffCache::evict() {
+    while (entries.size() > capacity) {
+        auto oldest = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); it++) {
+            if (!it->second->building && (oldest == entries.end() ||
+                                          it->second->lastUsedUs < oldest->second->lastUsedUs)) {
+                oldest = it;
+            }
+        }
+        if (oldest == entries.end()) {
+            // Everything's being built, we'll catch up next time.
+            return;
+        }
+        entries.erase(oldest);
+    }
+}
+
+// Configuration for `RateLimiter`. Each tier is a token bucket: it refills at `perSecond` tokens a second, holds at
+// most `burst`, and every write takes one token. A tier with a `perSecond` of 0 doesn't limit anything.
+struct RateLimits {
+    struct Tier {
+        uint64_t perSecond;
+        uint64_t burst;
+    };
+
+    // One bucket per userID, and one per source address.
+    Tier user{1, 10};
+    Tier address{20, 200};
+
+    // One bucket for everything, a ceiling on writes overall.
+    Tier global{100'000, 100'000};
+
+    // Buckets kept for each of the user and address tiers, see `RateLimiter`.
+    size_t tableSize = 1 << 16;
+};
+
+// Layered rate limiting for writes, with a tier per user, per source address and overall. This runs on every write
+// before it gets anywhere near the Place, so it takes no locks, allocates nothing after construction, and every check
+// is constant time. It's separate from the cooldown in `Place::update`, which is a rule of the game, this is about
+// protecting the server.
+//
+// Each bucket is a single atomic word, updated with compare and swap. Rather than a token count and the time it was
+// last refilled, we store the time at which the bucket will be full again (the "generic cell rate algorithm", which
+// behaves exactly like a token bucket). Taking a token pushes that time out by one token's worth, and is refused if
+// that would put it more than `burst` tokens' worth in the future.
+//
+// User and address buckets live in flat, fixed size tables of cache line sized groups, four slots each. A key only
+// ever looks at the one group it hashes to. A key that isn't there claims an empty slot, or one whose bucket is full
+// (forgetting a full bucket loses nothing). If there's neither, it shares whichever bucket in the group is closest to
+// full, which can only make it stricter. The global tier is split into shards, so writers on different cores don't all
+// fight over one cache line, each with its share of the rate. A write only looks past its own shard when that's empty.
+class RateLimiter {
+  public:
+    RateLimiter(const RateLimits& limits = RateLimits());
+
+    // Takes a token from each tier for a write by `userID` from `address`. Returns 0 if that's allowed. Otherwise, it
+    // takes nothing and returns roughly how long until it would be allowed, in microseconds.
+    uint64_t admit(uint64_t userID, uint64_t address);
+
+  private:
+    static constexpr size_t slotsPerGroup = 4;
+    static constexpr size_t globalShards = 16;
+
+    // A tier in the units we use: how much time a token is worth, and how far into the future a bucket can be full
+    // again, in nanoseconds. Both are 0 if the tier is off.
+    struct Rate {
+        Rate(const RateLimits::Tier& tier, uint64_t shares = 1);
+        uint64_t tokenNs = 0;
+        uint64_t burstNs = 0;
+    };
+
+    // Each slot's key is stored plus one, so that 0 means empty (the largest key is stored as 1, and ends up sharing
+    // with 0).
+    struct alignas(64) Group {
+        std::atomic<uint64_t> keys[slotsPerGroup];
+        std::atomic<uint64_t> buckets[slotsPerGroup];
+    };
+
+    struct Table {
+        Table(const RateLimits::Tier& tier, size_t size);
+
+        // The bucket for `key`, claiming one if needed, see above.
+        std::atomic<uint64_t>& bucketFor(uint64_t key, uint64_t nowNs);
+
+        Rate rate;
+        std::unique_ptr<Group[]> groups;
+        uint64_t groupMask;
+    };
+
+    struct alignas(64) GlobalShard {
+        std::atomic<uint64_t> bucket{0};
+    };
+
+    // Takes a token from `bucket`. On failure, sets `waitNs` to how long until there'd be one.
+    static bool take(std::atomic<uint64_t>& bucket, const Rate& rate, uint64_t nowNs, uint64_t& waitNs);
+
+    // Gives back a token from a successful `take`, when a later tier refuses the write.
+    static void giveBack(std::atomic<uint64_t>& bucket, const Rate& rate);
+
+    // Takes a token from the global tier, starting with this thread's shard.
+    bool takeGlobal(uint64_t nowNs, uint64_t& waitNs);
+
+    Table users;
+    Table addresses;
+    Rate globalRate;
+    GlobalShard shards[globalShards];
+};
+
+RateLimiter::Rate::Rate(const RateLimits::Tier& tier, uint64_t shares) {
+    if (tier.perSecond) {
+        tokenNs = std::max<uint64_t>(1'000'000'000 * shares / tier.perSecond, 1);
+        burstNs = tokenNs * std::max<uint64_t>(tier.burst / shares, 1);
+    }
+}
+
+RateLimiter::Table::Table(const RateLimits::Tier& tier, size_t size) :
+    rate(tier)
+{
+    size_t groupCount = 1;
+    while (groupCount * slotsPerGroup < size) {
+        groupCount *= 2;
+    }
+    groups = std::make_unique<Group[]>(groupCount);
+    for (size_t i = 0; i < groupCount; i++) {
+        for (size_t j = 0; j < slotsPerGroup; j++) {
+            groups[i].keys[j].store(0, std::memory_order_relaxed);
+            groups[i].buckets[j].store(0, std::memory_order_relaxed);
+        }
+    }
+    groupMask = groupCount - 1;
+}
+
+std::atomic<uint64_t>& RateLimiter::Table::bucketFor(uint64_t key, uint64_t nowNs) {
+    uint64_t stored = key + 1 ? key + 1 : 1;
+    Group& group = groups[((key * 0x9E3779B97F4A7C15) >> 32) & groupMask];
+    for (size_t i = 0; i < slotsPerGroup; i++) {
+        if (group.keys[i].load(std::memory_order_acquire) == stored) {
+            return group.buckets[i];
+        }
+    }
+
+    // Not here yet. If two threads claim a slot for the same key at once, it can briefly have two, the second one
+    // fills up and gets reclaimed.
+    size_t closest = 0;
+    uint64_t closestFull = UINT64_MAX;
+    for (size_t i = 0; i < slotsPerGroup; i++) {
+        uint64_t current = group.keys[i].load(std::memory_order_acquire);
+        uint64_t full = group.buckets[i].load(std::memory_order_relaxed);
+        if (current == 0 || full <= nowNs) {
+            if (group.keys[i].compare_exchange_strong(current, stored, std::memory_order_acq_rel) ||
+                current == stored) {
+                return group.buckets[i];
+            }
+        }
+        if (full < closestFull) {
+            closest = i;
+            closestFull = full;
+        }
+    }
+    return group.buckets[closest];
+}
+
+RateLimiter::RateLimiter(const RateLimits& limits) :
+    users(limits.user, limits.tableSize),
+    addresses(limits.address, limits.tableSize),
+    globalRate(limits.global, globalShards)
+{
+}
+
+bool RateLimiter::take(std::atomic<uint64_t>& bucket, const Rate& rate, uint64_t nowNs, uint64_t& waitNs) {
+    uint64_t full = bucket.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t next = std::max(full, nowNs) + rate.tokenNs;
+        if (next > nowNs + rate.burstNs) {
+            waitNs = next - nowNs - rate.burstNs;
+            return false;
+        }
+        if (bucket.compare_exchange_weak(full, next, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+void RateLimiter::giveBack(std::atomic<uint64_t>& bucket, const Rate& rate) {
+    // Every take added at least this much, so this can't go below zero.
+    bucket.fetch_sub(rate.tokenNs, std::memory_order_relaxed);
+}
+
+bool RateLimiter::takeGlobal(uint64_t nowNs, uint64_t& waitNs) {
+    static std::atomic<size_t> nextShard{0};
+    thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % globalShards;
+    waitNs = UINT64_MAX;
+    for (size_t i = 0; i < globalShards; i++) {
+        uint64_t shardWaitNs;
+        if (take(shards[(shard + i) % globalShards].bucket, globalRate, nowNs, shardWaitNs)) {
+            return true;
+        }
+        waitNs = std::min(waitNs, shardWaitNs);
+    }
+    return false;
+}
+
+uint64_t RateLimiter::admit(uint64_t userID, uint64_t address) {
+    uint64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    uint64_t waitNs = 0;
+
+    // Cheapest and most likely to refuse first.
+    std::atomic<uint64_t>* userBucket = nullptr;
+    if (users.rate.tokenNs) {
+        userBucket = &users.bucketFor(userID, nowNs);
+        if (!take(*userBucket, users.rate, nowNs, waitNs)) {
+            return waitNs / 1000 + 1;
+        }
+    }
+    std::atomic<uint64_t>* addressBucket = nullptr;
+    if (addresses.rate.tokenNs) {
+        addressBucket = &addresses.bucketFor(address, nowNs);
+        if (!take(*addressBucket, addresses.rate, nowNs, waitNs)) {
+            if (userBucket) {
+                giveBack(*userBucket, users.rate);
+            }
+            return waitNs / 1000 + 1;
+        }
+    }
+    if (globalRate.tokenNs && !takeGlobal(nowNs, waitNs)) {
+        if (userBucket) {
+            giveBack(*userBucket, users.rate);
+        }
+        if (addressBucket) {
+            giveBack(*addressBucket, addresses.rate);
+        }
+        return waitNs / 1000 + 1;
+    }
+    return 0;
+}
+
+// An embedded HTTP and WebSocket front end for a single Place.
+//
+// There's one event loop thread per core. Each has its own listening socket bound to the same port with SO_REUSEPORT,
+// so the kernel spreads connections between them, and its own edge-triggered epoll set, so the loops never share
+// anything but the Place. Everything is non-blocking: each loop reads until EAGAIN, handles every complete request it
+// has, and writes until EAGAIN, keeping whatever didn't fit for the next EPOLLOUT.
+//
+// Output is a queue of shared, immutable `EncodedBuffer`s, so a snapshot or update batch is encoded once and the same
+// bytes are queued on every connection that wants them. Queued buffers go out with a single gathering sendmsg, and
+// large ones with MSG_ZEROCOPY, so the kernel reads them straight from our memory rather than copying them per socket.
+// A zero copy buffer is kept alive until its completion notification arrives on the socket's error queue.
+//
+// Requests are parsed in place (as views into the connection's input), and everything a request needs only while it's
+// being handled (headers, the pixels behind a region, the updates behind a diff) comes from the loop thread's
+// `RequestArena`, so a request costs a few heap allocations for its response, however big that is.
+//
+// Endpoints (all numbers in the query string, all responses use the encodings above):
+//     POST /update?x=&y=&color=&user=   200 if applied, 403 if rejected by the Place, 429 if rate limited (see
+//                                       `RateLimiter`), with the microseconds to wait as the body.
+//     GET  /snapshot                    The current state. 413 if the Place is over `maxEncodedPixels`.
+//     GET  /diff?from=                  The latest update to every pixel changed since record `from`, see `DiffCache`.
+//     GET  /region?x=&y=&w=&h=          A rectangle from `Place::getRegion`, of at least one pixel and at most
+//                                       `maxEncodedPixels`.
+//     GET  /leaderboard?k=              Up to k (at most 1000) userID, pixels owned pairs, see `Place::getLeaderboard`.
+//     GET  /palette                     Each palette epoch as its epoch, first record number, color count, then its
+//                                       colors, so clients can read `/diff` records from before a palette change.
+//     GET  /stream                      WebSocket. Each binary message is a batch of updates, sent every tick.
+class FrontEnd {
+  public:
+    FrontEnd(Place& place, uint16_t port, size_t threadCount = std::thread::hardware_concurrency(),
+             const RateLimits& rateLimits = RateLimits());
+
+    // Stops and joins the event loops.
+    ~FrontEnd();
+
+    // Binds and starts the event loops. Returns false if any of the listening sockets can't be set up.
+    bool start();
+    void stop();
+
+    // How often WebSocket subscribers get a batch.
+    static constexpr int tickMilliseconds = 50;
+
+    // The largest snapshot or region we'll encode for a single response. A big, sparse canvas has to be fetched in
+    // regions.
+    static constexpr uint64_t maxEncodedPixels = 1 << 22;
+
+    // Requests handled so far, over every loop.
+    uint64_t getRequestCount() const;
+
+    // Heap allocations made while parsing and handling those requests (not counting sending the responses), over
+    // every loop. Temporaries come from each loop's `RequestArena`, so this should be a few per request however big
+    // the responses are. Always zero unless built with -DRPLACE_COUNT_ALLOCATIONS, see `heapAllocations`.
+    uint64_t getRequestAllocations() const;
+
+  private:
+    // The longest request headers and body we'll accept (and skip). A WebSocket frame from a client is held to the
+    // same limit as a body.
+    static constexpr size_t maxHeaderBytes = 65536;
+    static constexpr size_t maxBodyBytes = 65536;
+
+    // The most input we'll buffer for a connection, i.e., an incomplete request with as much of both as allowed.
+    static constexpr size_t maxInputBytes = maxHeaderBytes + maxBodyBytes;
+
+    // A WebSocket subscriber with more than this still queued has stopped reading (or can't keep up), and is hung up on
+    // at the next broadcast rather than buffered for forever. It can reconnect and start over from `/snapshot`.
+    static constexpr size_t maxSubscriberBacklogBytes = 16 << 20;
+
+    // Buffers at least this big are sent with MSG_ZEROCOPY, below that pinning pages costs more than copying them.
+    static constexpr size_t zeroCopyThreshold = 16384;
+
+    // How long a closed connection waits for its outstanding MSG_ZEROCOPY completions (see `close`), and how long we
+    // keep its buffers after giving up and resetting it.
+    static constexpr uint64_t drainMicroseconds = 30'000'000;
+    static constexpr uint64_t abandonMicroseconds = 1'000'000;
+
+    // Part of a connection's output: a buffer, and how much of it has been sent so far.
+    struct OutputSegment {
+        EncodedBuffer buffer;
+        size_t offset;
+    };
+
+    struct Connection {
+        int fd;
+
+        // The peer's IPv4 address, for rate limiting.
+        uint32_t address = 0;
+        std::string input;
+        std::deque<OutputSegment> output;
+
+        // How much of `output` is still to be sent.
+        size_t queuedBytes = 0;
+        bool webSocket = false;
+        bool closeAfterWrite = false;
+
+        // Whether the socket accepted SO_ZEROCOPY.
+        bool zeroCopy = false;
+
+        // Every MSG_ZEROCOPY send gets the next number, starting from 0. The kernel tells us (on the error queue) when
+        // it's done with a range of these, and until then we keep the buffer alive here.
+        uint32_t zeroCopySends = 0;
+        std::deque<std::pair<uint32_t, EncodedBuffer>> zeroCopyPending;
+
+        // Once closed with completions still pending, when we stop waiting for them.
+        uint64_t drainDeadlineUs = 0;
+    };
+
+    // Orders header names ignoring case, so they can be looked up as written in the spec.
+    struct HeaderNameLess {
+        using is_transparent = void;
+        bool operator()(std::string_view a, std::string_view b) const {
+            return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char c, char d) {
+                return ::tolower(static_cast<unsigned char>(c)) < ::tolower(static_cast<unsigned char>(d));
+            });
+        }
+    };
+
+    // A single request, as parsed from a Connection's input. The strings point into the input and the maps live in the
+    // `RequestArena`, so this is only good until the request has been handled.
+    struct Request {
+        explicit Request(std::pmr::memory_resource* resource) :
+            query(resource),
+            headers(resource)
+        {
+        }
+
+        std::string_view method;
+        std::string_view path;
+        std::pmr::map<std::string_view, std::string_view> query;
+        std::pmr::map<std::string_view, std::string_view, HeaderNameLess> headers;
+    };
+
+    // The state for one event loop thread. Only that thread touches it.
+    struct Loop {
+        int listenFD = -1;
+        int epollFD = -1;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+
+        // Connections we've closed that the kernel may still be sending from (with MSG_ZEROCOPY), see `close`. They're
+        // still open and in the epoll set, so their completions arrive.
+        std::unordered_map<int, std::unique_ptr<Connection>> draining;
+
+        // Buffers from draining connections we had to reset, and when it's safe to free them.
+        std::deque<std::pair<uint64_t, EncodedBuffer>> abandoned;
+
+        // Every WebSocket subscriber on this loop has been sent everything before this record number.
+        uint64_t streamedThrough = 0;
+        std::thread thread;
+
+        // Requests handled, and the heap allocations that took, see `getRequestAllocations`. Only this loop writes
+        // these.
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> requestAllocations{0};
+    };
+
+    void run(Loop& loop);
+    void accept(Loop& loop);
+    void readFrom(Loop& loop, Connection& connection);
+
+    // Handles whatever complete requests or frames are in the connection's input.
+    void handleInput(Loop& loop, Connection& connection);
+    void writeTo(Loop& loop, Connection& connection);
+
+    // With `abort`, for peers we know aren't reading, the connection is reset rather than left to send what the kernel
+    // still has queued. If it's waiting on MSG_ZEROCOPY completions, that happens at the next tick rather than after
+    // `drainMicroseconds`.
+    void close(Loop& loop, int fd, bool abort = false);
+
+    // Closes a draining connection if the kernel is done with all of its buffers, or resets it if it's out of time.
+    // Returns true if it's gone.
+    bool finishDraining(Loop& loop, Connection& connection, uint64_t now);
+
+    // Closes a socket with SO_LINGER 0, so the kernel drops whatever it hasn't sent yet rather than sending it later.
+    static void reset(int fd);
+
+    // Releases buffers the kernel has finished sending with MSG_ZEROCOPY. Returns false if the socket has an actual
+    // error, rather than just completions waiting.
+    bool reapZeroCopyCompletions(Connection& connection);
+
+    // Sends every WebSocket subscriber on `loop` whatever's new since the last tick. The batch is encoded once and the
+    // same bytes go to every subscriber.
+    void broadcast(Loop& loop);
+
+    // Parses and handles every complete request in the connection's input, each in its own `RequestArena::Scope`.
+    // Returns false if the input is garbage.
+    bool handleRequests(Loop& loop, Connection& connection);
+    void handleRequest(const Request& request, Connection& connection);
+
+    // Handles frames sent by a WebSocket client (we only care about ping and close). A frame that isn't masked, or is
+    // longer than `maxBodyBytes`, closes the connection.
+    void handleWebSocketFrames(Connection& connection);
+
+    // Queues a response with the given body on the connection. For large bodies, queue `responseHeader` and the
+    // encoded body as separate buffers, so the body can be shared and doesn't get copied.
+    static void respond(Connection& connection, int status, const char* reason, std::string_view body = {});
+    static EncodedBuffer responseHeader(const Connection& connection, int status, const char* reason,
+                                        size_t contentLength);
+    static void appendResponseHeader(std::string& out, const Connection& connection, int status, const char* reason,
+                                     size_t contentLength);
+
+    // Room for any header `appendResponseHeader` writes, so building one never reallocates.
+    static constexpr size_t maxResponseHeaderSize = 128;
+    static void queue(Connection& connection, EncodedBuffer buffer);
+
+    // The current snapshot, encoded. This is shared between every loop and rebuilt only when the Place has changed.
+    EncodedBuffer encodedSnapshot();
+
+    // Appends the header for a single unfragmented WebSocket frame.
+    static void appendFrameHeader(std::string& out, uint8_t opcode, size_t payloadLength);
+
+    Place& place;
+    const uint16_t port;
+    const size_t threadCount;
+    std::vector<std::unique_ptr<Loop>> loops;
+    std::atomic<bool> running{false};
+
+    // Shared by every loop, for `/diff`.
+    DiffCache diffCache;
+
+    // Shared by every loop, for `/update`.
+    RateLimiter rateLimiter;
+
+    // See `encodedSnapshot`.
+    EncodedBuffer cachedSnapshot;
+    uint64_t cachedSnapshotRecordNumber = 0;
+    uint64_t cachedSnapshotPaletteEpoch = 0;
+    std::mutex cachedSnapshotMutex;
+};
+
+FrontEnd::FrontEnd(Place& place, uint16_t port, size_t threadCount, const RateLimits& rateLimits) :
+    place(place),
+    port(port),
+    threadCount(std::max<size_t>(threadCount, 1)),
+    diffCache(place),
+    rateLimiter(rateLimits)
+{
+}
+
+FrontEnd::~FrontEnd() {
+    stop();
+}
+
+bool FrontEnd::start() {
+    for (size_t i = 0; i < threadCount; i++) {
+        auto loop = std::make_unique<Loop>();
+        loop->listenFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int enable = 1;
+        setsockopt(loop->listenFD, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        setsockopt(loop->listenFD, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+        loop->epollFD = epoll_create1(0);
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = loop->listenFD;
+        if (loop->listenFD < 0 || loop->epollFD < 0 ||
+            bind(loop->listenFD, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(loop->listenFD, SOMAXCONN) != 0 ||
+            epoll_ctl(loop->epollFD, EPOLL_CTL_ADD, loop->listenFD, &event) != 0) {
+            ::close(loop->listenFD);
+            ::close(loop->epollFD);
+            for (auto& started : loops) {
+                ::close(started->listenFD);
+                ::close(started->epollFD);
+            }
+            loops.clear();
+            return false;
+        }
+        loop->streamedThrough = place.getRecordCount();
+        loops.push_back(std::move(loop));
+    }
+    running.store(true);
+    for (auto& loop : loops) {
+        loop->thread = std::thread(&FrontEnd::run, this, std::ref(*loop));
+    }
+    return true;
+}
+
+void FrontEnd::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    for (auto& loop : loops) {
+        loop->thread.join();
+
+        // The buffers go with the loop, so nothing may still be sending from them.
+        for (auto& [fd, connection] : loop->connections) {
+            if (connection->zeroCopyPending.empty()) {
+                ::close(fd);
+            } else {
+                reset(fd);
+            }
+        }
+        for (auto& [fd, connection] : loop->draining) {
+            reset(fd);
+        }
+        ::close(loop->listenFD);
+        ::close(loop->epollFD);
+    }
+    loops.clear();
+}
+
+uint64_t FrontEnd::getRequestCount() const {
+    uint64_t total = 0;
+    for (const auto& loop : loops) {
+        total += loop->requests.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t FrontEnd::getRequestAllocations() const {
+    uint64_t total = 0;
+    for (const auto& loop : loops) {
+        total += loop->requestAllocations.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void FrontEnd::run(Loop& loop) {
+    static constexpr int maxEvents = 256;
+    epoll_event events[maxEvents];
+    auto nextTick = std::chrono::steady_clock::now() + std::chrono::milliseconds(tickMilliseconds);
+    while (running.load(std::memory_order_relaxed)) {
+        int count = epoll_wait(loop.epollFD, events, maxEvents, tickMilliseconds);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == loop.listenFD) {
+                accept(loop);
+                continue;
+            }
+            auto draining = loop.draining.find(fd);
+            if (draining != loop.draining.end()) {
+                if (finishDraining(loop, *draining->second, steadyMicroseconds())) {
+                    loop.draining.erase(draining);
+                }
+                continue;
+            }
+            auto it = loop.connections.find(fd);
+            if (it == loop.connections.end()) {
+                continue;
+            }
+            // Zero copy completions show up as EPOLLERR too, so only give up on a real error.
+            if ((events[i].events & EPOLLHUP) ||
+                ((events[i].events & EPOLLERR) && !reapZeroCopyCompletions(*it->second))) {
+                close(loop, fd);
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                readFrom(loop, *it->second);
+            }
+
+            // Reading can close the connection.
+            it = loop.connections.find(fd);
+            if (it != loop.connections.end() && (events[i].events & EPOLLOUT)) {
+                writeTo(loop, *it->second);
+            }
+        }
+        if (std::chrono::steady_clock::now() >= nextTick) {
+            broadcast(loop);
+
+            // Completions usually wake us up through EPOLLERR, this catches deadlines.
+            uint64_t now = steadyMicroseconds();
+            for (auto it = loop.draining.begin(); it != loop.draining.end(); ) {
+                it = finishDraining(loop, *it->second, now) ? loop.draining.erase(it) : std::next(it);
+            }
+            while (!loop.abandoned.empty() && loop.abandoned.front().first <= now) {
+                loop.abandoned.pop_front();
+            }
+            nextTick = std::chrono::steady_clock::now() + std::chrono::milliseconds(tickMilliseconds);
+        }
+    }
+}
+
+void FrontEnd::accept(Loop& loop) {
+    // Edge triggered, so take everything that's waiting.
+    while (true) {
+        sockaddr_in peer{};
+        socklen_t peerLength = sizeof(peer);
+        int fd = accept4(loop.listenFD, reinterpret_cast<sockaddr*>(&peer), &peerLength, SOCK_NONBLOCK);
+        if (fd < 0) {
+            return;
+        }
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        bool zeroCopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.fd = fd;
+        if (epoll_ctl(loop.epollFD, EPOLL_CTL_ADD, fd, &event) != 0) {
+            ::close(fd);
+            continue;
+        }
+        auto connection = std::make_unique<Connection>();
+        connection->fd = fd;
+        connection->zeroCopy = zeroCopy;
+        connection->address = ntohl(peer.sin_addr.s_addr);
+        loop.connections.emplace(fd, std::move(connection));
+    }
+}
+
+void FrontEnd::readFrom(Loop& loop, Connection& connection) {
+    char buffer[16384];
+    while (true) {
+        ssize_t received = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (received > 0) {
+            connection.input.append(buffer, received);
+
+            // However fast the client sends, we deal with what we have before buffering more than `maxInputBytes`.
+            // Anything still left after that is more than a request or frame is allowed to be.
+            if (connection.input.size() >= maxInputBytes) {
+                handleInput(loop, connection);
+                if (connection.input.size() >= maxInputBytes) {
+                    close(loop, connection.fd);
+                    return;
+                }
+            }
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // Closed by the other side, or an error.
+        close(loop, connection.fd);
+        return;
+    }
+
+    handleInput(loop, connection);
+    writeTo(loop, connection);
+}
+
+void FrontEnd::handleInput(Loop& loop, Connection& connection) {
+    if (connection.webSocket) {
+        handleWebSocketFrames(connection);
+    } else if (!handleRequests(loop, connection)) {
+        respond(connection, 400, "Bad Request");
+        connection.closeAfterWrite = true;
+    }
+
+    // Once we're hanging up, nothing else they send matters.
+    if (connection.closeAfterWrite) {
+        connection.input.clear();
+    }
+}
+
+void FrontEnd::writeTo(Loop& loop, Connection& connection) {
+    static constexpr size_t maxSegments = 64;
+    while (!connection.output.empty()) {
+        // A big buffer at the front goes on its own with MSG_ZEROCOPY, the kernel sends straight from our pages.
+        // Anything else is gathered into a single writev-style send.
+        const OutputSegment& front = connection.output.front();
+        bool zeroCopy = connection.zeroCopy && front.buffer->size() - front.offset >= zeroCopyThreshold;
+        iovec vectors[maxSegments];
+        size_t count = 0;
+        for (const OutputSegment& segment : connection.output) {
+            if (count == maxSegments || (count && segment.buffer->size() - segment.offset >= zeroCopyThreshold)) {
+                break;
+            }
+            vectors[count].iov_base = const_cast<char*>(segment.buffer->data() + segment.offset);
+            vectors[count].iov_len = segment.buffer->size() - segment.offset;
+            count++;
+            if (zeroCopy) {
+                break;
+            }
+        }
+        msghdr message{};
+        message.msg_iov = vectors;
+        message.msg_iovlen = count;
+        ssize_t sent = sendmsg(connection.fd, &message, MSG_NOSIGNAL | (zeroCopy ? MSG_ZEROCOPY : 0));
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // We'll get EPOLLOUT when there's room again.
+            return;
+        }
+        if (sent < 0 && zeroCopy && errno == ENOBUFS) {
+            // Out of pinned memory (optmem), fall back to copying for this connection.
+            connection.zeroCopy = false;
+            continue;
+        }
+        if (sent <= 0) {
+            close(loop, connection.fd);
+            return;
+        }
+        if (zeroCopy) {
+            // The kernel may still be reading from the buffer after we drop it from `output`.
+            connection.zeroCopyPending.emplace_back(connection.zeroCopySends++, front.buffer);
+        }
+
+        // Drop everything that's fully sent.
+        connection.queuedBytes -= sent;
+        size_t remaining = sent;
+        while (remaining) {
+            OutputSegment& segment = connection.output.front();
+            size_t available = segment.buffer->size() - segment.offset;
+            if (remaining < available) {
+                segment.offset += remaining;
+                break;
+            }
+            remaining -= available;
+            connection.output.pop_front();
+        }
+    }
+    if (connection.closeAfterWrite) {
+        close(loop, connection.fd);
+    }
+}
+
+bool FrontEnd::reapZeroCopyCompletions(Connection& connection) {
+    while (true) {
+        char control[128];
+        msghdr message{};
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(connection.fd, &message, MSG_ERRQUEUE) < 0) {
+            break;
+        }
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            if (!((header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                  (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            const sock_extended_err* error = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(header));
+            if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            // The kernel is done with sends `ee_info` through `ee_data`, inclusive. They complete in order on TCP.
+            uint32_t last = error->ee_data;
+            while (!connection.zeroCopyPending.empty() &&
+                   static_cast<int32_t>(connection.zeroCopyPending.front().first - last) <= 0) {
+                connection.zeroCopyPending.pop_front();
+            }
+        }
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    return error == 0;
+}
+
+void FrontEnd::close(Loop& loop, int fd, bool abort) {
+    auto it = loop.connections.find(fd);
+    if (it == loop.connections.end()) {
+        return;
+    }
+    std::unique_ptr<Connection> connection = std::move(it->second);
+    loop.connections.erase(it);
+    reapZeroCopyCompletions(*connection);
+    if (connection->zeroCopyPending.empty()) {
+        // Closing removes it from the epoll set.
+        if (abort) {
+            reset(fd);
+        } else {
+            ::close(fd);
+        }
+        return;
+    }
+
+    // The kernel may still be sending straight from the pending buffers, and once they're freed that memory can be
+    // reused for anything, which would then go out to the peer. So keep the socket open until the completions arrive,
+    // holding the buffers, but stop doing anything else with it.
+    shutdown(fd, SHUT_RD);
+    connection->output.clear();
+    connection->queuedBytes = 0;
+    connection->webSocket = false;
+    connection->drainDeadlineUs = abort ? 0 : steadyMicroseconds() + drainMicroseconds;
+    loop.draining.emplace(fd, std::move(connection));
+}
+
+bool FrontEnd::finishDraining(Loop& loop, Connection& connection, uint64_t now) {
+    reapZeroCopyCompletions(connection);
+    if (connection.zeroCopyPending.empty()) {
+        ::close(connection.fd);
+        return true;
+    }
+    if (now < connection.drainDeadlineUs) {
+        return false;
+    }
+
+    // The peer isn't reading. Resetting drops everything still queued, then give anything in flight a moment.
+    reset(connection.fd);
+    for (auto& [number, buffer] : connection.zeroCopyPending) {
+        loop.abandoned.emplace_back(now + abandonMicroseconds, std::move(buffer));
+    }
+    return true;
+}
+
+void FrontEnd::reset(int fd) {
+    linger option{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &option, sizeof(option));
+    ::close(fd);
+}
+
+void FrontEnd::broadcast(Loop& loop) {
+    RequestArena::Scope scope;
+    std::pmr::vector<Update> batch(RequestArena::resource());
+    place.getDiff(loop.streamedThrough, batch);
+    if (batch.empty()) {
+        return;
+    }
+    loop.streamedThrough = batch.back().recordNumber + 1;
+
+    auto frame = std::make_shared<std::string>();
+    size_t payloadSize = encodedUpdatesSize(batch.size());
+    frame->reserve(payloadSize + 10);
+    appendFrameHeader(*frame, 0x2, payloadSize);
+    encodeUpdates(batch.data(), batch.size(), *frame);
+    EncodedBuffer shared = std::move(frame);
+
+    std::pmr::vector<int> subscribers(RequestArena::resource());
+    for (auto& [fd, connection] : loop.connections) {
+        if (connection->webSocket) {
+            subscribers.push_back(fd);
+        }
+    }
+    for (int fd : subscribers) {
+        auto it = loop.connections.find(fd);
+        if (it != loop.connections.end() && it->second->queuedBytes > maxSubscriberBacklogBytes) {
+            close(loop, fd, true);
+        } else if (it != loop.connections.end()) {
+            queue(*it->second, shared);
+            writeTo(loop, *it->second);
+        }
+    }
+}
+
+bool FrontEnd::handleRequests(Loop& loop, Connection& connection) {
+    // The input isn't touched until we're done with it at the bottom, so everything can point straight into it.
+    std::string_view input = connection.input;
+    size_t consumed = 0;
+    bool valid = true;
+    while (!connection.webSocket && !connection.closeAfterWrite) {
+        size_t headerEnd = input.find("\r\n\r\n", consumed);
+        if (headerEnd == std::string_view::npos) {
+            // Don't let anybody make us buffer forever.
+            valid = input.size() - consumed < maxHeaderBytes;
+            break;
+        }
+
+        uint64_t allocationsBefore = heapAllocations;
+        RequestArena::Scope scope;
+        Request request(RequestArena::resource());
+        size_t lineEnd = input.find("\r\n", consumed);
+        std::string_view requestLine = input.substr(consumed, lineEnd - consumed);
+        size_t firstSpace = requestLine.find(' ');
+        size_t secondSpace = requestLine.find(' ', firstSpace + 1);
+        if (firstSpace == std::string_view::npos || secondSpace == std::string_view::npos) {
+            return false;
+        }
+        request.method = requestLine.substr(0, firstSpace);
+        std::string_view target = requestLine.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+        size_t question = target.find('?');
+        request.path = target.substr(0, question);
+        if (question != std::string_view::npos) {
+            std::string_view query = target.substr(question + 1);
+            size_t start = 0;
+            while (start <= query.size()) {
+                size_t end = query.find('&', start);
+                std::string_view pair = query.substr(start, end == std::string_view::npos ? end : end - start);
+                size_t equals = pair.find('=');
+                if (equals != std::string_view::npos) {
+                    request.query[pair.substr(0, equals)] = pair.substr(equals + 1);
+                }
+                if (end == std::string_view::npos) {
+                    break;
+                }
+                start = end + 1;
+            }
+        }
+        for (size_t line = lineEnd + 2; line < headerEnd; ) {
+            size_t end = input.find("\r\n", line);
+            std::string_view header = input.substr(line, end - line);
+            size_t colon = header.find(':');
+            if (colon != std::string_view::npos) {
+                size_t valueStart = header.find_first_not_of(' ', colon + 1);
+                request.headers[header.substr(0, colon)] =
+                    valueStart == std::string_view::npos ? std::string_view() : header.substr(valueStart);
+            }
+            line = end + 2;
+        }
+
+        // We don't use bodies, but we have to skip them, and we buffer them while we wait for all of it, so they get
+        // the same kind of limit as headers.
+        size_t bodyLength = 0;
+        auto contentLength = request.headers.find("content-length");
+        if (contentLength != request.headers.end()) {
+            const char* end = contentLength->second.data() + contentLength->second.size();
+            auto [parsed, error] = std::from_chars(contentLength->second.data(), end, bodyLength);
+            if (error != std::errc() || parsed != end || bodyLength > maxBodyBytes) {
+                valid = false;
+                break;
+            }
+        }
+        if (input.size() < headerEnd + 4 + bodyLength) {
+            break;
+        }
+        consumed = headerEnd + 4 + bodyLength;
+
+        // One bad request (an allocation we couldn't make, say) shouldn't take the whole server down with it. It gets
+        // a 500, and the connection is closed once that's sent, in case we left it half way through something.
+        try {
+            handleRequest(request, connection);
+        } catch (const std::exception&) {
+            connection.closeAfterWrite = true;
+            respond(connection, 500, "Internal Server Error");
+        }
+        loop.requests.store(loop.requests.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        loop.requestAllocations.store(loop.requestAllocations.load(std::memory_order_relaxed) + heapAllocations -
+                                      allocationsBefore, std::memory_order_relaxed);
+    }
+    connection.input.erase(0, consumed);
+    return valid;
+}
+
+void FrontEnd::handleRequest(const Request& request, Connection& connection) {
+    auto number = [&request](const char* name, uint64_t& value) {
+        auto it = request.query.find(name);
+        if (it == request.query.end() || it->second.empty()) {
+            return false;
+        }
+        const char* end = it->second.data() + it->second.size();
+        auto [parsed, error] = std::from_chars(it->second.data(), end, value);
+        return error == std::errc() && parsed == end;
+    };
+
+    auto connectionHeader = request.headers.find("connection");
+    if (connectionHeader != request.headers.end() && connectionHeader->second == "close") {
+        connection.closeAfterWrite = true;
+    }
+
+    if (request.path == "/update" && request.method == "POST") {
+        uint64_t x, y, color, user;
+        if (!number("x", x) || !number("y", y) || !number("color", color) || !number("user", user)) {
+            respond(connection, 400, "Bad Request");
+            return;
+        }
+        uint64_t retryAfterUs = rateLimiter.admit(user, connection.address);
+        if (retryAfterUs) {
+            std::string body;
+            appendUint64(body, retryAfterUs);
+            respond(connection, 429, "Too Many Requests", body);
+        } else if (place.update(Pixel(x, y, color, user))) {
+            respond(connection, 200, "OK");
+        } else {
+            respond(connection, 403, "Forbidden");
+        }
+    } else if (request.path == "/snapshot" && request.method == "GET") {
+        uint64_t width = place.width;
+        if (width > maxEncodedPixels || (width && place.height > maxEncodedPixels / width)) {
+            respond(connection, 413, "Payload Too Large");
+            return;
+        }
+        EncodedBuffer body = encodedSnapshot();
+        queue(connection, responseHeader(connection, 200, "OK", body->size()));
+        queue(connection, std::move(body));
+    } else if (request.path == "/diff" && request.method == "GET") {
+        uint64_t from;
+        if (!number("from", from)) {
+            respond(connection, 400, "Bad Request");
+            return;
+        }
+        EncodedBuffer body = diffCache.get(from);
+        queue(connection, responseHeader(connection, 200, "OK", body->size()));
+        queue(connection, std::move(body));
+    } else if (request.path == "/leaderboard" && request.method == "GET") {
+        uint64_t k;
+        if (!number("k", k)) {
+            respond(connection, 400, "Bad Request");
+            return;
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> leaders = place.getLeaderboard(std::min<uint64_t>(k, 1000));
+        std::string body;
+        body.reserve(leaders.size() * 16);
+        for (const auto& [userID, owned] : leaders) {
+            appendUint64(body, userID);
+            appendUint64(body, owned);
+        }
+        respond(connection, 200, "OK", body);
+    } else if (request.path == "/palette" && request.method == "GET") {
+        std::string body;
+        for (const PaletteEpoch& epoch : place.getPaletteEpochs()) {
+            appendUint64(body, epoch.epoch);
+            appendUint64(body, epoch.recordNumber);
+            appendUint64(body, epoch.colors.size());
+            for (uint32_t color : epoch.colors) {
+                appendUint64(body, color);
+            }
+        }
+        respond(connection, 200, "OK", body);
+    } else if (request.path == "/region" && request.method == "GET") {
+        uint64_t x, y, w, h;
+        std::pmr::vector<PixelInfo> region(RequestArena::resource());
+        if (!number("x", x) || !number("y", y) || !number("w", w) || !number("h", h) || !w || !h ||
+            w > maxEncodedPixels || h > maxEncodedPixels / w || !place.getRegion(x, y, w, h, region)) {
+            respond(connection, 400, "Bad Request");
+            return;
+        }
+        auto body = std::make_shared<std::string>();
+        body->reserve(encodedRegionSize(region.size()));
+        encodeRegion(x, y, w, h, region.data(), *body);
+        queue(connection, responseHeader(connection, 200, "OK", body->size()));
+        queue(connection, std::move(body));
+    } else if (request.path == "/stream" && request.method == "GET") {
+        auto key = request.headers.find("sec-websocket-key");
+        if (key == request.headers.end()) {
+            respond(connection, 400, "Bad Request");
+            return;
+        }
+        std::string accept = base64(sha1(std::string(key->second) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+        queue(connection, std::make_shared<std::string>(
+            "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: " + accept + "\r\n\r\n"));
+        connection.webSocket = true;
+    } else {
+        respond(connection, 404, "Not Found");
+    }
+}
+
+void FrontEnd::handleWebSocketFrames(Connection& connection) {
+    // Echoes (or sends) a close and hangs up.
+    auto hangUp = [&connection]() {
+        auto frame = std::make_shared<std::string>();
+        appendFrameHeader(*frame, 0x8, 0);
+        queue(connection, std::move(frame));
+        connection.closeAfterWrite = true;
+    };
+    while (connection.input.size() >= 2) {
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(connection.input.data());
+        uint8_t opcode = data[0] & 0x0F;
+        bool masked = data[1] & 0x80;
+        uint64_t length = data[1] & 0x7F;
+        size_t offset = 2;
+        if (length == 126) {
+            if (connection.input.size() < 4) {
+                return;
+            }
+            length = (uint64_t(data[2]) << 8) | data[3];
+            offset = 4;
+        } else if (length == 127) {
+            if (connection.input.size() < 10) {
+                return;
+            }
+            length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = (length << 8) | data[2 + i];
+            }
+            offset = 10;
+        }
+        if (!masked || length > maxBodyBytes) {
+            // Clients have to mask what they send, and have no business sending us anything big.
+            hangUp();
+            return;
+        }
+        size_t maskOffset = offset;
+        offset += 4;
+        if (connection.input.size() < offset || length > connection.input.size() - offset) {
+            return;
+        }
+        std::string payload = connection.input.substr(offset, length);
+        for (size_t i = 0; i < payload.size(); i++) {
+            payload[i] ^= data[maskOffset + i % 4];
+        }
+        connection.input.erase(0, offset + length);
+
+        if (opcode == 0x8) {
+            hangUp();
+            return;
+        } else if (opcode == 0x9) {
+            auto frame = std::make_shared<std::string>();
+            appendFrameHeader(*frame, 0xA, payload.size());
+            *frame += payload;
+            queue(connection, std::move(frame));
+        }
+    }
+}
+
+void FrontEnd::respond(Connection& connection, int status, const char* reason, std::string_view body) {
+    auto response = std::make_shared<std::string>();
+    response->reserve(maxResponseHeaderSize + body.size());
+    appendResponseHeader(*response, connection, status, reason, body.size());
+    response->append(body);
+    queue(connection, std::move(response));
+}
+
+EncodedBuffer FrontEnd::responseHeader(const Connection& connection, int status, const char* reason,
+                                       size_t contentLength) {
+    auto header = std::make_shared<std::string>();
+    header->reserve(maxResponseHeaderSize);
+    appendResponseHeader(*header, connection, status, reason, contentLength);
+    return header;
+}
+
+void FrontEnd::appendResponseHeader(std::string& out, const Connection& connection, int status, const char* reason,
+                                    size_t contentLength) {
+    char number[24];
+    out += "HTTP/1.1 ";
+    out.append(number, std::to_chars(number, number + sizeof(number), status).ptr);
+    out += ' ';
+    out += reason;
+    out += "\r\nContent-Type: application/octet-stream\r\nContent-Length: ";
+    out.append(number, std::to_chars(number, number + sizeof(number), contentLength).ptr);
+    out += "\r\n";
+    if (connection.closeAfterWrite) {
+        out += "Connection: close\r\n";
+    }
+    out += "\r\n";
+}
+
+void FrontEnd::queue(Connection& connection, EncodedBuffer buffer) {
+    if (!buffer->empty()) {
+        connection.queuedBytes += buffer->size();
+        connection.output.push_back({std::move(buffer), 0});
+    }
+}
+
+EncodedBuffer FrontEnd::encodedSnapshot() {
+    // Held while encoding, so a burst of requests after a change encodes the snapshot once rather than once each.
+    std::lock_guard<std::mutex> lock(cachedSnapshotMutex);
+    if (cachedSnapshot && cachedSnapshotRecordNumber == place.getRecordCount() &&
+        cachedSnapshotPaletteEpoch == place.getPaletteEpoch()) {
+        return cachedSnapshot;
+    }
+    Snapshot snapshot = place.getCurrentState();
+    auto encoded = std::make_shared<std::string>();
+    encoded->reserve(encodedSnapshotSize(snapshot));
+    encodeSnapshot(snapshot, *encoded);
+    cachedSnapshot = std::move(encoded);
+    cachedSnapshotRecordNumber = snapshot.recordNumber;
+    cachedSnapshotPaletteEpoch = snapshot.paletteEpoch;
+    return cachedSnapshot;
+}
+
+void FrontEnd::appendFrameHeader(std::string& out, uint8_t opcode, size_t payloadLength) {
+    out.push_back(static_cast<char>(0x80 | opcode));
+    if (payloadLength < 126) {
+        out.push_back(static_cast<char>(payloadLength));
+    } else if (payloadLength < 65536) {
+        out.push_back(126);
+        out.push_back(static_cast<char>(payloadLength >> 8));
+        out.push_back(static_cast<char>(payloadLength));
+    } else {
+        out.push_back(127);
+        for (int i = 7; i >= 0; i--) {
+            out.push_back(static_cast<char>(static_cast<uint64_t>(payloadLength) >> (8 * i)));
+        }
+    }
+}
+
+// Multicast fan-out to edge servers. Sending every update batch to every edge over its own connection costs the core
+// egress in proportion to the number of edges. Instead, a MulticastPublisher sends each batch once to a multicast
+// group, and each edge's MulticastSubscriber picks it up from there and applies it to its own Snapshot.
+//
+// Batches are sealed: each tick's new updates are cut into datagrams whose contents never change, and record numbers
+// are contiguous, so they double as sequence numbers. A datagram says which records it holds and how far the stream
+// has got (`next`). When there's nothing new, the publisher still sends an empty datagram every tick, so a lost tail is
+// noticed too. A subscriber that sees a gap sends NACKs for the range it's missing straight back to the publisher,
+// which answers each with (the start of) just that range, unicast, from the Place's log.
+//
+// Whoever sends a NACK gets the repair, and a NACK's source address is easy to forge, so repairs mustn't make the core
+// much of an amplifier. A NACK is padded out to `multicastNackSize` and gets at most
+// `MulticastPublisher::maxRepairRecords` back, which is under three times what it took to ask. Repairs are also
+// capped per source address and overall each tick, and `MulticastConfig::subscribers` limits who gets them at all.
+//
+// Datagrams use the wire encodings, every number 8 bytes little endian:
+//     Batch: `multicastBatchMagic`, width, height, next, then updates (count first).
+//     NACK:  `multicastNackMagic`, from, to (exclusive), then zeros up to `multicastNackSize` bytes.
+struct MulticastConfig {
+    // Where batches go, and the address of the interface to send and join on (any by default). Use 127.0.0.1 to try
+    // it out on loopback.
+    std::string group = "239.255.42.1";
+    uint16_t port = 4242;
+    std::string interfaceAddress = "0.0.0.0";
+
+    // How many routers batches can cross. 1 keeps them on the local network.
+    int ttl = 1;
+
+    // If not empty, the publisher only answers NACKs from these addresses (each edge's, as IPv4 dotted quads). List
+    // the edges here unless nobody outside the network can send to the core.
+    std::vector<std::string> subscribers;
+
+    // Low latency mode for the publisher: it busy-polls the Place and NACKs rather than waiting for the next tick, so
+    // updates go out as soon as they're applied, in more and smaller datagrams. Best with `core` set to an isolated
+    // core (see `AdmissionLimits::busyPoll`), -1 doesn't pin.
+    bool busyPoll = false;
+    int core = -1;
+};
+
+static constexpr uint64_t multicastBatchMagic = 0x3162636d636c7072; // "rplcmcb1"
+static constexpr uint64_t multicastNackMagic = 0x316b616e636c7072;  // "rplcnak1"
+static constexpr size_t multicastHeaderSize = 5 * 8;
+static constexpr size_t multicastNackSize = 1024;
+
+static uint64_t readUint64(const char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+class MulticastPublisher {
+  public:
+    MulticastPublisher(Place& place, const MulticastConfig& config = MulticastConfig());
+
+    // Stops the thread.
+    ~MulticastPublisher();
+
+    // Opens the socket and starts publishing from the current record. Returns false if the socket can't be set up.
+    bool start();
+    void stop();
+
+    // Bytes sent to the group, and to single subscribers as repairs (UDP payload only).
+    uint64_t getBytesSent() const {return bytesSent.load(std::memory_order_relaxed);}
+    uint64_t getRepairBytesSent() const {return repairBytesSent.load(std::memory_order_relaxed);}
+    uint64_t getNacksReceived() const {return nacksReceived.load(std::memory_order_relaxed);}
+
+    // Same as the front end's WebSocket batches.
+    static constexpr int tickMilliseconds = 50;
+
+    // Keeps a datagram (with the header) under 1400 bytes, so it fits in one Ethernet frame with room to spare.
+    static constexpr size_t maxUpdatesPerDatagram = 28;
+
+    // The most records one NACK gets back, two datagrams' worth. Subscribers ask for a gap this much at a time.
+    static constexpr uint64_t maxRepairRecords = 2 * maxUpdatesPerDatagram;
+
+    // The most records repaired in a tick for any one source address, and for all of them between them.
+    static constexpr uint64_t repairRecordsPerSourcePerTick = 4096;
+    static constexpr uint64_t repairRecordsPerTick = 65536;
+
+  private:
+    void run();
+
+    // Sends `updates` as sealed datagrams, to the group or, for a repair, to one subscriber. An empty batch to the
+    // group is a heartbeat.
+    void send(const std::vector<Update>& updates, const sockaddr_in& to, bool repair);
+
+    Place& place;
+    const MulticastConfig config;
+    sockaddr_in groupAddress{};
+    int socketFD = -1;
+
+    // `MulticastConfig::subscribers`, in network byte order.
+    std::vector<uint32_t> allowedSubscribers;
+
+    // Only touched by `thread`: everything before this has been sent to the group, and the records repaired for each
+    // source address (that got any) this tick.
+    uint64_t publishedThrough = 0;
+    std::unordered_map<uint32_t, uint64_t> repairedThisTick;
+
+    std::atomic<bool> running{false};
+    std::thread thread;
+    std::atomic<uint64_t> bytesSent{0};
+    std::atomic<uint64_t> repairBytesSent{0};
+    std::atomic<uint64_t> nacksReceived{0};
+};
+
+MulticastPublisher::MulticastPublisher(Place& place, const MulticastConfig& config) :
+    place(place),
+    config(config)
+{
+}
+
+MulticastPublisher::~MulticastPublisher() {
+    stop();
+}
+
+bool MulticastPublisher::start() {
+    if (running.load()) {
+        return true;
+    }
+    groupAddress.sin_family = AF_INET;
+    groupAddress.sin_port = htons(config.port);
+    in_addr interface{};
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    unsigned char ttl = static_cast<unsigned char>(config.ttl);
+    allowedSubscribers.clear();
+    for (const std::string& subscriber : config.subscribers) {
+        in_addr address{};
+        if (inet_pton(AF_INET, subscriber.c_str(), &address) != 1) {
+            return false;
+        }
+        allowedSubscribers.push_back(address.s_addr);
+    }
+
+    // NACKs come back to this socket, so it also waits for them, just not for so long that a tick is late.
+    timeval timeout{0, 5000};
+    socketFD = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socketFD < 0 ||
+        inet_pton(AF_INET, config.group.c_str(), &groupAddress.sin_addr) != 1 ||
+        inet_pton(AF_INET, config.interfaceAddress.c_str(), &interface) != 1 ||
+        setsockopt(socketFD, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) != 0 ||
+        setsockopt(socketFD, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0 ||
+        setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        bind(socketFD, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+        ::close(socketFD);
+        socketFD = -1;
+        return false;
+    }
+    publishedThrough = place.getRecordCount();
+    running.store(true);
+    thread = std::thread(&MulticastPublisher::run, this);
+    return true;
+}
+
+void MulticastPublisher::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    thread.join();
+    ::close(socketFD);
+    socketFD = -1;
+}
+
+void MulticastPublisher::run() {
+    if (config.core >= 0) {
+        pinCurrentThread(config.core);
+    }
+    auto nextTick = std::chrono::steady_clock::now() + std::chrono::milliseconds(tickMilliseconds);
+    uint64_t repairBudget = repairRecordsPerTick;
+    uint64_t spins = 0;
+    char nack[multicastNackSize];
+    while (running.load(std::memory_order_relaxed)) {
+        sockaddr_in from{};
+        socklen_t fromLength = sizeof(from);
+        ssize_t received = recvfrom(socketFD, nack, sizeof(nack), config.busyPoll ? MSG_DONTWAIT : 0,
+                                    reinterpret_cast<sockaddr*>(&from), &fromLength);
+        if (received == static_cast<ssize_t>(multicastNackSize) && readUint64(nack) == multicastNackMagic) {
+            nacksReceived.fetch_add(1, std::memory_order_relaxed);
+
+            // Only what's already been sent to the group, anything later is on its way anyway.
+            uint32_t source = from.sin_addr.s_addr;
+            uint64_t first = readUint64(nack + 8);
+            uint64_t end = std::min(readUint64(nack + 16), publishedThrough);
+            auto repaired = repairedThisTick.find(source);
+            uint64_t sourceBudget = repairRecordsPerSourcePerTick -
+                                    (repaired == repairedThisTick.end() ? 0 : repaired->second);
+            bool allowed = allowedSubscribers.empty() ||
+                           std::find(allowedSubscribers.begin(), allowedSubscribers.end(), source) !=
+                           allowedSubscribers.end();
+            if (allowed && first < end && repairBudget > 0 && sourceBudget > 0) {
+                uint64_t count = std::min({end - first, maxRepairRecords, repairBudget, sourceBudget});
+                repairBudget -= count;
+                repairedThisTick[source] += count;
+                send(place.getDiff(first, count), from, true);
+            }
+        }
+
+        // Heartbeats still only go out on the tick.
+        bool tick = std::chrono::steady_clock::now() >= nextTick;
+        if (tick || (config.busyPoll && place.getRecordCount() > publishedThrough)) {
+            std::vector<Update> batch = place.getDiff(publishedThrough);
+            if (!batch.empty()) {
+                publishedThrough = batch.back().recordNumber + 1;
+            }
+            if (tick || !batch.empty()) {
+                send(batch, groupAddress, false);
+            }
+        } else if (config.busyPoll) {
+            // As in the sequencer, give up the core now and then in case it isn't ours alone.
+            if (++spins % 256 == 0) {
+                std::this_thread::yield();
+            } else {
+                cpuRelax();
+            }
+        }
+        if (tick) {
+            repairBudget = repairRecordsPerTick;
+            repairedThisTick.clear();
+            nextTick = std::chrono::steady_clock::now() + std::chrono::milliseconds(tickMilliseconds);
+        }
+    }
+}
+
+void MulticastPublisher::send(const std::vector<Update>& updates, const sockaddr_in& to, bool repair) {
+    // Read after the updates, the dimensions only grow, so these always cover them.
+    uint64_t width = place.width.load();
+    uint64_t height = place.height.load();
+    std::string datagram;
+    datagram.reserve(multicastHeaderSize + maxUpdatesPerDatagram * 6 * 8);
+    size_t first = 0;
+    do {
+        size_t count = std::min(maxUpdatesPerDatagram, updates.size() - first);
+        datagram.clear();
+        appendUint64(datagram, multicastBatchMagic);
+        appendUint64(datagram, width);
+        appendUint64(datagram, height);
+        appendUint64(datagram, count ? updates[first + count - 1].recordNumber + 1 : publishedThrough);
+        encodeUpdates(updates.data() + first, count, datagram);
+        if (sendto(socketFD, datagram.data(), datagram.size(), 0, reinterpret_cast<const sockaddr*>(&to),
+                   sizeof(to)) == static_cast<ssize_t>(datagram.size())) {
+            (repair ? repairBytesSent : bytesSent).fetch_add(datagram.size(), std::memory_order_relaxed);
+        }
+        first += count;
+    } while (first < updates.size());
+}
+
+// The edge side of `MulticastPublisher`. It starts from a Snapshot the edge already has (i.e., a `/snapshot` from the
+// core) and applies batches from the group in record order from there. Anything that arrives past a gap is held until
+// the gap is filled, and NACKs go out for the gap right away, `MulticastPublisher::maxRepairRecords` at a time and
+// `nacksInFlight` pieces ahead, then again every `nackRetryUs` while nothing arrives to fill it. Repairs come back on
+// a separate unicast socket, as the group socket is bound to the group address and shared by every subscriber on the
+// host.
+class MulticastSubscriber {
+  public:
+    MulticastSubscriber(Snapshot initial, const MulticastConfig& config = MulticastConfig());
+
+    // Stops the thread.
+    ~MulticastSubscriber();
+
+    // Joins the group. Returns false if either socket can't be set up.
+    bool start();
+    void stop();
+
+    // Everything up to the first record we haven't got. This only copies tile pointers.
+    Snapshot getState();
+    uint64_t getRecordNumber() const {return recordNumber.load(std::memory_order_acquire);}
+
+    // Bytes received from the group and as repairs (UDP payload only), and NACKs sent.
+    uint64_t getBytesReceived() const {return bytesReceived.load(std::memory_order_relaxed);}
+    uint64_t getNacksSent() const {return nacksSent.load(std::memory_order_relaxed);}
+
+    // Throws away this many of every thousand datagrams from the group, as if the network had, to exercise repair.
+    void setSimulatedLoss(uint32_t perThousand) {simulatedLoss.store(perThousand);}
+
+    static constexpr uint64_t nackRetryUs = 100'000;
+    static constexpr uint64_t nacksInFlight = 8;
+
+    // The most updates we'll hold on to past a gap. Beyond that, they're dropped and repaired along with the gap.
+    static constexpr size_t maxPending = 1 << 20;
+
+  private:
+    void run();
+    void receive(const char* data, size_t size);
+    void requestRepair();
+
+    const MulticastConfig config;
+    int groupFD = -1;
+    int repairFD = -1;
+    int epollFD = -1;
+
+    // Guarded by `stateMutex`, `recordNumber` is `state.recordNumber` for reading without it.
+    Snapshot state;
+    std::mutex stateMutex;
+    std::atomic<uint64_t> recordNumber;
+
+    // Only touched by `thread`: updates past a gap, how far any batch has said the stream has got, where the batches
+    // come from (and so where NACKs go), and the last NACKs: what we had then, how far they asked for, and when.
+    std::map<uint64_t, Pixel> pending;
+    uint64_t announced = 0;
+    std::optional<sockaddr_in> publisher;
+    uint64_t lastNackFrom = UINT64_MAX;
+    uint64_t requestedThrough = 0;
+    uint64_t lastNackUs = 0;
+    uint64_t random = 0x9E3779B97F4A7C15;
+
+    std::atomic<bool> running{false};
+    std::thread thread;
+    std::atomic<uint64_t> bytesReceived{0};
+    std::atomic<uint64_t> nacksSent{0};
+    std::atomic<uint32_t> simulatedLoss{0};
+};
+
+MulticastSubscriber::MulticastSubscriber(Snapshot initial, const MulticastConfig& config) :
+    config(config),
+    state(std::move(initial)),
+    recordNumber(state.recordNumber),
+    announced(state.recordNumber)
+{
+}
+
+MulticastSubscriber::~MulticastSubscriber() {
+    stop();
+}
+
+bool MulticastSubscriber::start() {
+    if (running.load()) {
+        return true;
+    }
+    sockaddr_in groupAddress{};
+    groupAddress.sin_family = AF_INET;
+    groupAddress.sin_port = htons(config.port);
+    ip_mreq membership{};
+    if (inet_pton(AF_INET, config.group.c_str(), &groupAddress.sin_addr) != 1 ||
+        inet_pton(AF_INET, config.interfaceAddress.c_str(), &membership.imr_interface) != 1) {
+        return false;
+    }
+    membership.imr_multiaddr = groupAddress.sin_addr;
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    int enable = 1;
+    groupFD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    repairFD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    epollFD = epoll_create1(0);
+    epoll_event groupEvent{};
+    groupEvent.events = EPOLLIN;
+    groupEvent.data.fd = groupFD;
+    epoll_event repairEvent{};
+    repairEvent.events = EPOLLIN;
+    repairEvent.data.fd = repairFD;
+
+    // Every subscriber on the host binds the same group and port, and each gets its own copy of every datagram.
+    if (groupFD < 0 || repairFD < 0 || epollFD < 0 ||
+        setsockopt(groupFD, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+        bind(groupFD, reinterpret_cast<sockaddr*>(&groupAddress), sizeof(groupAddress)) != 0 ||
+        setsockopt(groupFD, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0 ||
+        bind(repairFD, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0 ||
+        epoll_ctl(epollFD, EPOLL_CTL_ADD, groupFD, &groupEvent) != 0 ||
+        epoll_ctl(epollFD, EPOLL_CTL_ADD, repairFD, &repairEvent) != 0) {
+        ::close(groupFD);
+        ::close(repairFD);
+        ::close(epollFD);
+        groupFD = repairFD = epollFD = -1;
+        return false;
+    }
+    running.store(true);
+    thread = std::thread(&MulticastSubscriber::run, this);
+    return true;
+}
+
+void MulticastSubscriber::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    thread.join();
+    ::close(groupFD);
+    ::close(repairFD);
+    ::close(epollFD);
+    groupFD = repairFD = epollFD = -1;
+}
+
+Snapshot MulticastSubscriber::getState() {
+    std::lock_guard<std::mutex> lock(stateMutex);
+    return state;
+}
+
+void MulticastSubscriber::run() {
+    static constexpr int maxEvents = 2;
+    epoll_event events[maxEvents];
+    char datagram[65536];
+    while (running.load(std::memory_order_relaxed)) {
+        int count = epoll_wait(epollFD, events, maxEvents, 10);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            while (true) {
+                sockaddr_in from{};
+                socklen_t fromLength = sizeof(from);
+                ssize_t received = recvfrom(fd, datagram, sizeof(datagram), 0, reinterpret_cast<sockaddr*>(&from),
+                                            &fromLength);
+                if (received < 0) {
+                    break;
+                }
+                bytesReceived.fetch_add(received, std::memory_order_relaxed);
+                if (fd == groupFD) {
+                    random ^= random << 13;
+                    random ^= random >> 7;
+                    random ^= random << 17;
+                    if (random % 1000 < simulatedLoss.load(std::memory_order_relaxed)) {
+                        continue;
+                    }
+                    publisher = from;
+                }
+                receive(datagram, received);
+            }
+        }
+        requestRepair();
+    }
+}
+
+void MulticastSubscriber::receive(const char* data, size_t size) {
+    if (size < multicastHeaderSize || readUint64(data) != multicastBatchMagic) {
+        return;
+    }
+    uint64_t width = readUint64(data + 8);
+    uint64_t height = readUint64(data + 16);
+    uint64_t next = readUint64(data + 24);
+    uint64_t count = readUint64(data + 32);
+    if (count > (size - multicastHeaderSize) / 48 || size != multicastHeaderSize + count * 48) {
+        return;
+    }
+    announced = std::max(announced, next);
+
+    std::lock_guard<std::mutex> lock(stateMutex);
+    state.expand(width, height);
+    for (const char* u = data + multicastHeaderSize; u < data + size; u += 48) {
+        uint64_t number = readUint64(u);
+        Pixel p(readUint64(u + 16), readUint64(u + 24), readUint64(u + 32), readUint64(u + 40));
+        if (number == state.recordNumber) {
+            state.set(p);
+            state.recordNumber++;
+        } else if (number > state.recordNumber && pending.size() < maxPending) {
+            pending.emplace(number, p);
+        }
+    }
+
+    // Whatever was waiting on this.
+    while (!pending.empty() && pending.begin()->first <= state.recordNumber) {
+        if (pending.begin()->first == state.recordNumber) {
+            state.set(pending.begin()->second);
+            state.recordNumber++;
+        }
+        pending.erase(pending.begin());
+    }
+    recordNumber.store(state.recordNumber, std::memory_order_release);
+}
+
+void MulticastSubscriber::requestRepair() {
+    uint64_t have = recordNumber.load(std::memory_order_relaxed);
+    if (!publisher || have >= announced) {
+        return;
+    }
+
+    // Ask as soon as we see a gap, a piece at a time (that's all a NACK gets back) and a few pieces ahead. Each repair
+    // that arrives moves `have`, so the next piece is asked for right away. If the gap doesn't move for a while, we
+    // ask for all of it again.
+    uint64_t now = steadyMicroseconds();
+    bool retry = now - lastNackUs >= nackRetryUs;
+    if (have == lastNackFrom && !retry) {
+        return;
+    }
+    lastNackFrom = have;
+    uint64_t end = std::min(pending.empty() ? announced : pending.begin()->first,
+                            have + nacksInFlight * MulticastPublisher::maxRepairRecords);
+    uint64_t from = retry ? have : std::max(have, requestedThrough);
+    if (from >= end) {
+        return;
+    }
+    for (; from < end; from += MulticastPublisher::maxRepairRecords) {
+        std::string nack;
+        appendUint64(nack, multicastNackMagic);
+        appendUint64(nack, from);
+        appendUint64(nack, std::min(from + MulticastPublisher::maxRepairRecords, end));
+        nack.resize(multicastNackSize);
+        if (sendto(repairFD, nack.data(), nack.size(), 0, reinterpret_cast<const sockaddr*>(&*publisher),
+                   sizeof(*publisher)) == static_cast<ssize_t>(nack.size())) {
+            nacksSent.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    requestedThrough = end;
+    lastNackUs = now;
+}
+
+// Built in benchmarks, run with `rplace bench`.
+
+// Benchmarks add whatever they compute in here, so the compiler can't throw the work away.
+static std::atomic<uint64_t> benchmarkSink{0};
+
+// Mixed readers and writers against one lock, shaped like our use of `updateMutex`: readers hold it shared for a
+// short scan (applying a tail of updates), writers hold it exclusively to append. Returns operations per second.
+template <typename Mutex>
+static double benchmarkLock(size_t threadCount, int writesPerThousand, std::chrono::milliseconds duration) {
+    Mutex mutex;
+    std::vector<uint64_t> log(64, 1);
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> operations{0};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t] {
+            uint64_t random = t * 0x9E3779B97F4A7C15 + 1;
+            uint64_t count = 0;
+            uint64_t sink = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                if (static_cast<int>(random % 1000) < writesPerThousand) {
+                    std::unique_lock<Mutex> lock(mutex);
+                    log[random % log.size()] += 1;
+                } else {
+                    std::shared_lock<Mutex> lock(mutex);
+                    for (uint64_t value : log) {
+                        sink += value;
+                    }
+                }
+                count++;
+            }
+            operations.fetch_add(count);
+            benchmarkSink.fetch_add(sink, std::memory_order_relaxed);
+        });
+    }
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return operations.load() / (duration.count() / 1000.0);
+}
+
+// Writes checked against `RateLimiter` from every thread, spread over many users and addresses, with limits high enough
+// that everything is allowed (so we measure the check, not refusals). Returns checks per second.
+static double benchmarkRateLimiter(size_t threadCount, std::chrono::milliseconds duration) {
+    RateLimits limits;
+    limits.user = {1'000'000'000, 1'000'000'000};
+    limits.address = {1'000'000'000, 1'000'000'000};
+    limits.global = {1'000'000'000, 1'000'000'000};
+    RateLimiter limiter(limits);
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> operations{0};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t] {
+            uint64_t random = t * 0x9E3779B97F4A7C15 + 1;
+            uint64_t count = 0;
+            uint64_t sink = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                random ^= random << 13;
+                random ^= random >> 7;
+                random ^= random << 17;
+                sink += limiter.admit(random % 100'000, random % 10'000);
+                count++;
+            }
+            operations.fetch_add(count);
+            benchmarkSink.fetch_add(sink, std::memory_order_relaxed);
+        });
+    }
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return operations.load() / (duration.count() / 1000.0);
+}
+
+// End to end accept latency through the sequencer: from calling `submit` to the write having been applied (its `done`
+// being called), one write at a time with a gap between them, so the sequencer has run dry before each one, which is
+// the worst case for waking it up. Prints the median, 99th percentile and worst, in microseconds.
+static void benchmarkAcceptLatency(bool busyPoll, int core, size_t writes) {
+    Place place(1000, 1000);
+    AdmissionLimits limits;
+    limits.busyPoll = busyPoll;
+    limits.sequencerCore = core;
+    place.startSequencer(limits);
+    std::vector<double> latencies;
+    latencies.reserve(writes);
+    for (size_t i = 0; i < writes; i++) {
+        // A new user every time, so nothing is on cooldown.
+        std::atomic<int64_t> appliedNs{-1};
+        auto start = std::chrono::steady_clock::now();
+        place.submit(Pixel(i % 1000, i / 1000 % 1000, 1, i), [&appliedNs, start](bool) {
+            appliedNs.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count(), std::memory_order_release);
+        });
+        int64_t ns;
+        for (int spins = 1; (ns = appliedNs.load(std::memory_order_acquire)) < 0; spins++) {
+            if (spins % 256 == 0) {
+                std::this_thread::yield();
+            }
+        }
+        latencies.push_back(ns / 1000.0);
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    place.stopSequencer();
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "  " << (busyPoll ? "busy poll" : "parking") << (core >= 0 ? ", pinned to core " : "")
+              << (core >= 0 ? std::to_string(core) : "") << ": " << latencies[latencies.size() / 2] << "us median, "
+              << latencies[latencies.size() * 99 / 100] << "us p99, " << latencies.back() << "us worst" << std::endl;
+}
+
+// How long foreground tasks wait to start on an `Executor` that's also running `maintenanceJobs` long jobs of
+// millisecond steps, posted as `maintenancePriority`. Prints the median, 99th percentile and worst wait.
+static void benchmarkExecutor(size_t maintenanceJobs, Priority maintenancePriority,
+                              std::chrono::milliseconds duration) {
+    std::vector<uint64_t> waits;
+    std::mutex waitsMutex;
+    std::atomic<bool> stop{false};
+    {
+        ExecutorLimits limits;
+        limits.threads = 4;
+        Executor executor(limits);
+        for (size_t i = 0; i < maintenanceJobs; i++) {
+            executor.postChunked(maintenancePriority, [&stop] {
+                uint64_t until = steadyMicroseconds() + 1000;
+                uint64_t sink = 0;
+                while (steadyMicroseconds() < until) {
+                    sink++;
+                }
+                benchmarkSink.fetch_add(sink, std::memory_order_relaxed);
+                return !stop.load(std::memory_order_relaxed);
+            });
+        }
+        auto end = std::chrono::steady_clock::now() + duration;
+        while (std::chrono::steady_clock::now() < end) {
+            uint64_t posted = steadyMicroseconds();
+            executor.post(Priority::Foreground, [posted, &waits, &waitsMutex] {
+                uint64_t waited = steadyMicroseconds() - posted;
+                std::lock_guard<std::mutex> lock(waitsMutex);
+                waits.push_back(waited);
+            });
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        stop.store(true);
+    }
+    std::sort(waits.begin(), waits.end());
+    std::cout << "  " << maintenanceJobs << " maintenance jobs as "
+              << (maintenancePriority == Priority::Background ? "Background" : "Foreground") << ": "
+              << waits[waits.size() / 2] << "us median, " << waits[waits.size() * 99 / 100] << "us p99, "
+              << waits.back() << "us worst" << std::endl;
+}
+
+// A Place written to as fast as `stamp` allows, published to `edges` subscribers on loopback multicast, each losing
+// `lossPerThousand` of the datagrams. Prints what the core sent against what unicast to every edge would have cost,
+// and whether every edge ended up with the same canvas as the core.
+static void benchmarkMulticast(size_t edges, uint32_t lossPerThousand, std::chrono::milliseconds duration) {
+    MulticastConfig config;
+    config.interfaceAddress = "127.0.0.1";
+    config.port = 42420;
+    Place place(256, 256);
+    MulticastPublisher publisher(place, config);
+    std::vector<std::unique_ptr<MulticastSubscriber>> subscribers;
+    for (size_t i = 0; i < edges; i++) {
+        subscribers.push_back(std::make_unique<MulticastSubscriber>(place.getCurrentState(), config));
+        subscribers.back()->setSimulatedLoss(lossPerThousand);
+        if (!subscribers.back()->start()) {
+            std::cout << "  skipped, couldn't join " << config.group << " on " << config.interfaceAddress << std::endl;
+            return;
+        }
+    }
+    if (!publisher.start()) {
+        std::cout << "  skipped, couldn't publish to " << config.group << std::endl;
+        return;
+    }
+
+    // A stamp of 64 pixels every millisecond or so, about what a busy event sees.
+    auto end = std::chrono::steady_clock::now() + duration;
+    uint64_t random = 1;
+    while (std::chrono::steady_clock::now() < end) {
+        std::vector<Pixel> pixels;
+        for (int i = 0; i < 64; i++) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            pixels.emplace_back(random % 256, (random >> 8) % 256, (random >> 16) % 16, (random >> 24) % 1000);
+        }
+        place.stamp(pixels);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Give the last batch, and its repairs, time to get there.
+    uint64_t records = place.getRecordCount();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    size_t caughtUp = 0;
+    while (caughtUp < edges && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        caughtUp = 0;
+        for (auto& subscriber : subscribers) {
+            caughtUp += subscriber->getRecordNumber() >= records;
+        }
+    }
+    publisher.stop();
+
+    Snapshot core = place.getCurrentState();
+    size_t matching = 0;
+    uint64_t received = 0;
+    for (auto& subscriber : subscribers) {
+        subscriber->stop();
+        Snapshot edge = subscriber->getState();
+        bool same = edge.recordNumber == core.recordNumber;
+        for (uint64_t y = 0; y < core.height && same; y++) {
+            for (uint64_t x = 0; x < core.width && same; x++) {
+                same = edge.getPixel(x, y).getColor() == core.getPixel(x, y).getColor() &&
+                       edge.getPixel(x, y).getUserID() == core.getPixel(x, y).getUserID();
+            }
+        }
+        matching += same;
+        received += subscriber->getBytesReceived();
+    }
+    uint64_t sent = publisher.getBytesSent() + publisher.getRepairBytesSent();
+    std::cout << "  " << edges << " edges, " << lossPerThousand / 10.0 << "% loss: " << records << " updates, "
+              << "core sent " << publisher.getBytesSent() << " bytes + " << publisher.getRepairBytesSent()
+              << " repair bytes for " << publisher.getNacksReceived() << " NACKs, "
+              << 100 * sent / std::max<uint64_t>(received, 1) << "% of what the edges received, " << matching << "/"
+              << edges << " edges match the core" << std::endl;
+}
+
+// Heap allocations per request through a real `FrontEnd` on loopback, for regions, leaderboards and diffs of growing
+// size. The temporaries come from the loop's `RequestArena`, so this should stay flat as the responses grow. Each
+// kind is requested a few times first so the arena has grown to fit, and only the requests after that are counted.
+// Diffs are asked for with one new update in between, so every one rebases its `DiffCache` entry rather than just
+// returning it.
+static void benchmarkRequestAllocations(uint16_t port) {
+#ifndef RPLACE_COUNT_ALLOCATIONS
+    std::cout << "  skipped, build with -DRPLACE_COUNT_ALLOCATIONS" << std::endl;
+    (void)port;
+    return;
+#endif
+    Place place(1024, 1024);
+    uint64_t random = 1;
+    for (int i = 0; i < 1024; i++) {
+        std::vector<Pixel> pixels;
+        for (int j = 0; j < 64; j++) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            pixels.emplace_back(random % 1024, (random >> 10) % 1024, (random >> 20) % 16, (random >> 24) % 1000);
+        }
+        place.stamp(pixels);
+    }
+    FrontEnd frontEnd(place, port, 1);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (!frontEnd.start() || connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cout << "  skipped, couldn't serve on port " << port << std::endl;
+        ::close(fd);
+        return;
+    }
+
+    // Sends a GET and reads the whole response, returning the size of the body.
+    std::string response;
+    auto get = [&](const std::string& target) -> size_t {
+        std::string request = "GET " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+            return 0;
+        }
+        response.clear();
+        size_t headerEnd = std::string::npos;
+        size_t bodyLength = 0;
+        char buffer[65536];
+        while (headerEnd == std::string::npos || response.size() < headerEnd + 4 + bodyLength) {
+            ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                return 0;
+            }
+            response.append(buffer, received);
+            if (headerEnd == std::string::npos && (headerEnd = response.find("\r\n\r\n")) != std::string::npos) {
+                size_t length = response.find("Content-Length: ");
+                bodyLength = length < headerEnd ? std::strtoull(response.c_str() + length + 16, nullptr, 10) : 0;
+            }
+        }
+        return bodyLength;
+    };
+
+    static constexpr int warmup = 4;
+    static constexpr int counted = 64;
+    uint64_t user = 1'000'000;
+    auto measure = [&](const std::string& label, const std::string& target, bool rebase) {
+        size_t bytes = 0;
+        uint64_t requests = 0;
+        uint64_t allocations = 0;
+        for (int i = 0; i < warmup + counted; i++) {
+            if (rebase) {
+                place.update(Pixel(0, 0, i % 16, user++));
+            }
+            if (i == warmup) {
+                requests = frontEnd.getRequestCount();
+                allocations = frontEnd.getRequestAllocations();
+            }
+            bytes = get(target);
+        }
+        requests = frontEnd.getRequestCount() - requests;
+        allocations = frontEnd.getRequestAllocations() - allocations;
+        std::cout << "  " << label << ": " << bytes << " byte responses, "
+                  << static_cast<double>(allocations) / std::max<uint64_t>(requests, 1) << " allocations per request"
+                  << std::endl;
+    };
+    for (uint64_t side : {16, 128, 512, 1024}) {
+        measure("region " + std::to_string(side) + "x" + std::to_string(side),
+                "/region?x=0&y=0&w=" + std::to_string(side) + "&h=" + std::to_string(side), false);
+    }
+    for (uint64_t k : {10, 1000}) {
+        measure("leaderboard of " + std::to_string(k), "/leaderboard?k=" + std::to_string(k), false);
+    }
+    for (uint64_t since : {64, 4096, 65536}) {
+        measure("diff of the last " + std::to_string(since) + " updates",
+                "/diff?from=" + std::to_string(place.getRecordCount() - since), true);
+    }
+    ::close(fd);
+    frontEnd.stop();
+}
+
+static void runBenchmarks() {
+    size_t cores = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+    std::vector<size_t> threadCounts{1, cores / 2, cores, cores * 2};
+    std::sort(threadCounts.begin(), threadCounts.end());
+    threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+    threadCounts.erase(std::remove(threadCounts.begin(), threadCounts.end(), 0), threadCounts.end());
+
+    std::cout << "updateMutex, mixed workload (operations per second):" << std::endl;
+    for (int writesPerThousand : {1, 10, 100}) {
+        for (size_t threadCount : threadCounts) {
+            double standard = benchmarkLock<std::shared_mutex>(threadCount, writesPerThousand,
+                                                               std::chrono::milliseconds(500));
+            double scalable = benchmarkLock<ScalableSharedMutex>(threadCount, writesPerThousand,
+                                                                 std::chrono::milliseconds(500));
+            std::cout << "  " << threadCount << " threads, " << writesPerThousand / 10.0 << "% writes: "
+                      << "std::shared_mutex " << static_cast<uint64_t>(standard) << ", "
+                      << "ScalableSharedMutex " << static_cast<uint64_t>(scalable) << std::endl;
+        }
+    }
+
+    std::cout << "RateLimiter::admit, all three tiers:" << std::endl;
+    for (size_t threadCount : threadCounts) {
+        double checks = benchmarkRateLimiter(threadCount, std::chrono::milliseconds(500));
+        std::cout << "  " << threadCount << " threads: " << static_cast<uint64_t>(checks) << " per second, "
+                  << static_cast<uint64_t>(1e9 * threadCount / checks) << "ns each" << std::endl;
+    }
+
+    // The sequencer gets the last core, the benchmark thread polls for the result from whichever is left. With one
+    // core they fight over it, and busy polling only makes that worse.
+    std::cout << "Sequencer accept latency, submit to applied:" << std::endl;
+    int lastCore = cores > 1 ? static_cast<int>(cores - 1) : -1;
+    benchmarkAcceptLatency(false, -1, 2000);
+    benchmarkAcceptLatency(true, -1, 2000);
+    benchmarkAcceptLatency(true, lastCore, 2000);
+
+    std::cout << "Executor, foreground wait to start:" << std::endl;
+    benchmarkExecutor(0, Priority::Background, std::chrono::milliseconds(500));
+    benchmarkExecutor(16, Priority::Background, std::chrono::milliseconds(500));
+    benchmarkExecutor(16, Priority::Foreground, std::chrono::milliseconds(500));
+
+    std::cout << "Multicast fan-out on loopback:" << std::endl;
+    for (auto [edges, lossPerThousand] : {std::pair<size_t, uint32_t>{4, 0}, {16, 0}, {16, 20}, {16, 100}}) {
+        benchmarkMulticast(edges, lossPerThousand, std::chrono::milliseconds(1000));
+    }
+
+    std::cout << "Front end heap allocations per request:" << std::endl;
+    benchmarkRequestAllocations(42421);
+}
+
+// Quick behaviour checks, run after the smoke test in `main`, for the pieces that are easy to get subtly wrong. Each
+// prints OK or Failed!, and none take more than a moment. Anything that needs something this machine might not have
+// (i.e., multicast on loopback) says so and is skipped.
+static void reportCheck(const std::string& name, bool ok) {
+    std::cout << "  " << name << ": " << (ok ? "OK" : "Failed!") << std::endl;
+}
+
+// A file (or shared memory) name for checks to use, one per process so that runs don't trip over each other.
+static std::string checkScratchName() {
+    return "rplace-checks." + std::to_string(getpid());
+}
+
+// A reader in another process (well, this one) sees what the Place published, and a whole snapshot of it.
+static void checkSharedExport() {
+    std::string name = "/" + checkScratchName();
+    Place place(64, 64);
+    bool ok = place.exportSharedMemory(name);
+    // Snapshots are only replaced (and so published) every hundred or so records.
+    std::vector<Pixel> pixels;
+    for (uint64_t i = 0; i < 200; i++) {
+        pixels.emplace_back(i % 64, 10 + i / 64, 7, 8);
+    }
+    pixels.emplace_back(1, 2, 3, 4);
+    pixels.emplace_back(63, 63, 5, 6);
+    place.stamp(pixels);
+    place.getCurrentState();
+    SharedSnapshotReader reader;
+    ok = ok && reader.open(name) && reader.getWidth() == 64 && reader.getHeight() == 64;
+    if (ok) {
+        SharedSnapshotReader::Frame frame;
+        bool same;
+        do {
+            frame = reader.acquire();
+            same = frame.recordNumber == place.getRecordCount() && frame.pixels[2 * 64 + 1].color == 3 &&
+                   frame.pixels[2 * 64 + 1].userID == 4 && frame.pixels[63 * 64 + 63].color == 5;
+        } while (!reader.validate(frame));
+        ok = same;
+    }
+    reportCheck("shared memory export", ok);
+}
+
+// Regions read back what single pixel reads do, and empty ones are empty, wherever they are.
+static void checkRegionReads() {
+    Place place(100, 100);
+    place.stamp({Pixel(0, 0, 1, 2), Pixel(63, 64, 3, 4), Pixel(64, 64, 5, 6), Pixel(99, 99, 7, 8)});
+    std::vector<PixelInfo> region;
+    bool ok = place.getRegion(0, 0, 100, 100, region) && region.size() == 100 * 100;
+    for (uint64_t i = 0; i < region.size() && ok; i++) {
+        PixelInfo info;
+        ok = place.getPixel(i % 100, i / 100, info) && info.color == region[i].color &&
+             info.userID == region[i].userID && info.placed == region[i].placed &&
+             info.recordNumber == region[i].recordNumber;
+    }
+    const uint64_t empty[][4] = {{0, 0, 0, 1}, {0, 0, 1, 0}, {0, 0, 0, 0}, {99, 99, 0, 1}, {50, 0, 50, 0}};
+    for (const uint64_t* e : empty) {
+        ok = ok && place.getRegion(e[0], e[1], e[2], e[3], region) && region.empty();
+    }
+    ok = ok && !place.getRegion(100, 0, 0, 1, region) && !place.getRegion(0, 0, 101, 1, region);
+    reportCheck("region reads, including empty ones", ok);
+}
+
+// Every submission pushed by several producers comes out exactly once.
+static void checkIngestionQueue() {
+    IngestionQueue queue(256);
+    static constexpr uint64_t producers = 4;
+    static constexpr uint64_t each = 20000;
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < producers; t++) {
+        threads.emplace_back([&queue, t] {
+            for (uint64_t i = 0; i < each; i++) {
+                while (!queue.push({Pixel(0, 0, 0, t * each + i), 0, nullptr})) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    std::vector<bool> seen(producers * each, false);
+    bool ok = true;
+    Submission submission{Pixel(0, 0, 0, 0), 0, nullptr};
+    // Keep popping even once something's wrong, or the producers would never finish.
+    for (uint64_t popped = 0; popped < producers * each; ) {
+        if (queue.pop(submission)) {
+            uint64_t id = submission.pixel.getUserID();
+            if (id < seen.size() && !seen[id]) {
+                seen[id] = true;
+            } else {
+                ok = false;
+            }
+            popped++;
+        }
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    reportCheck("ingestion queue", ok && queue.depth() == 0);
+}
+
+// Nothing is accepted without a sequencer. Pixels that can't be written are accepted but refused on the spot, and
+// everything else gets its result once it's sequenced.
+static void checkSubmit() {
+    Place place(16, 16);
+    bool ok = !place.submit(Pixel(0, 0, 1, 1)).accepted;
+    place.startSequencer();
+    std::atomic<int> outside{-1};
+    std::atomic<int> inside{-1};
+    ok = ok && place.submit(Pixel(16, 0, 1, 1), [&outside](bool result) {outside = result;}).accepted &&
+         outside == 0;
+    ok = ok && place.submit(Pixel(1, 1, 1, 1), [&inside](bool result) {inside = result;}).accepted;
+    place.stopSequencer();
+    PixelInfo info;
+    reportCheck("submit", ok && inside == 1 && place.getPixel(1, 1, info) && info.placed);
+}
+
+// A stamp with any pixel out of bounds applies nothing. Then stamps alternate between two colors over a rectangle
+// that spans several tiles, and a region read must never see a mix.
+static void checkAtomicStamps() {
+    Place place(256, 256);
+    PixelInfo info;
+    bool refused = !place.stamp({Pixel(0, 0, 1, 1), Pixel(256, 0, 1, 1)}) && place.getRecordCount() == 0 &&
+                   place.getPixel(0, 0, info) && !info.placed;
+    std::atomic<bool> stop{false};
+    std::thread writer([&place, &stop] {
+        for (uint64_t color = 1; !stop.load(std::memory_order_relaxed); color = 3 - color) {
+            std::vector<Pixel> pixels;
+            for (uint64_t y = 60; y < 140; y++) {
+                for (uint64_t x = 60; x < 140; x++) {
+                    pixels.emplace_back(x, y, color, 1);
+                }
+            }
+            place.stamp(pixels);
+        }
+    });
+    bool ok = true;
+    std::vector<PixelInfo> region;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    while (ok && std::chrono::steady_clock::now() < end) {
+        ok = place.getRegion(60, 60, 80, 80, region);
+        for (const PixelInfo& info : region) {
+            ok = ok && info.color == region[0].color;
+        }
+    }
+    stop = true;
+    writer.join();
+    reportCheck("stamps are atomic to region reads", refused && ok);
+}
+
+// Expanding keeps what's there, the new area starts out blank and takes writes, a region read across the old edge
+// sees both, and a Place never shrinks.
+static void checkExpand() {
+    Place place(100, 100);
+    place.stamp({Pixel(99, 99, 3, 4)});
+    std::vector<PixelInfo> region;
+    PixelInfo info;
+    bool ok = place.expand(300, 200) && place.getEpoch() == 1 && place.getEpochs().size() == 2 &&
+              place.getPixel(99, 99, info) && info.color == 3 && place.getPixel(250, 150, info) && !info.placed &&
+              place.stamp({Pixel(250, 150, 5, 6)}) && place.getRegion(99, 99, 152, 52, region) &&
+              region[0].color == 3 && region.back().color == 5 && region.back().placed && !region[1].placed &&
+              !place.expand(299, 200) && !place.expand(300, 199) && place.getEpoch() == 1;
+    reportCheck("expand", ok);
+}
+
+// Whether two Places agree about a pixel, for checks that build the same canvas two ways.
+static bool samePixelAt(Place& a, Place& b, uint64_t x, uint64_t y) {
+    PixelInfo p, q;
+    return a.getPixel(x, y, p) && b.getPixel(x, y, q) && p.color == q.color && p.userID == q.userID &&
+           p.placed == q.placed;
+}
+
+// A checkpoint loads back the same, and nothing short of a whole one loads at all, including one with canvas epochs
+// that `expand` couldn't have made. The registry doesn't keep a canvas whose checkpoint won't load.
+static void checkCheckpoints() {
+    std::string scratch = "/tmp/" + checkScratchName();
+    Place place(64, 64);
+    place.stamp({Pixel(1, 2, 3, 4), Pixel(5, 6, 7, 8), Pixel(1, 2, 9, 10)});
+    bool ok = place.save(scratch);
+    Place loaded(64, 64);
+    ok = ok && loaded.load(scratch) && loaded.getRecordCount() == place.getRecordCount() &&
+         samePixelAt(place, loaded, 1, 2) && samePixelAt(place, loaded, 5, 6) && samePixelAt(place, loaded, 0, 0);
+    std::ifstream in(scratch, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    for (size_t length = 0; ok && length < bytes.size(); length += 8) {
+        std::ofstream(scratch, std::ios::binary | std::ios::trunc).write(bytes.data(), length);
+        Place truncated(64, 64);
+        ok = !truncated.load(scratch);
+    }
+    std::ofstream(scratch, std::ios::binary | std::ios::trunc) << std::string(bytes.size(), '\xff');
+    Place corrupt(64, 64);
+    ok = ok && !corrupt.load(scratch);
+    reportCheck("checkpoint round trip, truncated and corrupt files", ok);
+
+    // Old style (no palettes) checkpoints with the given canvas epochs, each {epoch, recordNumber, width, height}, and
+    // a single update at (0, 0).
+    auto loads = [&scratch](const std::vector<CanvasEpoch>& epochs) {
+        std::vector<uint64_t> words{checkpointMagicV1, epochs.size()};
+        for (const CanvasEpoch& epoch : epochs) {
+            words.insert(words.end(), {epoch.epoch, epoch.recordNumber, epoch.width, epoch.height});
+        }
+        words.insert(words.end(), {1, 0, 1, 0, 0, 3, 4});
+        std::ofstream(scratch, std::ios::binary | std::ios::trunc).write(reinterpret_cast<const char*>(words.data()),
+                                                                         words.size() * sizeof(uint64_t));
+        Place target(64, 64);
+        return target.load(scratch) && target.getEpochs().back().width == epochs.back().width;
+    };
+    ok = loads({{0, 0, 64, 64}, {1, 1, 128, 64}}) && !loads({{1, 0, 64, 64}}) && !loads({{0, 1, 64, 64}}) &&
+         !loads({{0, 0, 64, 64}, {2, 1, 128, 64}}) && !loads({{0, 0, 64, 64}, {1, 1, 32, 64}}) &&
+         !loads({{0, 1, 64, 64}, {1, 0, 128, 64}}) && !loads({{0, 0, 1ull << 40, 1ull << 40}}) &&
+         !loads({{0, 0, 64, 64}, {1, 1, 64, Place::maxDimension + 1}});
+    std::remove(scratch.c_str());
+    reportCheck("checkpoints with bad canvas epochs are refused", ok);
+
+    std::string directory = scratch + ".d";
+    ok = mkdir(directory.c_str(), 0700) == 0;
+    std::ofstream(directory + "/bad.place", std::ios::binary) << std::string(64, '\xff');
+    {
+        CanvasRegistry registry(directory);
+        ok = ok && !registry.get("bad") && !registry.get("bad") && registry.knownCount() == 0;
+    }
+    std::remove((directory + "/bad.place").c_str());
+    rmdir(directory.c_str());
+    reportCheck("a canvas whose checkpoint won't load isn't kept", ok);
+}
+
+// Starts `frontEnd` and connects to it on loopback, for checks that talk to it. Returns -1 (having said so) if either
+// fails, i.e., the port is taken.
+static int connectForCheck(FrontEnd& frontEnd, uint16_t port, const std::string& name) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || !frontEnd.start() || connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cout << "  " << name << ": skipped, couldn't serve on port " << port << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Sends `request` as is and reads a single response to it (headers and body). Returns whatever arrived before the
+// connection was closed, if it was.
+static std::string exchangeForCheck(int fd, const std::string& request) {
+    std::string response;
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+        return response;
+    }
+    size_t headerEnd = std::string::npos;
+    size_t bodyLength = 0;
+    char buffer[4096];
+    while (headerEnd == std::string::npos || response.size() < headerEnd + 4 + bodyLength) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            break;
+        }
+        response.append(buffer, received);
+        if (headerEnd == std::string::npos && (headerEnd = response.find("\r\n\r\n")) != std::string::npos) {
+            size_t length = response.find("Content-Length: ");
+            bodyLength = length < headerEnd ? std::strtoull(response.c_str() + length + 16, nullptr, 10) : 0;
+        }
+    }
+    return response;
+}
+
+// An empty or oversized region is a bad request, and the server carries on serving afterwards.
+static void checkRegionEndpoint() {
+    Place place(64, 64);
+    place.update(Pixel(1, 1, 3, 4));
+    FrontEnd frontEnd(place, 42423, 1);
+    int fd = connectForCheck(frontEnd, 42423, "region endpoint");
+    if (fd < 0) {
+        return;
+    }
+    auto status = [fd](const std::string& query) {
+        return exchangeForCheck(fd, "GET /region?" + query + " HTTP/1.1\r\nHost: localhost\r\n\r\n").substr(0, 12);
+    };
+    bool ok = status("x=0&y=0&w=0&h=1") == "HTTP/1.1 400" && status("x=0&y=0&w=1&h=0") == "HTTP/1.1 400" &&
+              status("x=0&y=0&w=0&h=0") == "HTTP/1.1 400" && status("x=0&y=0&w=4194304&h=2") == "HTTP/1.1 400" &&
+              status("x=0&y=0&w=2&h=2") == "HTTP/1.1 200";
+    ::close(fd);
+    frontEnd.stop();
+    reportCheck("region endpoint", ok);
+}
+
+// A WebSocket client that sends an unmasked frame, or one far too big to be anything we'd accept, is hung up on rather
+// than buffered, and other connections carry on.
+static void checkWebSocketFrames() {
+    Place place(64, 64);
+    FrontEnd frontEnd(place, 42424, 1);
+    int fd = connectForCheck(frontEnd, 42424, "oversized and unmasked WebSocket frames");
+    if (fd < 0) {
+        return;
+    }
+    ::close(fd);
+
+    // That connection only told us the server is up. Each frame below gets a connection of its own.
+
+    // Upgrades a new connection, sends `frame`, and waits for the server to close it.
+    auto hungUpOn = [](const std::string& frame) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(42424);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        timeval timeout{5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        bool ok = connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0 &&
+                  exchangeForCheck(fd, "GET /stream HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                                       "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                       "\r\n").substr(0, 12) == "HTTP/1.1 101" &&
+                  send(fd, frame.data(), frame.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(frame.size());
+        char buffer[4096];
+        ssize_t received = 0;
+        while (ok && (received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        }
+        ok = ok && received == 0;
+        ::close(fd);
+        return ok;
+    };
+
+    // A binary frame claiming 2^40 bytes, and then a bit of it.
+    std::string oversized("\x82\xff\x00\x00\x01\x00\x00\x00\x00\x00" "abcd", 14);
+    oversized += std::string(1024, 'x');
+    std::string unmasked("\x89\x02hi", 4);
+    std::string tooLong("\x82\xff\x00\x00\x00\x00\x00\x01\x00\x01" "abcd", 14);
+    tooLong += std::string(1024, 'x');
+    bool ok = hungUpOn(oversized) && hungUpOn(unmasked) && hungUpOn(tooLong);
+    frontEnd.stop();
+    reportCheck("oversized and unmasked WebSocket frames", ok);
+}
+
+// A WebSocket subscriber that stops reading is hung up on once it's too far behind, rather than having every batch
+// buffered for it.
+static void checkSlowSubscriber() {
+    Place place(1024, 1024);
+    FrontEnd frontEnd(place, 42425, 1);
+    int fd = connectForCheck(frontEnd, 42425, "slow WebSocket subscribers");
+    if (fd < 0) {
+        return;
+    }
+    int small = 4096;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    bool ok = exchangeForCheck(fd, "GET /stream HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                                   "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                   "\r\n").substr(0, 12) == "HTTP/1.1 101";
+
+    // Batches of 6MB or so, a tick apart, that nobody reads.
+    for (uint64_t i = 0; ok && i < 8; i++) {
+        std::vector<Pixel> pixels;
+        for (uint64_t j = 0; j < (1 << 17); j++) {
+            pixels.emplace_back(j % 1024, (i * 128) + j / 1024, 1 + i % 16, 1);
+        }
+        ok = place.stamp(pixels);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2 * FrontEnd::tickMilliseconds));
+    }
+
+    // Whatever made it into the socket before the hang up, and then the reset.
+    char buffer[65536];
+    ssize_t received = 0;
+    size_t total = 0;
+    while (ok && (received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        total += received;
+    }
+    ok = ok && received < 0 && errno == ECONNRESET && total < 8 * encodedUpdatesSize(1 << 17);
+    ::close(fd);
+    frontEnd.stop();
+    reportCheck("slow WebSocket subscribers", ok);
+}
+
+// A cached diff, rebased as the Place moves on, matches coalescing the log from its (rounded down) base.
+static void checkDiffCache() {
+    Place place(64, 64);
+    DiffCache cache(place, 2);
+    uint64_t random = 7;
+    auto next = [&random] {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        return random;
+    };
+    bool ok = true;
+    for (int round = 0; round < 100 && ok; round++) {
+        std::vector<Pixel> pixels;
+        uint64_t spread = round % 3 ? 64 : 4;
+        uint64_t count = next() % 50 + 1;
+        for (uint64_t i = 0; i < count; i++) {
+            pixels.emplace_back(next() % spread, next() % spread, next() % 16, next() % 100);
+        }
+        place.stamp(pixels);
+        uint64_t from = next() % (place.getRecordCount() + 1);
+        std::vector<Update> all = place.getDiff(from - from % DiffCache::baseGranularity);
+        std::map<std::pair<uint64_t, uint64_t>, size_t> last;
+        for (size_t i = 0; i < all.size(); i++) {
+            last[{all[i].pixel.getX(), all[i].pixel.getY()}] = i;
+        }
+        std::vector<size_t> kept;
+        for (const auto& [pixel, i] : last) {
+            kept.push_back(i);
+        }
+        std::sort(kept.begin(), kept.end());
+        std::string expected;
+        appendUint64(expected, kept.size());
+        for (size_t i : kept) {
+            appendUpdate(expected, all[i].recordNumber, all[i].timestamp, all[i].pixel);
+        }
+        ok = *cache.get(from) == expected;
+    }
+    reportCheck("diff cache rebases", ok);
+}
+
+// Snapshots that were handed out don't change when the Place does.
+static void checkSnapshots() {
+    Place place(128, 128);
+    place.update(Pixel(70, 70, 3, 1));
+    Snapshot before = place.getCurrentState();
+    place.stamp({Pixel(70, 70, 4, 2), Pixel(1, 1, 5, 2)});
+    Snapshot after = place.getCurrentState();
+    bool ok = before.getPixel(70, 70).getColor() == 3 && before.getPixel(1, 1).getColor() == Pixel::defaultColor &&
+              after.getPixel(70, 70).getColor() == 4 && after.getPixel(1, 1).getColor() == 5;
+    reportCheck("copy on write snapshots", ok);
+}
+
+// Readers never see a writer's critical section half done, including readers that hold the lock a long time.
+static void checkReaderWriterLock() {
+    ScalableSharedMutex mutex;
+    uint64_t a = 0;
+    uint64_t b = 0;
+    std::atomic<bool> torn{false};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 6; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 5000; i++) {
+                if (t % 3 == 0) {
+                    std::unique_lock<ScalableSharedMutex> lock(mutex);
+                    a++;
+                    b++;
+                } else {
+                    std::shared_lock<ScalableSharedMutex> lock(mutex);
+                    if (a != b) {
+                        torn = true;
+                    }
+                    if (i % 2500 == 0) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    reportCheck("reader writer lock", !torn && a == 10000);
+}
+
+// A newer held write replaces the older one, which is refused right away, and held writes are refused when the
+// sequencer stops.
+static void checkHeldWrites() {
+    Place place(16, 16);
+    AdmissionLimits limits;
+    limits.deferCooldownWrites = true;
+    place.startSequencer(limits);
+    place.update(Pixel(0, 0, 1, 5));
+    std::atomic<int> first{-1};
+    std::atomic<int> second{-1};
+    bool ok = place.submit(Pixel(1, 1, 2, 5), [&first](bool result) {first = result;}).accepted &&
+              place.submit(Pixel(2, 2, 3, 5), [&second](bool result) {second = result;}).accepted;
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (first == -1 && std::chrono::steady_clock::now() < end) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ok = ok && first == 0 && second == -1;
+    place.stopSequencer();
+    PixelInfo info;
+    ok = ok && second == 0 && place.getPixel(1, 1, info) && !info.placed && place.getPixel(2, 2, info) &&
+         !info.placed;
+    reportCheck("held writes are replaced, and dropped on stop", ok);
+}
+
+// Timers fire once, when they're due and not before, however far out they were.
+static void checkTimerWheel() {
+    TimerWheel wheel(1000, 16);
+    std::vector<uint64_t> fired;
+    auto expired = [&fired](uint64_t key) {fired.push_back(key);};
+    wheel.advance(1'000'000, expired);
+    wheel.schedule(1, 1'002'500);
+    wheel.schedule(2, 1'050'000);
+    wheel.schedule(3, 999'000);
+    wheel.advance(1'002'000, expired);
+    bool ok = fired == std::vector<uint64_t>{3};
+    wheel.advance(1'003'000, expired);
+    ok = ok && fired == std::vector<uint64_t>{3, 1};
+    wheel.advance(1'049'999, expired);
+    ok = ok && fired.size() == 2;
+    wheel.advance(1'100'000, expired);
+    reportCheck("timer wheel", ok && fired == std::vector<uint64_t>({3, 1, 2}) && wheel.empty());
+}
+
+// A user gets their burst and then has to wait, without using up anybody else's.
+static void checkRateLimiter() {
+    RateLimits limits;
+    limits.user = {1, 10};
+    limits.address = {0, 0};
+    RateLimiter limiter(limits);
+    bool ok = true;
+    for (int i = 0; i < 10; i++) {
+        ok = ok && limiter.admit(1, 1) == 0;
+    }
+    reportCheck("rate limiter", ok && limiter.admit(1, 1) > 0 && limiter.admit(2, 1) == 0);
+}
+
+// A revert brings back colors and owners, and pixels that were blank go back to being unplaced and unowned.
+static void checkRevert() {
+    Place place(64, 64);
+    place.stamp({Pixel(1, 1, 3, 7)});
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    uint64_t before = wallMicroseconds();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    place.stamp({Pixel(1, 1, 4, 8), Pixel(2, 2, 5, 9), Pixel(3, 3, Pixel::defaultColor, 9)});
+    size_t reverted = 0;
+    PixelInfo a, b, c;
+    bool ok = place.revert(0, 0, 8, 8, before, reverted) && reverted == 3 && place.getPixel(1, 1, a) &&
+              place.getPixel(2, 2, b) && place.getPixel(3, 3, c) && a.color == 3 && a.userID == 7 && a.placed &&
+              !b.placed && !c.placed && place.getOwnedPixels(7) == 1 && place.getOwnedPixels(8) == 0 &&
+              place.getOwnedPixels(9) == 0 && place.getOwnedPixels(0) == 0;
+    reportCheck("revert, including blank pixels", ok);
+}
+
+// Colors outside a palette are refused by every kind of write, palettes survive a checkpoint, and a checkpoint with
+// palette epochs `setPalette` couldn't have made doesn't load.
+static void checkPalettes() {
+    std::string scratch = "/tmp/" + checkScratchName();
+    Place place(16, 16);
+    bool ok = place.setPalette({0x000000, 0xffffff}, {}) && !place.update(Pixel(0, 0, 2, 1)) &&
+              !place.stamp({Pixel(0, 0, 2, 1)}) && place.stamp({Pixel(0, 0, 1, 1)});
+    reportCheck("palette checks", ok);
+
+    place.setPalette({0x000000, 0x808080, 0xffffff}, {0, 2});
+    Place loaded(16, 16);
+    PixelInfo info;
+    ok = place.save(scratch) && loaded.load(scratch) && loaded.getPaletteEpochs().size() == 3 &&
+         loaded.getPixel(0, 0, info) && info.color == 2;
+
+    // Checkpoints with the given palette epochs, a single canvas epoch, and a single update at (0, 0) in color 1.
+    auto loads = [&scratch](const std::vector<PaletteEpoch>& palettes) {
+        std::vector<uint64_t> words{checkpointMagic, 1, 0, 0, 16, 16, palettes.size()};
+        for (const PaletteEpoch& palette : palettes) {
+            words.insert(words.end(), {palette.epoch, palette.recordNumber, palette.colors.size()});
+            words.insert(words.end(), palette.colors.begin(), palette.colors.end());
+            words.push_back(palette.remap.size());
+            words.insert(words.end(), palette.remap.begin(), palette.remap.end());
+        }
+        words.insert(words.end(), {1, 0, 1, 0, 0, 1, 4});
+        std::ofstream(scratch, std::ios::binary | std::ios::trunc).write(reinterpret_cast<const char*>(words.data()),
+                                                                         words.size() * sizeof(uint64_t));
+        Place target(16, 16);
+        return target.load(scratch);
+    };
+    const std::vector<std::vector<PaletteEpoch>> bad{
+        {{0, 1, {}, {}}, {1, 1, {0, 1}, {}}},
+        {{1, 0, {}, {}}},
+        {{0, 0, {}, {}}, {1, 0, {0, 1}, {}}, {2, 0, {0}, {0, 1}}},
+        {{0, 0, {}, {}}, {1, 0, {0, 1}, {}}, {2, 0, {0, 1}, {0, 5}}},
+        {{0, 0, {}, {}}, {1, 0, {0, 1}, {}}, {3, 0, {0, 1}, {0, 1}}},
+    };
+    ok = ok && loads({{0, 0, {}, {}}, {1, 0, {0, 1}, {}}});
+    for (const std::vector<PaletteEpoch>& palettes : bad) {
+        ok = ok && !loads(palettes);
+    }
+    std::remove(scratch.c_str());
+    reportCheck("palettes in checkpoints", ok);
+}
+
+// A frozen archive answers like the Place did, and a damaged one doesn't open.
+static void checkFrozenArchive() {
+    std::string scratch = "/tmp/" + checkScratchName();
+    Place place(64, 64);
+    place.stamp({Pixel(1, 2, 3, 4), Pixel(5, 6, 7, 8), Pixel(1, 2, 9, 10)});
+    FrozenArchive archive;
+    PixelInfo info, then;
+    bool ok = place.freeze(scratch) && archive.open(scratch) && archive.getPixel(1, 2, info) &&
+              archive.getPixel(1, 2, then, 1) && info.color == 9 && info.userID == 10 && then.color == 3 &&
+              archive.getOwnedPixels(10) == 1 && archive.getOwnedPixels(4) == 0;
+    std::ifstream in(scratch, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::ofstream(scratch, std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size() / 2);
+    FrozenArchive truncated;
+    ok = ok && !truncated.open(scratch);
+    bytes[0] ^= 1;
+    std::ofstream(scratch, std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size());
+    FrozenArchive corrupt;
+    ok = ok && !corrupt.open(scratch);
+    std::remove(scratch.c_str());
+    reportCheck("frozen archive round trip, truncated and corrupt files", ok);
+}
+
+// An edge that drops packets still ends up with the same canvas, by NACKing what it missed.
+static void checkMulticastRepair() {
+    MulticastConfig config;
+    config.interfaceAddress = "127.0.0.1";
+    config.port = 42422;
+    Place place(64, 64);
+    MulticastPublisher publisher(place, config);
+    MulticastSubscriber subscriber(place.getCurrentState(), config);
+    subscriber.setSimulatedLoss(200);
+    if (!subscriber.start() || !publisher.start()) {
+        std::cout << "  multicast repair: skipped, no multicast on loopback" << std::endl;
+    } else {
+        // Enough datagrams that some are certain to be dropped.
+        for (uint64_t i = 0; i < 200; i++) {
+            std::vector<Pixel> pixels;
+            for (uint64_t j = 0; j < 64; j++) {
+                pixels.emplace_back((i * 7 + j) % 64, (i + j * 3) % 64, (i + j) % 16, i);
+            }
+            place.stamp(pixels);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto end = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (subscriber.getRecordNumber() < place.getRecordCount() && std::chrono::steady_clock::now() < end) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        publisher.stop();
+        subscriber.stop();
+        Snapshot core = place.getCurrentState();
+        Snapshot edge = subscriber.getState();
+        bool ok = edge.recordNumber == core.recordNumber && publisher.getNacksReceived() > 0;
+        for (uint64_t i = 0; i < 64 * 64 && ok; i++) {
+            ok = edge.getPixel(i % 64, i / 64).getColor() == core.getPixel(i % 64, i / 64).getColor() &&
+                 edge.getPixel(i % 64, i / 64).getUserID() == core.getPixel(i % 64, i / 64).getUserID();
+        }
+        reportCheck("multicast repair", ok);
+    }
+}
+
+// Whatever a NACK asks for, it gets back less than three times its own size, nothing if it isn't padded, and nothing if
+// it's from an address that isn't a listed subscriber.
+static void checkMulticastAmplification() {
+    // Bytes that come back for a NACK (of `nackSize`, for everything from record 0) sent from loopback, or -1 if
+    // there's no multicast on loopback.
+    auto repairBytes = [](const std::vector<std::string>& subscribers, size_t nackSize) -> ssize_t {
+        MulticastConfig config;
+        config.interfaceAddress = "127.0.0.1";
+        config.port = 42426;
+        config.subscribers = subscribers;
+        Place place(64, 64);
+        for (uint64_t i = 0; i < 20; i++) {
+            std::vector<Pixel> pixels;
+            for (uint64_t j = 0; j < 100; j++) {
+                pixels.emplace_back(j % 64, (i + j) % 64, 1, i);
+            }
+            place.stamp(pixels);
+        }
+        MulticastPublisher publisher(place, config);
+
+        // The publisher's address is wherever its heartbeats come from.
+        sockaddr_in group{};
+        group.sin_family = AF_INET;
+        group.sin_port = htons(config.port);
+        ip_mreq membership{};
+        int enable = 1;
+        timeval timeout{0, 200'000};
+        int groupFD = socket(AF_INET, SOCK_DGRAM, 0);
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in from{};
+        socklen_t fromLength = sizeof(from);
+        char datagram[65536];
+        bool joined = inet_pton(AF_INET, config.group.c_str(), &group.sin_addr) == 1 &&
+                      inet_pton(AF_INET, config.interfaceAddress.c_str(), &membership.imr_interface) == 1;
+        membership.imr_multiaddr = group.sin_addr;
+        joined = joined && setsockopt(groupFD, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == 0 &&
+                 bind(groupFD, reinterpret_cast<sockaddr*>(&group), sizeof(group)) == 0 &&
+                 setsockopt(groupFD, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == 0 &&
+                 setsockopt(groupFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+                 setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 && publisher.start() &&
+                 recvfrom(groupFD, datagram, sizeof(datagram), 0, reinterpret_cast<sockaddr*>(&from), &fromLength) > 0;
+        ssize_t total = -1;
+        if (joined) {
+            std::string nack;
+            appendUint64(nack, multicastNackMagic);
+            appendUint64(nack, 0);
+            appendUint64(nack, place.getRecordCount());
+            nack.resize(nackSize);
+            sendto(fd, nack.data(), nack.size(), 0, reinterpret_cast<const sockaddr*>(&from), sizeof(from));
+            total = 0;
+            for (ssize_t received; (received = recv(fd, datagram, sizeof(datagram), 0)) > 0; ) {
+                total += received;
+            }
+        }
+        publisher.stop();
+        ::close(groupFD);
+        ::close(fd);
+        return total;
+    };
+    ssize_t answered = repairBytes({}, multicastNackSize);
+    if (answered < 0) {
+        std::cout << "  multicast amplification: skipped, no multicast on loopback" << std::endl;
+        return;
+    }
+    bool ok = answered > 0 && answered < static_cast<ssize_t>(3 * multicastNackSize) &&
+              repairBytes({}, 3 * 8) == 0 && repairBytes({"127.0.0.2"}, multicastNackSize) == 0 &&
+              repairBytes({"127.0.0.1"}, multicastNackSize) == answered;
+    reportCheck("multicast amplification", ok);
+}
+
+static void runChecks() {
+    std::cout << "Checks:" << std::endl;
+    checkSharedExport();
+    checkRegionReads();
+    checkIngestionQueue();
+    checkSubmit();
+    checkAtomicStamps();
+    checkExpand();
+    checkCheckpoints();
+    checkRegionEndpoint();
+    checkWebSocketFrames();
+    checkSlowSubscriber();
+    checkDiffCache();
+    checkSnapshots();
+    checkReaderWriterLock();
+    checkHeldWrites();
+    checkTimerWheel();
+    checkRateLimiter();
+    checkRevert();
+    checkPalettes();
+    checkFrozenArchive();
+    checkMulticastRepair();
+    checkMulticastAmplification();
+}
+
+// Main is not really the right place to call this, but it's all conceptual so far.
+// Run with `rplace serve <port> [width height]` to serve a Place over HTTP, or `rplace bench` for the benchmarks, otherwise this runs
+// the trivial tests below.
+int main(int argc, char** argv) {
+    uint64_t width = argc >= 5 ? std::strtoull(argv[3], nullptr, 10) : 1000;
+    uint64_t height = argc >= 5 ? std::strtoull(argv[4], nullptr, 10) : 1000;
+    Place place(width, height);
+
+    if (argc >= 2 && std::string(argv[1]) == "bench") {
+        runBenchmarks();
+        return 0;
+    }
+
+    if (argc >= 3 && std::string(argv[1]) == "serve") {
+        FrontEnd frontEnd(place, static_cast<uint16_t>(std::atoi(argv[2])));
+        if (!frontEnd.start()) {
+            std::cout << "Couldn't listen on port " << argv[2] << std::endl;
+            return 1;
+        }
+        while (true) {
+            sleep(60);
+        }
+    }
 
     // Trivial testing.
     bool result = place.update(Pixel{0,0,0,0});
@@ -247,4 +7651,5 @@ int main() {
         }
     }
 
+    runChecks();
 }